@@ -41,9 +41,9 @@
 
 #define FIXED_NUM_CONFIGURATIONS 1 // we only have one USB device configuration
 
-//#define INTERRUPT_CONTROL_ENDPOINT // I used to think this would be required, because in the PS/2 code, when we send commands to the PS/2 keyboard we are stuck in that code until the keyboard has clocked the bits from us, which takes an arbitrary amount of time. However everything seems to work out fine without it, and since it isn't a common LUFA config I'll avoid it.
+//#define INTERRUPT_CONTROL_ENDPOINT // (also, latency.c uses USB_COM_vect, which LUFA would take over with this set) I used to think this would be required, because in the PS/2 code, when we send commands to the PS/2 keyboard we are stuck in that code until the keyboard has clocked the bits from us, which takes an arbitrary amount of time. However everything seems to work out fine without it, and since it isn't a common LUFA config I'll avoid it.
 
-#define NO_DEVICE_REMOTE_WAKEUP // for now I don't implement making the PS/2 keyboard wake up the PC. It might not be a great idea to ever do it given the power usage of these old keyboards at idle (~200 mA x 5V = 1 Watt)
+//#define NO_DEVICE_REMOTE_WAKEUP // a keystroke wakes the PC (see suspend_tick() in main.c), if the host enables it. the keyboard still draws its ~200 mA (~1 Watt) while the bus is suspended, more than USB allows, but there's no way to power it down and still hear the keystroke
 
 #define NO_DEVICE_SELF_POWER // we are always powered via the USB bus
 
@@ -0,0 +1,44 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <string.h>
+#include <avr/interrupt.h>
+#include "budget.h"
+
+struct budget budget;
+
+uint8_t budget_get_report(uint8_t* buf) {
+    struct budget_report* rep = (struct budget_report*)buf;
+    rep->budget_us = BUDGET_US;
+    uint8_t oldSREG = SREG;
+    cli();
+    for (uint8_t i=0; i<BUDGET_NUM; i++) {
+        rep->isr[i].max_us = budget.max[i];
+        rep->isr[i].over = budget.over[i];
+    }
+    SREG = oldSREG;
+    return sizeof(*rep);
+}
+
+void budget_clear(void) {
+    uint8_t oldSREG = SREG;
+    cli();
+    memset(&budget, 0, sizeof(budget));
+    SREG = oldSREG;
+}
@@ -0,0 +1,109 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// ISR budget measurement
+//
+// USART1_RX_vect can't run while another ISR has interrupts off, and the longer it waits the more likely
+// the PS/2 side goes wrong. So every ISR keeps the part it runs with interrupts off under BUDGET_US, and
+// lets anything slow run with interrupts on (see USART1_RX_vect). To prove it, each ISR notes now_us16() when it
+// starts and records how long it had interrupts off when it re-enables them or returns.
+// The host reads the worst case of each with a GET_REPORT(Feature) on the diagnostics interface (see diag.h)
+//
+// the times don't include the few cycles the CPU takes to get into the ISR and push registers before the first read.
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdint.h>
+#include "timebase.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUDGET_US 48 // the most any ISR may keep USART1_RX_vect waiting
+
+// the timed sections
+enum {
+    BUDGET_USART1_RX,  // USART1_RX_vect, unloading the UART
+    BUDGET_KEYS,       // the ps2_rx_hook it calls afterwards. that runs with interrupts on, so only its max_us is kept, and over stays 0
+    BUDGET_TIMER1,     // TIMER1_COMPA_vect and TIMER1_COMPB_vect, the alarms (see timebase.h)
+    BUDGET_TIMER3,     // TIMER3_COMPA_vect, the PS/2 transmitter
+    BUDGET_USB_COM,    // USB_COM_vect, the latency measurement's endpoint interrupt
+    BUDGET_SOF,        // EVENT_USB_Device_StartOfFrame(), inside LUFA's USB_GEN_vect. only the callback: the rest of that
+                       // ISR (and its suspend, wakeup and reset handling) is LUFA's, and isn't timed
+    BUDGET_CAPTURE,    // TIMER1_CAPT_vect and INT2_vect, while capturing the PS/2 signals (see capture.h)
+    BUDGET_MOUSE,      // INT0_vect, clocking the mouse's bits (see mouse.h)
+    BUDGET_KBD2,       // INT3_vect, clocking the second keyboard's bits (see ps2.h)
+    BUDGET_NUM
+};
+
+// the feature report, as the host sees it
+struct budget_report {
+    uint16_t budget_us; // BUDGET_US
+    struct {
+        uint16_t max_us; // the longest it ran with interrupts off
+        uint16_t over; // how many times that was more than BUDGET_US (saturates at 65535)
+    } isr[BUDGET_NUM];
+};
+
+struct budget {
+    uint16_t max[BUDGET_NUM]; // in usec
+    uint16_t over[BUDGET_NUM];
+};
+extern struct budget budget;
+
+// call first thing in the ISR
+static inline uint16_t budget_start(void) {
+    return now_us16();
+}
+
+// record that which ran for t usec
+static inline void budget_record(uint8_t which, uint16_t t) {
+    if (t > budget.max[which])
+        budget.max[which] = t;
+    if (t > BUDGET_US && which != BUDGET_KEYS && budget.over[which] != 0xffff)
+        budget.over[which]++;
+}
+
+// call when the ISR re-enables interrupts or returns, or, for BUDGET_KEYS, once USART1_RX_vect has turned them back
+// off after the hook. it is only ever called from inside ISRs with interrupts off, so it needs no cli() of its own
+static inline void budget_end(uint8_t which, uint16_t start) {
+    budget_record(which, now_us16() - start);
+}
+
+// the same for TIMER3_COMPA_vect, which runs every 10 usec while a byte goes to the keyboard. two calls to
+// now_us16() (and the registers they make it save) would take much of that, so it reads TCNT1 inline instead,
+// and only the difference is turned into usec
+static inline uint16_t budget_start_fast(void) {
+    return timebase_tcnt1();
+}
+
+static inline void budget_end_fast(uint8_t which, uint16_t start) {
+    budget_record(which, (uint16_t)(timebase_tcnt1() - start) >> 1);
+}
+
+uint8_t budget_get_report(uint8_t* buf); // fill in a struct budget_report; returns its size
+void budget_clear(void);
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
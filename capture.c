@@ -0,0 +1,180 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include "capture.h"
+#include "ps2.h"
+#include "budget.h"
+
+#define CAPTURE_EDGES 64 // the ring. must be a power of 2, and at most 128
+
+static struct capture_edge ring[CAPTURE_EDGES];
+static volatile uint8_t head, tail; // edges go in at ring[head % CAPTURE_EDGES] and are streamed from tail. head-tail is how many are waiting
+
+static volatile uint8_t capturing; // the ISRs are recording edges
+static uint8_t frames_left; // frames still to be started
+static uint8_t started; // the first frame has started. Clk edges before it belong to a frame we came in the middle of
+static uint8_t done_sent = 1; // the last stream report of the capture has gone out (or there hasn't been a capture)
+static uint32_t last_clk; // now_us() of the last Clk edge, to tell when a frame starts
+static uint32_t data_fell; // now_us() when Data last went low
+static uint8_t lost; // since the last stream report
+static uint16_t total_edges, total_lost;
+
+// the wires as CAPTURE_CLK and CAPTURE_DATA. Clk is read on the capture pin, since that's what ICP1 sees
+static uint8_t wires(void) {
+    uint8_t p = PIND;
+    return (p & _BV(CAPTURE_PIN) ? CAPTURE_CLK : 0) | (p & _BV(PS2_DATA_PIN) ? CAPTURE_DATA : 0);
+}
+
+static void stop(void) {
+    capturing = 0;
+    TIMSK1 &= ~_BV(ICIE1);
+    EIMSK &= ~_BV(INT2);
+}
+
+// called with interrupts off
+static void add(uint16_t time, uint8_t lines, uint8_t lag) {
+    if (total_edges != 0xffff)
+        total_edges++;
+    if ((uint8_t)(head - tail) == CAPTURE_EDGES) {
+        // the host isn't keeping up. drop the edge, and let it know
+        if (lost != 0xff)
+            lost++;
+        if (total_lost != 0xffff)
+            total_lost++;
+        return;
+    }
+    struct capture_edge* e = &ring[head & (CAPTURE_EDGES-1)];
+    e->time = time;
+    e->lines = lines;
+    e->lag = lag;
+    head++;
+}
+
+ISR(TIMER1_CAPT_vect) {
+    uint16_t start = budget_start();
+    uint16_t t = timebase_icr1();
+    uint8_t rose = TCCR1B & _BV(ICES1);
+    uint8_t w = wires();
+    uint32_t now = now_us();
+    uint16_t lag = (uint16_t)(now << 1) - t;
+    // capture the next change from the level Clk is at now. that is normally the opposite edge from this one,
+    // but if Clk has already gone back we have missed the edge which did it
+    if (w & CAPTURE_CLK)
+        TCCR1B &= ~_BV(ICES1);
+    else
+        TCCR1B |= _BV(ICES1);
+    TIFR1 = _BV(ICF1); // changing ICES1 can set ICF1
+    uint8_t lines = (w & CAPTURE_DATA) | (rose ? CAPTURE_CLK : 0);
+    if ((w ^ lines) & CAPTURE_CLK)
+        lines |= CAPTURE_MISSED;
+    if (!rose && now - last_clk >= CAPTURE_GAP_US && ((w & CAPTURE_DATA) || now - data_fell < CAPTURE_GAP_US)) {
+        // Clk going low after being still a while is the start of a frame, either the keyboard's start bit or us inhibiting
+        // the bus to send. but not when we've been holding Data low since well before; that's the keyboard finally starting
+        // to clock in the byte we're sending, which it can take a few hundred usec to get to
+        if (frames_left) {
+            frames_left--;
+            started = 1;
+            lines |= CAPTURE_FRAME;
+        } else {
+            stop(); // and that's all the frames that were asked for
+        }
+    }
+    last_clk = now;
+    if (capturing && started)
+        add(t, lines, lag > 255 ? 255 : lag);
+    budget_end(BUDGET_CAPTURE, start);
+}
+
+void capture_data_edge(void) {
+    uint16_t start = budget_start();
+    // Data edges are recorded even before the first frame, because the start bit's falling edge comes before its Clk edge
+    uint8_t w = wires();
+    if (!(w & CAPTURE_DATA))
+        data_fell = now_us();
+    add(now_ticks16(), CAPTURE_DATA_EDGE | w, 0);
+    budget_end(BUDGET_CAPTURE, start);
+}
+
+void capture_start(uint8_t frames) {
+    uint8_t oldSREG = SREG;
+    cli();
+    stop();
+    head = tail = 0;
+    lost = 0;
+    total_edges = total_lost = 0;
+    frames_left = frames;
+    started = 0;
+    done_sent = !frames;
+    if (frames) {
+        capturing = 1;
+        last_clk = data_fell = now_us();
+        if (wires() & CAPTURE_CLK)
+            TCCR1B &= ~(_BV(ICNC1) | _BV(ICES1)); // Clk is high, so the next edge is falling. and no noise canceller; we want to see the glitches
+        else
+            TCCR1B = (TCCR1B & ~_BV(ICNC1)) | _BV(ICES1);
+        TIFR1 = _BV(ICF1);
+        TIMSK1 |= _BV(ICIE1);
+        EICRA = (EICRA & ~_BV(ISC21)) | _BV(ISC20); // INT2 on both edges
+        EIFR = _BV(INTF2);
+        EIMSK |= _BV(INT2);
+    }
+    SREG = oldSREG;
+}
+
+uint8_t capture_running(void) {
+    return capturing;
+}
+
+uint8_t capture_get_status(uint8_t* buf) {
+    struct capture_status* st = (struct capture_status*)buf;
+    uint8_t oldSREG = SREG;
+    cli();
+    st->frames = frames_left;
+    st->running = capturing || !done_sent;
+    st->edges = total_edges;
+    st->lost = total_lost;
+    SREG = oldSREG;
+    return sizeof(*st);
+}
+
+uint8_t capture_get_stream_report(uint8_t* buf) {
+    struct capture_stream_report* rep = (struct capture_stream_report*)buf;
+    uint8_t oldSREG = SREG;
+    cli();
+    // the capture is over once the last frame has started and Clk has been idle (high) long enough that it must have finished
+    if (capturing && !frames_left && started && now_us() - last_clk >= CAPTURE_GAP_US && (wires() & CAPTURE_CLK))
+        stop();
+    uint8_t n = head - tail;
+    if (n > CAPTURE_STREAM_EDGES)
+        n = CAPTURE_STREAM_EDGES;
+    for (uint8_t i=0; i<n; i++)
+        rep->edges[i] = ring[(tail+i) & (CAPTURE_EDGES-1)];
+    tail += n;
+    uint8_t l = lost;
+    lost = 0;
+    uint8_t done = !capturing && !done_sent && head == tail;
+    if (done)
+        done_sent = 1;
+    SREG = oldSREG;
+    if (!n && !l && !done)
+        return 0;
+    rep->num = n | (done ? CAPTURE_STREAM_DONE : 0);
+    rep->lost = l;
+    return sizeof(*rep);
+}
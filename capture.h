@@ -0,0 +1,88 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// PS/2 signal capture
+//
+// timestamps every edge on the PS/2 wires for the next few frames, so tools/ps2timing can measure what the scope
+// measurements at the top of main.c were taken by hand: the Clk period, the Data setup and hold times, and any glitches.
+//
+// the PS/2 Clk pin (XCK1) has no input capture of its own, so this needs a jumper from Clk (PD5) to ICP1 (PD4).
+// Timer1's input capture unit then latches the time of each Clk edge in hardware, exactly, however late
+// TIMER1_CAPT_vect gets to run. Data edges come from INT2 (PD2, which is also RXD1), and are timestamped by its ISR,
+// so they are late by however long that took to start.
+//
+// the host starts a capture with a SET_REPORT(Feature) on the diagnostics interface, and the edges are streamed
+// to it as input reports on that interface's IN endpoint while the capture runs (see diag.h). they wait in a small
+// ring in RAM until then, so a capture can be any number of frames long
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAPTURE_PIN    PD4 // ICP1. jumper it to PS2_CLK_PIN
+#define CAPTURE_GAP_US 200 // a Clk falling edge after Clk has been still this long starts a frame. PS/2 half periods are 30 to 50 usec
+
+// lines in struct capture_edge
+#define CAPTURE_CLK       0x01 // the level of Clk after the edge
+#define CAPTURE_DATA      0x02 // the level of Data, as the ISR read it lag ticks after the edge
+#define CAPTURE_DATA_EDGE 0x04 // it was Data which changed (INT2), not Clk (ICP1)
+#define CAPTURE_MISSED    0x08 // Clk had changed back by the time the ISR ran, so the edge after this one wasn't captured
+#define CAPTURE_FRAME     0x10 // the first Clk edge of a frame
+
+struct capture_edge {
+    uint16_t time; // Timer1, in 0.5 usec ticks (wraps every 32 msec)
+    uint8_t lines; // CAPTURE_xxx
+    uint8_t lag; // ticks from the edge to the ISR reading the wires, up to 255. 0 for Data edges
+};
+
+// the feature report. SET_REPORT starts (or with frames = 0, stops) a capture of that many frames,
+// and GET_REPORT shows how it is going
+struct capture_status {
+    uint8_t frames; // frames still to be started. 0 once the last one has
+    uint8_t running; // non-zero until the capture is over and every edge has been streamed
+    uint16_t edges; // edges captured so far (saturates at 65535)
+    uint16_t lost; // edges lost because the ring was full (saturates at 65535)
+};
+
+// the streamed input report: the edges captured since the previous one
+#define CAPTURE_STREAM_EDGES 15 // as many as fit in a 64 byte packet along with the report ID
+#define CAPTURE_STREAM_DONE  0x80 // or'ed into num in the last report of the capture
+struct capture_stream_report {
+    uint8_t num; // how many of edges[] are valid, | CAPTURE_STREAM_DONE
+    uint8_t lost; // how many edges were lost because the ring was full (saturates at 255)
+    struct capture_edge edges[CAPTURE_STREAM_EDGES];
+};
+
+void capture_start(uint8_t frames); // stop any capture in progress, and start one of frames frames (if not 0)
+uint8_t capture_running(void); // true while edges are being captured. main() mustn't sleep in standby meanwhile
+void capture_data_edge(void); // called by INT2_vect while capture_running()
+
+uint8_t capture_get_status(uint8_t* buf); // fill in a struct capture_status; returns its size
+uint8_t capture_get_stream_report(uint8_t* buf); // fill in a struct capture_stream_report; returns 0 if there is nothing to send
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
@@ -44,6 +44,8 @@
 // the LUFA USB descriptor macros only work in C, so I have to split them out from the C++ code
 
 #include <LUFA/Drivers/USB/USB.h>
+#include "descriptors.h"
+#include "diag.h"
 
 static const USB_Descriptor_Device_t PROGMEM usb_device_desc = {
     .Header                 = {.Size = sizeof(USB_Descriptor_Device_t), .Type = DTYPE_Device},
@@ -116,6 +118,137 @@ static const USB_Descriptor_HIDReport_Datatype_t PROGMEM usb_report_desc[] = {
     HID_RI_END_COLLECTION(0),
 };
 
+// the N-key-rollover report. rather than an array of the keys which are down it is a bitmap of all of
+// them, so there is no limit to how many can be reported at once. the boot protocol can't do that, so
+// this lives on its own interface, which the BIOS ignores and which we use when the host is in report protocol
+static const USB_Descriptor_HIDReport_Datatype_t PROGMEM usb_nkro_report_desc[] = {
+    HID_RI_USAGE_PAGE(8, 1), // generic desktop controls
+    HID_RI_USAGE(8, 6), // keyboard
+    HID_RI_COLLECTION(8, 1), // application
+
+        HID_RI_USAGE_PAGE(8, 7), // key codes
+        HID_RI_LOGICAL_MINIMUM(8, 0),
+        HID_RI_LOGICAL_MAXIMUM(8, 1),
+        HID_RI_REPORT_SIZE(8, 1), // each key uses 1 bit
+
+        // the modifier keys, same as in the boot report
+        HID_RI_USAGE_MINIMUM(8, 0xe0),
+        HID_RI_USAGE_MAXIMUM(8, 0xe7),
+        HID_RI_REPORT_COUNT(8, 8),
+        HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // and all the other keys, one bit each. this is matrix[] in main.c, as-is
+        HID_RI_USAGE_MINIMUM(8, 0),
+        HID_RI_USAGE_MAXIMUM(8, 0xdf),
+        HID_RI_REPORT_COUNT(8, 0xe0),
+        HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+    HID_RI_END_COLLECTION(0),
+};
+
+// the mouse's report is the boot mouse's, buttons and X and Y, with the wheel after them. a BIOS only looks at the
+// first three bytes, and in boot protocol that's all we send
+static const USB_Descriptor_HIDReport_Datatype_t PROGMEM usb_mouse_report_desc[] = {
+    HID_RI_USAGE_PAGE(8, 1), // generic desktop controls
+    HID_RI_USAGE(8, 2), // mouse
+    HID_RI_COLLECTION(8, 1), // application
+        HID_RI_USAGE(8, 1), // pointer
+        HID_RI_COLLECTION(8, 0), // physical
+
+            // the 3 buttons a PS/2 mouse has, and padding out the byte
+            HID_RI_USAGE_PAGE(8, 9), // buttons
+            HID_RI_USAGE_MINIMUM(8, 1),
+            HID_RI_USAGE_MAXIMUM(8, 3),
+            HID_RI_LOGICAL_MINIMUM(8, 0),
+            HID_RI_LOGICAL_MAXIMUM(8, 1),
+            HID_RI_REPORT_COUNT(8, 3),
+            HID_RI_REPORT_SIZE(8, 1),
+            HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+            HID_RI_REPORT_COUNT(8, 1),
+            HID_RI_REPORT_SIZE(8, 8-3),
+            HID_RI_INPUT(8, HID_IOF_CONSTANT),
+
+            // the movement since the last report, and the wheel's
+            HID_RI_USAGE_PAGE(8, 1), // generic desktop controls
+            HID_RI_USAGE(8, 0x30), // X
+            HID_RI_USAGE(8, 0x31), // Y
+            HID_RI_USAGE(8, 0x38), // wheel
+            HID_RI_LOGICAL_MINIMUM(8, -127),
+            HID_RI_LOGICAL_MAXIMUM(8, 127),
+            HID_RI_REPORT_COUNT(8, 3),
+            HID_RI_REPORT_SIZE(8, 8),
+            HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_RELATIVE),
+
+        HID_RI_END_COLLECTION(0),
+    HID_RI_END_COLLECTION(0),
+};
+
+// the diagnostics interface's reports are all vendor defined. the host needs a tool which knows their layout (see diag.h)
+static const USB_Descriptor_HIDReport_Datatype_t PROGMEM usb_diag_report_desc[] = {
+    HID_RI_USAGE_PAGE(16, 0xFF00), // vendor defined
+    HID_RI_USAGE(8, 1),
+    HID_RI_COLLECTION(8, 1), // application
+
+        HID_RI_LOGICAL_MINIMUM(8, 0),
+        HID_RI_LOGICAL_MAXIMUM(16, 0xff),
+        HID_RI_REPORT_SIZE(8, 8), // everything is reported as an array of bytes
+
+        // the keystroke latency histograms
+        HID_RI_REPORT_ID(8, DIAG_REPORT_LATENCY),
+        HID_RI_USAGE(8, DIAG_REPORT_LATENCY),
+        HID_RI_REPORT_COUNT(8, sizeof(struct latency_report)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // the trace log (see trace.h)
+        HID_RI_REPORT_ID(8, DIAG_REPORT_TRACE),
+        HID_RI_USAGE(8, DIAG_REPORT_TRACE),
+        HID_RI_REPORT_COUNT(8, sizeof(struct trace_report)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // and the trace records as they happen
+        HID_RI_REPORT_ID(8, DIAG_REPORT_TRACE_STREAM),
+        HID_RI_USAGE(8, DIAG_REPORT_TRACE_STREAM),
+        HID_RI_REPORT_COUNT(8, sizeof(struct trace_stream_report)),
+        HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // the PS/2 link's error counters
+        HID_RI_REPORT_ID(8, DIAG_REPORT_LINK),
+        HID_RI_USAGE(8, DIAG_REPORT_LINK),
+        HID_RI_REPORT_COUNT(8, sizeof(struct ps2_counters)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // how long each ISR kept the UART receive interrupt waiting
+        HID_RI_REPORT_ID(8, DIAG_REPORT_ISR),
+        HID_RI_USAGE(8, DIAG_REPORT_ISR),
+        HID_RI_REPORT_COUNT(8, sizeof(struct budget_report)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // the PS/2 signal capture (see capture.h): starting it, and the edges it captures
+        HID_RI_REPORT_ID(8, DIAG_REPORT_CAPTURE),
+        HID_RI_USAGE(8, DIAG_REPORT_CAPTURE),
+        HID_RI_REPORT_COUNT(8, sizeof(struct capture_status)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+        HID_RI_REPORT_ID(8, DIAG_REPORT_CAPTURE_STREAM),
+        HID_RI_USAGE(8, DIAG_REPORT_CAPTURE_STREAM),
+        HID_RI_REPORT_COUNT(8, sizeof(struct capture_stream_report)),
+        HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // the key remapping in EEPROM (see remap.h). the report is a struct remap_request going out, and a
+        // (shorter) struct remap_status coming back
+        HID_RI_REPORT_ID(8, DIAG_REPORT_REMAP),
+        HID_RI_USAGE(8, DIAG_REPORT_REMAP),
+        HID_RI_REPORT_COUNT(8, sizeof(struct remap_request)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+        // typing for the host (see inject.h): a struct inject_request going out, and a struct inject_status coming back
+        HID_RI_REPORT_ID(8, DIAG_REPORT_INJECT),
+        HID_RI_USAGE(8, DIAG_REPORT_INJECT),
+        HID_RI_REPORT_COUNT(8, sizeof(struct inject_request)),
+        HID_RI_FEATURE(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+
+    HID_RI_END_COLLECTION(0),
+};
+
 static const struct {
     // Note the order of the pieces on the config desc match those of a commercial keyboard
     // and is what is specified by the USB HID spec for a Boot Protocol Keyboard's config descriptor
@@ -123,17 +256,26 @@ static const struct {
     USB_Descriptor_Interface_t            interface0;
     USB_HID_Descriptor_HID_t              hid_keyboard;
     USB_Descriptor_Endpoint_t             endpoint1;
+    USB_Descriptor_Interface_t            interface1;
+    USB_HID_Descriptor_HID_t              hid_diag;
+    USB_Descriptor_Endpoint_t             endpoint2;
+    USB_Descriptor_Interface_t            interface2;
+    USB_HID_Descriptor_HID_t              hid_nkro;
+    USB_Descriptor_Endpoint_t             endpoint3;
+    USB_Descriptor_Interface_t            interface3;
+    USB_HID_Descriptor_HID_t              hid_mouse;
+    USB_Descriptor_Endpoint_t             endpoint4;
 } PROGMEM usb_config_desc = {
     .config = {
             .Header                 = { .Size = sizeof(USB_Descriptor_Configuration_Header_t), .Type = DTYPE_Configuration },
 
             .TotalConfigurationSize = sizeof(usb_config_desc),
-            .TotalInterfaces        = 1,
+            .TotalInterfaces        = 4,
 
             .ConfigurationNumber    = 1,
             .ConfigurationStrIndex  = NO_DESCRIPTOR, // we only have one configuration, so no point in naming it
 
-            .ConfigAttributes       = USB_CONFIG_ATTR_RESERVED, // bit 7 must be set for backwards compat with USB 1.0
+            .ConfigAttributes       = USB_CONFIG_ATTR_RESERVED | USB_CONFIG_ATTR_REMOTEWAKEUP, // bit 7 must be set for backwards compat with USB 1.0. and a keystroke can wake the host
 
             .MaxPowerConsumption    = USB_CONFIG_POWER_MA(200), // it's a guess since my V-A meter doesn't measure more than 200mA in DC mode, but the Northgate keyboard uses 195 mA idle, and each 1908's-era green LED ought to use 10 to 20 mA. The ATmega32u4 uses nothing in comparison. Anyhow we don't want to guess too low here since a proper host will cut our power if we draw more than we said we would (not that all hosts do that, but some do and many ought to :-).
         },
@@ -141,7 +283,7 @@ static const struct {
     .interface0 = {
             .Header                 = { .Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface },
 
-            .InterfaceNumber        = 0, // interface number 0, our only interface
+            .InterfaceNumber        = KEYBOARD_INTERFACE, // interface number 0, the keyboard
             .AlternateSetting       = 0,
 
             .TotalEndpoints         = 1, // 1 IN. commercial keyboards don't have an OUT endpoint. they use the control endpoint for commands, and we will too
@@ -166,11 +308,114 @@ static const struct {
 
     .endpoint1 = {
             .Header                 = { .Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint },
-            .EndpointAddress        = ENDPOINT_DIR_IN | 1, // endpoint #1 (#0 is always the control endpoint)
+            .EndpointAddress        = KEYBOARD_IN_EPADDR, // endpoint #1 (#0 is always the control endpoint)
             .Attributes             = EP_TYPE_INTERRUPT | ENDPOINT_USAGE_DATA, // we are a plain interrupt endpoint
-            .EndpointSize           = 8, // we send 8-byte reports, like commercial keyboards do
+            .EndpointSize           = KEYBOARD_IN_EPSIZE, // we send 8-byte reports, like commercial keyboards do
             .PollingIntervalMS      = 2, // have the host poll us rapidly for keystrokes and our device has less keystroke latency. commercial keyboards usually have 10 msec polling intervals, but I think that is too much (plus PS/2 takes ~1msec to transfer a byte, and 1+2 bytes for key down+up, so in theory a fast ps/2 keyboard could send us keystrokes faster than USB would notice. not that that really happens (the ps/2 keyboards aren't running at wire rate and take leisurely pauses when sending))
-                                         // note that the higher the polling rate the more parity errors I see on the PS/2 bus. there must be some interrupt code in the USB side which is taking > 50 usec to run, but that's the price. Even with the typical [for a keyboard] 10msec polling I get a parity error once in a while when typing rapidly.
+                                         // host/pollsim puts numbers on it ('make pollsim'): at 2 msec typing reaches the host within 2 to 3 msec of its last PS/2 byte (1 on average) and chords of up to 6 keys within 5. at 10 msec it's 5 on average, and chords and bursts of quick taps wait in the key queue for up to 30 or 40 msec. 1 msec would save another half msec on average, less than one PS/2 byte takes
+                                         // note that the higher the polling rate the more parity errors I see on the PS/2 bus. there must be some interrupt code in the USB side which is taking > 50 usec to run, but that's the price. (diag report 5 now shows how long each ISR keeps the UART waiting; see budget.h) Even with the typical [for a keyboard] 10msec polling I get a parity error once in a while when typing rapidly.
+        },
+
+    .interface1 = {
+            .Header                 = { .Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface },
+
+            .InterfaceNumber        = DIAG_INTERFACE, // interface number 1, diagnostics
+            .AlternateSetting       = 0,
+
+            .TotalEndpoints         = 1, // HID requires an interrupt IN endpoint, even though everything so far goes over the control endpoint
+
+            .Class                  = HID_CSCP_HIDClass,
+            .SubClass               = HID_CSCP_NonBootSubclass, // the BIOS has no business with this interface
+            .Protocol               = HID_CSCP_NonBootProtocol,
+
+            .InterfaceStrIndex      = NO_DESCRIPTOR
+        },
+
+    .hid_diag =
+        {
+            .Header                 = { .Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID },
+
+            .HIDSpec                = VERSION_BCD(1,1,0),
+            .CountryCode            = 0, // not a keyboard, so no country
+            .TotalReportDescriptors = 1,
+            .HIDReportType          = HID_DTYPE_Report,
+            .HIDReportLength        = sizeof(usb_diag_report_desc)
+        },
+
+    .endpoint2 = {
+            .Header                 = { .Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint },
+            .EndpointAddress        = DIAG_IN_EPADDR, // endpoint #2
+            .Attributes             = EP_TYPE_INTERRUPT | ENDPOINT_USAGE_DATA,
+            .EndpointSize           = DIAG_IN_EPSIZE,
+            .PollingIntervalMS      = 1, // as often as possible, so the trace stream can keep up
+        },
+
+    .interface2 = {
+            .Header                 = { .Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface },
+
+            .InterfaceNumber        = NKRO_INTERFACE, // interface number 2, the N-key-rollover keyboard
+            .AlternateSetting       = 0,
+
+            .TotalEndpoints         = 1,
+
+            .Class                  = HID_CSCP_HIDClass,
+            .SubClass               = HID_CSCP_NonBootSubclass, // a bitmap report isn't something a BIOS can parse, so don't claim to be a boot keyboard
+            .Protocol               = HID_CSCP_NonBootProtocol,
+
+            .InterfaceStrIndex      = NO_DESCRIPTOR
+        },
+
+    .hid_nkro =
+        {
+            .Header                 = { .Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID },
+
+            .HIDSpec                = VERSION_BCD(1,1,0),
+            .CountryCode            = 33, // US, same as the boot keyboard
+            .TotalReportDescriptors = 1,
+            .HIDReportType          = HID_DTYPE_Report,
+            .HIDReportLength        = sizeof(usb_nkro_report_desc)
+        },
+
+    .endpoint3 = {
+            .Header                 = { .Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint },
+            .EndpointAddress        = NKRO_IN_EPADDR, // endpoint #3
+            .Attributes             = EP_TYPE_INTERRUPT | ENDPOINT_USAGE_DATA,
+            .EndpointSize           = NKRO_IN_EPSIZE, // the 29-byte report rounded up to a size the ATmega's endpoints come in
+            .PollingIntervalMS      = 2, // same as the boot keyboard. this is the one carrying keystrokes most of the time
+        },
+
+    .interface3 = {
+            .Header                 = { .Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface },
+
+            .InterfaceNumber        = MOUSE_INTERFACE, // interface number 3, the mouse
+            .AlternateSetting       = 0,
+
+            .TotalEndpoints         = 1,
+
+            .Class                  = HID_CSCP_HIDClass,
+            .SubClass               = HID_CSCP_BootSubclass, // the report starts out like the boot mouse's, so a BIOS can use it too
+            .Protocol               = HID_CSCP_MouseBootProtocol,
+
+            .InterfaceStrIndex      = NO_DESCRIPTOR
+        },
+
+    .hid_mouse =
+        {
+            .Header                 = { .Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID },
+
+            .HIDSpec                = VERSION_BCD(1,1,0),
+            .CountryCode            = 0, // not a keyboard
+            .TotalReportDescriptors = 1,
+            .HIDReportType          = HID_DTYPE_Report,
+            .HIDReportLength        = sizeof(usb_mouse_report_desc)
+        },
+
+    .endpoint4 = {
+            .Header                 = { .Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint },
+            .EndpointAddress        = MOUSE_IN_EPADDR, // endpoint #4
+            .Attributes             = EP_TYPE_INTERRUPT | ENDPOINT_USAGE_DATA,
+            .EndpointSize           = MOUSE_IN_EPSIZE,
+            .PollingIntervalMS      = 2, // the mouse sends 200 packets a second, so the host gets nearly every one on its own. and if it polls slower they're added up (see mouse.h)
         },
 };
 
@@ -215,12 +460,35 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t val, const uint8_t idx, const
             }
             break;
         case HID_DTYPE_HID:
-            d = &usb_config_desc.hid_keyboard;
-            s = sizeof(usb_config_desc.hid_keyboard);
+            // for HID descriptors idx is the interface number
+            if (idx == DIAG_INTERFACE) {
+                d = &usb_config_desc.hid_diag;
+                s = sizeof(usb_config_desc.hid_diag);
+            } else if (idx == NKRO_INTERFACE) {
+                d = &usb_config_desc.hid_nkro;
+                s = sizeof(usb_config_desc.hid_nkro);
+            } else if (idx == MOUSE_INTERFACE) {
+                d = &usb_config_desc.hid_mouse;
+                s = sizeof(usb_config_desc.hid_mouse);
+            } else {
+                d = &usb_config_desc.hid_keyboard;
+                s = sizeof(usb_config_desc.hid_keyboard);
+            }
             break;
         case HID_DTYPE_Report:
-            d = &usb_report_desc;
-            s = sizeof(usb_report_desc);
+            if (idx == DIAG_INTERFACE) {
+                d = &usb_diag_report_desc;
+                s = sizeof(usb_diag_report_desc);
+            } else if (idx == NKRO_INTERFACE) {
+                d = &usb_nkro_report_desc;
+                s = sizeof(usb_nkro_report_desc);
+            } else if (idx == MOUSE_INTERFACE) {
+                d = &usb_mouse_report_desc;
+                s = sizeof(usb_mouse_report_desc);
+            } else {
+                d = &usb_report_desc;
+                s = sizeof(usb_report_desc);
+            }
             break;
     }
     *desc = d;
@@ -0,0 +1,42 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// the interface and endpoint numbers which descriptors.c hands out, and which the class drivers in main.c must match
+// (the diagnostics interface's are in diag.h)
+
+#ifndef DESCRIPTORS_H
+#define DESCRIPTORS_H
+
+// the boot protocol keyboard
+#define KEYBOARD_INTERFACE   0
+#define KEYBOARD_IN_EPADDR   (ENDPOINT_DIR_IN | 1)
+#define KEYBOARD_IN_EPSIZE   8
+
+// the N-key-rollover keyboard, used instead of the boot keyboard when the host is in report protocol
+#define NKRO_INTERFACE       2
+#define NKRO_IN_EPADDR       (ENDPOINT_DIR_IN | 3)
+#define NKRO_IN_EPSIZE       32
+#define NKRO_REPORT_SIZE     (1 + 0xE0/8) // the modifier byte and a bitmap of keys 0x00-0xDF
+
+// the mouse passed through from the second PS/2 port (see mouse.h)
+#define MOUSE_INTERFACE      3
+#define MOUSE_IN_EPADDR      (ENDPOINT_DIR_IN | 4)
+#define MOUSE_IN_EPSIZE      8
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+#include "diag.h"
+
+USB_ClassInfo_HID_Device_t usb_hid_diag = {
+    .Config = {
+        .InterfaceNumber = DIAG_INTERFACE,
+        .ReportINEndpoint = {
+            .Address = DIAG_IN_EPADDR,
+            .Size = DIAG_IN_EPSIZE,
+            .Banks = 1,
+        },
+        // there is no previous IN report to compare against, but the HID class driver also sizes
+        // its GET_REPORT buffer from PrevReportINBufferSize, so it has to be as large as the largest feature report
+        .PrevReportINBuffer         = NULL,
+        .PrevReportINBufferSize     = DIAG_MAX_REPORT_SIZE,
+    },
+};
+
+void diag_configure(void) {
+    HID_Device_ConfigureEndpoints(&usb_hid_diag);
+}
+
+bool diag_create_report(uint8_t* const id, const uint8_t type, void* data, uint16_t* const len) {
+    *len = 0; // nothing to send unless asked for something we have
+    if (type == HID_REPORT_ITEM_In) {
+        // the input reports are the trace stream and the signal capture. send whichever has anything new,
+        // which can be once a frame, since nothing else shares the endpoint. the trace first, since it's rarely busy
+        *id = DIAG_REPORT_TRACE_STREAM;
+        *len = trace_get_stream_report(data);
+        if (!*len) {
+            *id = DIAG_REPORT_CAPTURE_STREAM;
+            *len = capture_get_stream_report(data);
+        }
+        return *len != 0;
+    } else if (type == HID_REPORT_ITEM_Feature) {
+        switch (*id) {
+            case DIAG_REPORT_LATENCY:
+                *len = latency_get_report(data);
+                break;
+            case DIAG_REPORT_TRACE:
+                *len = trace_get_report(data);
+                break;
+            case DIAG_REPORT_LINK:
+                *len = ps2_get_counters(data);
+                break;
+            case DIAG_REPORT_ISR:
+                *len = budget_get_report(data);
+                break;
+            case DIAG_REPORT_CAPTURE:
+                *len = capture_get_status(data);
+                break;
+            case DIAG_REPORT_REMAP:
+                *len = remap_get_status(data);
+                break;
+            case DIAG_REPORT_INJECT:
+                *len = inject_get_status(data);
+                break;
+        }
+    }
+    return false;
+}
+
+void diag_process_report(const uint8_t id, const uint8_t type, const void* data, const uint16_t len) {
+    if (type == HID_REPORT_ITEM_Feature) {
+        switch (id) {
+            case DIAG_REPORT_LATENCY:
+                latency_clear();
+                break;
+            case DIAG_REPORT_TRACE:
+                trace_clear();
+                trace_bytes = len && *(const uint8_t*)data;
+                break;
+            case DIAG_REPORT_LINK:
+                ps2_clear_counters();
+                break;
+            case DIAG_REPORT_ISR:
+                budget_clear();
+                break;
+            case DIAG_REPORT_CAPTURE:
+                capture_start(len ? ((const struct capture_status*)data)->frames : 0);
+                break;
+            case DIAG_REPORT_REMAP:
+                remap_request(data, len);
+                break;
+            case DIAG_REPORT_INJECT:
+                inject_request(data, len);
+                break;
+        }
+    }
+}
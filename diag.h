@@ -0,0 +1,81 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// the diagnostics interface
+//
+// a second, vendor-defined HID interface through which the host can read measurements out of
+// the adapter. it is separate from the keyboard interface because the keyboard has to stick to
+// the boot protocol's report format, which leaves no room for report IDs.
+// on linux the reports can be read from the interface's /dev/hidrawN with the HIDIOCGFEATURE ioctl, and
+// the input reports streamed on its IN endpoint with read()
+
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <LUFA/Drivers/USB/USB.h>
+#include "latency.h"
+#include "trace.h"
+#include "ps2.h"
+#include "budget.h"
+#include "capture.h"
+#include "remap.h"
+#include "inject.h"
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+#define DIAG_INTERFACE   1
+#define DIAG_IN_EPADDR   (ENDPOINT_DIR_IN | 2)
+#define DIAG_IN_EPSIZE   64 // the most a full speed interrupt endpoint can do
+
+// the report IDs of the diagnostics interface
+enum {
+    DIAG_REPORT_LATENCY = 1, // feature: struct latency_report. SET_REPORT of anything clears the histograms
+    DIAG_REPORT_TRACE = 2,   // feature: struct trace_report. SET_REPORT of anything clears the trace log, and
+                             // a non-zero first byte has every byte received from the keyboard traced from then on (0 or nothing stops it)
+    DIAG_REPORT_TRACE_STREAM = 3, // input: struct trace_stream_report, sent on the IN endpoint whenever there are new trace records
+    DIAG_REPORT_LINK = 4,    // feature: struct ps2_counters. SET_REPORT of anything clears them
+    DIAG_REPORT_ISR = 5,     // feature: struct budget_report. SET_REPORT of anything clears it
+    DIAG_REPORT_CAPTURE = 6, // feature: struct capture_status. SET_REPORT starts a capture of the PS/2 signals
+    DIAG_REPORT_CAPTURE_STREAM = 7, // input: struct capture_stream_report, sent on the IN endpoint while a capture runs
+    DIAG_REPORT_REMAP = 8,   // feature: SET_REPORT takes a struct remap_request, which uploads the key remapping to EEPROM.
+                             // GET_REPORT returns a struct remap_status
+    DIAG_REPORT_INJECT = 9,  // feature: SET_REPORT takes a struct inject_request, which queues keystrokes to type.
+                             // GET_REPORT returns a struct inject_status
+};
+
+// the largest of the reports
+#define DIAG_MAX(a,b) ((a) > (b) ? (a) : (b))
+#define DIAG_MAX_REPORT_SIZE DIAG_MAX(DIAG_MAX(sizeof(struct latency_report), sizeof(struct trace_report)), \
+                                      DIAG_MAX(DIAG_MAX(sizeof(struct trace_stream_report), sizeof(struct ps2_counters)), \
+                                               DIAG_MAX(DIAG_MAX(sizeof(struct budget_report), sizeof(struct capture_stream_report)), \
+                                                        DIAG_MAX(sizeof(struct remap_request), sizeof(struct inject_request)))))
+
+extern USB_ClassInfo_HID_Device_t usb_hid_diag;
+
+void diag_configure(void);
+bool diag_create_report(uint8_t* const id, const uint8_t type, void* data, uint16_t* const len);
+void diag_process_report(const uint8_t id, const uint8_t type, const void* data, const uint16_t len);
+
+#ifdef __cplusplus 
+} // end of extern "C"
+#endif
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// host (linux) stand-in for the parts of LUFA 140302 the firmware uses
+// The descriptor types and macros are copied closely enough that descriptors.c compiles unchanged.
+// The HID class driver is a model of LUFA's: HID_Device_USBTask() builds a report at most once per
+// USB frame, compares it with the previous one and queues it in the endpoint if it changed. The
+// "host" side of the bus is the harness calling host_usb_in() (see shim.h) whenever it polls.
+
+#ifndef HOST_LUFA_USB_H
+#define HOST_LUFA_USB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+
+#if defined(USE_LUFA_CONFIG_HEADER)
+#include "LUFAConfig.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ATTR_PACKED __attribute__((packed))
+
+#define CONCAT(x, y)          x ## y
+#define CONCAT_EXPANDED(x, y) CONCAT(x, y)
+
+//-------------------------------------------------------------------------
+// standard descriptors
+
+#define VERSION_BCD(Major, Minor, Revision) \
+    ((((Major) & 0xFF) << 8) | (((Minor) & 0x0F) << 4) | ((Revision) & 0x0F))
+
+#define NO_DESCRIPTOR        0
+#define LANGUAGE_ID_ENG      0x0409
+
+#define USB_CONFIG_POWER_MA(mA)       ((mA) >> 1)
+#define USB_CONFIG_ATTR_RESERVED      0x80
+#define USB_CONFIG_ATTR_SELFPOWERED   0x40
+#define USB_CONFIG_ATTR_REMOTEWAKEUP  0x20
+
+#define ENDPOINT_DIR_MASK     0x80
+#define ENDPOINT_DIR_OUT      0x00
+#define ENDPOINT_DIR_IN       0x80
+#define ENDPOINT_EPNUM_MASK   0x0F
+#define ENDPOINT_CONTROLEP    0
+
+#define EP_TYPE_CONTROL       0x00
+#define EP_TYPE_ISOCHRONOUS   0x01
+#define EP_TYPE_BULK          0x02
+#define EP_TYPE_INTERRUPT     0x03
+
+#define ENDPOINT_ATTR_NO_SYNC (0 << 2)
+#define ENDPOINT_USAGE_DATA   (0 << 4)
+
+#define USB_CSCP_NoDeviceClass     0x00
+#define USB_CSCP_NoDeviceSubclass  0x00
+#define USB_CSCP_NoDeviceProtocol  0x00
+#define USB_CSCP_VendorSpecificClass 0xFF
+
+enum USB_DescriptorTypes_t {
+    DTYPE_Device               = 0x01,
+    DTYPE_Configuration        = 0x02,
+    DTYPE_String               = 0x03,
+    DTYPE_Interface            = 0x04,
+    DTYPE_Endpoint             = 0x05,
+};
+
+typedef struct {
+    uint8_t Size;
+    uint8_t Type;
+} ATTR_PACKED USB_Descriptor_Header_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint16_t USBSpecification;
+    uint8_t  Class;
+    uint8_t  SubClass;
+    uint8_t  Protocol;
+    uint8_t  Endpoint0Size;
+    uint16_t VendorID;
+    uint16_t ProductID;
+    uint16_t ReleaseNumber;
+    uint8_t  ManufacturerStrIndex;
+    uint8_t  ProductStrIndex;
+    uint8_t  SerialNumStrIndex;
+    uint8_t  NumberOfConfigurations;
+} ATTR_PACKED USB_Descriptor_Device_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint16_t TotalConfigurationSize;
+    uint8_t  TotalInterfaces;
+    uint8_t  ConfigurationNumber;
+    uint8_t  ConfigurationStrIndex;
+    uint8_t  ConfigAttributes;
+    uint8_t  MaxPowerConsumption;
+} ATTR_PACKED USB_Descriptor_Configuration_Header_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint8_t InterfaceNumber;
+    uint8_t AlternateSetting;
+    uint8_t TotalEndpoints;
+    uint8_t Class;
+    uint8_t SubClass;
+    uint8_t Protocol;
+    uint8_t InterfaceStrIndex;
+} ATTR_PACKED USB_Descriptor_Interface_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint8_t  EndpointAddress;
+    uint8_t  Attributes;
+    uint16_t EndpointSize;
+    uint8_t  PollingIntervalMS;
+} ATTR_PACKED USB_Descriptor_Endpoint_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    wchar_t UnicodeString[];
+} ATTR_PACKED USB_Descriptor_String_t;
+
+#define USB_STRING_LEN(UnicodeChars) (sizeof(USB_Descriptor_Header_t) + ((UnicodeChars) << 1))
+
+#define USB_STRING_DESCRIPTOR(String) \
+    { .Header = {.Size = sizeof(USB_Descriptor_Header_t) + (sizeof(String) - sizeof(wchar_t)), .Type = DTYPE_String}, .UnicodeString = String }
+
+#define USB_STRING_DESCRIPTOR_ARRAY(...) \
+    { .Header = {.Size = sizeof(USB_Descriptor_Header_t) + sizeof((uint16_t[]){__VA_ARGS__}), .Type = DTYPE_String}, .UnicodeString = {__VA_ARGS__} }
+
+//-------------------------------------------------------------------------
+// HID class descriptors and report descriptor items
+
+#define HID_CSCP_HIDClass              0x03
+#define HID_CSCP_NonBootSubclass       0x00
+#define HID_CSCP_BootSubclass          0x01
+#define HID_CSCP_NonBootProtocol       0x00
+#define HID_CSCP_KeyboardBootProtocol  0x01
+#define HID_CSCP_MouseBootProtocol     0x02
+
+enum HID_Descriptor_ClassSubclassProtocol_t {
+    HID_DTYPE_HID    = 0x21,
+    HID_DTYPE_Report = 0x22,
+};
+
+enum HID_ReportItemTypes_t {
+    HID_REPORT_ITEM_In      = 0,
+    HID_REPORT_ITEM_Out     = 1,
+    HID_REPORT_ITEM_Feature = 2,
+};
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint16_t HIDSpec;
+    uint8_t  CountryCode;
+    uint8_t  TotalReportDescriptors;
+    uint8_t  HIDReportType;
+    uint16_t HIDReportLength;
+} ATTR_PACKED USB_HID_Descriptor_HID_t;
+
+typedef uint8_t USB_Descriptor_HIDReport_Datatype_t;
+
+#define HID_IOF_CONSTANT     (1 << 0)
+#define HID_IOF_DATA         (0 << 0)
+#define HID_IOF_VARIABLE     (1 << 1)
+#define HID_IOF_ARRAY        (0 << 1)
+#define HID_IOF_RELATIVE     (1 << 2)
+#define HID_IOF_ABSOLUTE     (0 << 2)
+#define HID_IOF_WRAP         (1 << 3)
+#define HID_IOF_NO_WRAP      (0 << 3)
+#define HID_IOF_NON_LINEAR   (1 << 4)
+#define HID_IOF_LINEAR       (0 << 4)
+#define HID_IOF_NO_PREFERRED_STATE (1 << 5)
+#define HID_IOF_PREFERRED_STATE    (0 << 5)
+#define HID_IOF_NULLSTATE    (1 << 6)
+#define HID_IOF_NO_NULL_POSITION   (0 << 6)
+#define HID_IOF_VOLATILE     (1 << 7)
+#define HID_IOF_NON_VOLATILE (0 << 7)
+#define HID_IOF_BUFFERED_BYTES (1 << 8)
+#define HID_IOF_BITFIELD     (0 << 8)
+
+#define HID_RI_TYPE_MAIN     0x00
+#define HID_RI_TYPE_GLOBAL   0x04
+#define HID_RI_TYPE_LOCAL    0x08
+
+#define HID_RI_DATA_BITS_0   0x00
+#define HID_RI_DATA_BITS_8   0x01
+#define HID_RI_DATA_BITS_16  0x02
+#define HID_RI_DATA_BITS_32  0x03
+#define HID_RI_DATA_BITS(DataBits) CONCAT_EXPANDED(HID_RI_DATA_BITS_, DataBits)
+
+#define _HID_RI_ENCODE_0(Data)
+#define _HID_RI_ENCODE_8(Data)  , (Data & 0xFF)
+#define _HID_RI_ENCODE_16(Data) _HID_RI_ENCODE_8(Data)  _HID_RI_ENCODE_8(Data >> 8)
+#define _HID_RI_ENCODE_32(Data) _HID_RI_ENCODE_16(Data) _HID_RI_ENCODE_16(Data >> 16)
+#define _HID_RI_ENCODE(DataBits, ...) CONCAT_EXPANDED(_HID_RI_ENCODE_, DataBits(__VA_ARGS__))
+
+#define _HID_RI_ENTRY(Type, Tag, DataBits, ...) \
+    (Type | Tag | HID_RI_DATA_BITS(DataBits)) _HID_RI_ENCODE(DataBits, (__VA_ARGS__))
+
+#define HID_RI_INPUT(DataBits, ...)            _HID_RI_ENTRY(HID_RI_TYPE_MAIN  , 0x80, DataBits, __VA_ARGS__)
+#define HID_RI_OUTPUT(DataBits, ...)           _HID_RI_ENTRY(HID_RI_TYPE_MAIN  , 0x90, DataBits, __VA_ARGS__)
+#define HID_RI_COLLECTION(DataBits, ...)       _HID_RI_ENTRY(HID_RI_TYPE_MAIN  , 0xA0, DataBits, __VA_ARGS__)
+#define HID_RI_FEATURE(DataBits, ...)          _HID_RI_ENTRY(HID_RI_TYPE_MAIN  , 0xB0, DataBits, __VA_ARGS__)
+#define HID_RI_END_COLLECTION(DataBits, ...)   _HID_RI_ENTRY(HID_RI_TYPE_MAIN  , 0xC0, DataBits, __VA_ARGS__)
+#define HID_RI_USAGE_PAGE(DataBits, ...)       _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x00, DataBits, __VA_ARGS__)
+#define HID_RI_LOGICAL_MINIMUM(DataBits, ...)  _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x10, DataBits, __VA_ARGS__)
+#define HID_RI_LOGICAL_MAXIMUM(DataBits, ...)  _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x20, DataBits, __VA_ARGS__)
+#define HID_RI_PHYSICAL_MINIMUM(DataBits, ...) _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x30, DataBits, __VA_ARGS__)
+#define HID_RI_PHYSICAL_MAXIMUM(DataBits, ...) _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x40, DataBits, __VA_ARGS__)
+#define HID_RI_UNIT_EXPONENT(DataBits, ...)    _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x50, DataBits, __VA_ARGS__)
+#define HID_RI_UNIT(DataBits, ...)             _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x60, DataBits, __VA_ARGS__)
+#define HID_RI_REPORT_SIZE(DataBits, ...)      _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x70, DataBits, __VA_ARGS__)
+#define HID_RI_REPORT_ID(DataBits, ...)        _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x80, DataBits, __VA_ARGS__)
+#define HID_RI_REPORT_COUNT(DataBits, ...)     _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0x90, DataBits, __VA_ARGS__)
+#define HID_RI_PUSH(DataBits, ...)             _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0xA0, DataBits, __VA_ARGS__)
+#define HID_RI_POP(DataBits, ...)              _HID_RI_ENTRY(HID_RI_TYPE_GLOBAL, 0xB0, DataBits, __VA_ARGS__)
+#define HID_RI_USAGE(DataBits, ...)            _HID_RI_ENTRY(HID_RI_TYPE_LOCAL , 0x00, DataBits, __VA_ARGS__)
+#define HID_RI_USAGE_MINIMUM(DataBits, ...)    _HID_RI_ENTRY(HID_RI_TYPE_LOCAL , 0x10, DataBits, __VA_ARGS__)
+#define HID_RI_USAGE_MAXIMUM(DataBits, ...)    _HID_RI_ENTRY(HID_RI_TYPE_LOCAL , 0x20, DataBits, __VA_ARGS__)
+
+//-------------------------------------------------------------------------
+// device state and the HID class driver
+
+enum USB_Device_States_t {
+    DEVICE_STATE_Unattached   = 0,
+    DEVICE_STATE_Powered      = 1,
+    DEVICE_STATE_Default      = 2,
+    DEVICE_STATE_Addressed    = 3,
+    DEVICE_STATE_Configured   = 4,
+    DEVICE_STATE_Suspended    = 5,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+typedef struct {
+    uint8_t  Address;
+    uint16_t Size;
+    uint8_t  Type;
+    uint8_t  Banks;
+} USB_Endpoint_Table_t;
+
+typedef struct {
+    struct {
+        uint8_t  InterfaceNumber;
+        USB_Endpoint_Table_t ReportINEndpoint;
+        void*    PrevReportINBuffer;
+        uint8_t  PrevReportINBufferSize;
+    } Config;
+    struct {
+        bool     UsingReportProtocol;
+        uint16_t PrevFrameNum;
+        uint16_t IdleCount;
+        uint16_t IdleMSRemaining;
+    } State;
+} USB_ClassInfo_HID_Device_t;
+
+uint8_t Endpoint_GetCurrentEndpoint(void);
+void Endpoint_SelectEndpoint(const uint8_t Address);
+bool Endpoint_IsINReady(void);
+bool Endpoint_IsReadWriteAllowed(void);
+uint8_t Endpoint_GetBusyBanks(void);
+void Endpoint_Write_8(const uint8_t Data);
+uint8_t Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed);
+void Endpoint_ClearIN(void);
+enum { ENDPOINT_RWSTREAM_NoError = 0 };
+
+void USB_Init(void);
+void USB_USBTask(void);
+void USB_Device_EnableSOFEvents(void);
+void USB_Device_DisableSOFEvents(void);
+uint16_t USB_Device_GetFrameNumber(void);
+extern bool USB_Device_RemoteWakeupEnabled;
+void USB_Device_SendRemoteWakeup(void);
+
+bool HID_Device_ConfigureEndpoints(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo);
+void HID_Device_ProcessControlRequest(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo);
+void HID_Device_USBTask(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo);
+void HID_Device_MillisecondElapsed(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo);
+
+// callbacks and events the application provides
+void EVENT_USB_Device_Connect(void);
+void EVENT_USB_Device_ConfigurationChanged(void);
+void EVENT_USB_Device_ControlRequest(void);
+void EVENT_USB_Device_StartOfFrame(void);
+void EVENT_USB_Device_Suspend(void);
+void EVENT_USB_Device_WakeUp(void);
+bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo, uint8_t* const ReportID,
+                                         const uint8_t ReportType, void* ReportData, uint16_t* const ReportSize);
+void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo, const uint8_t ReportID,
+                                          const uint8_t ReportType, const void* ReportData, const uint16_t ReportSize);
+uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue, const uint8_t wIndex, const void** const DescriptorAddress);
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
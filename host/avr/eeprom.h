@@ -0,0 +1,61 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// host (linux) stand-in for <avr/eeprom.h>. EEMEM variables are ordinary RAM, starting out zeroed rather than erased,
+// and a write keeps the EEPROM busy for 3.4 msec of simulated time, as on the real part
+
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+extern uint32_t host_now_us;
+extern uint32_t host_eeprom_ready_at; // host_now_us when the last write finishes
+extern unsigned host_eeprom_writes; // how many bytes have actually been written
+
+#define eeprom_is_ready() ((int32_t)(host_now_us - host_eeprom_ready_at) >= 0)
+
+static inline uint8_t eeprom_read_byte(const uint8_t* p) {
+    return *p;
+}
+
+static inline void eeprom_read_block(void* dst, const void* src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+void host_advance_us(uint32_t us);
+
+// like avr-libc's, these wait for the previous write to finish first
+static inline void eeprom_write_byte(uint8_t* p, uint8_t v) {
+    if (!eeprom_is_ready())
+        host_advance_us(host_eeprom_ready_at - host_now_us);
+    *p = v;
+    host_eeprom_ready_at = host_now_us + 3400;
+    host_eeprom_writes++;
+}
+
+static inline void eeprom_update_byte(uint8_t* p, uint8_t v) {
+    if (*p != v)
+        eeprom_write_byte(p, v);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// host (linux) stand-in for <avr/interrupt.h>
+// an ISR becomes a plain function which shim.c (or a test harness) calls when the "hardware" would
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+
+// there is only one thread on the host, so interrupts are always "enabled" and never preempt
+#define sei() do { } while (0)
+#define cli() do { } while (0)
+
+void USART1_RX_vect(void);
+void TIMER0_OVF_vect(void);
+void TIMER1_OVF_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_COMPB_vect(void);
+void TIMER1_CAPT_vect(void);
+void TIMER3_COMPA_vect(void);
+void USB_COM_vect(void);
+void INT2_vect(void);
+void INT0_vect(void);
+void INT3_vect(void);
+
+#endif
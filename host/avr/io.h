@@ -0,0 +1,150 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// host (linux) stand-in for <avr/io.h>
+// only the registers and bits the firmware actually touches are here. Most registers are plain
+// variables. The few whose reads have side effects on real hardware (UDR1 pops the rx fifo, PIND
+// and TCNT1 move with time) are function calls into shim.c
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t SREG;
+
+// USART1, which receives from the PS/2 keyboard
+extern volatile uint8_t UCSR1A, UCSR1B, UCSR1C;
+uint8_t host_read_UDR1(void);
+#define UDR1 host_read_UDR1()
+
+#define RXC1    7
+#define FE1     4
+#define DOR1    3
+#define UPE1    2
+#define RXCIE1  7
+#define RXEN1   4
+#define UCSZ12  2
+#define UMSEL10 6
+#define UPM11   5
+#define UPM10   4
+#define USBS1   3
+#define UCSZ10  1
+#define UCPOL1  0
+
+// port D, where the PS/2 Clk and Data wires are. PIND reads back the wires as driven by us and by the simulated keyboard and mouse
+extern volatile uint8_t PORTD, DDRD;
+uint8_t host_read_PIND(void);
+#define PIND host_read_PIND()
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+// the external interrupts. INT2 is on the PS/2 Data pin, and wakes us from sleep while the USB bus is suspended,
+// or timestamps the Data edges during a capture. INT0 is on the mouse's Clk pin, and clocks its bits (see mouse.h),
+// and INT3 is on the second keyboard's (see ps2.h)
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+
+#define ISC00 0
+#define ISC01 1
+#define INT0  0
+#define INTF0 0
+#define ISC20 4
+#define ISC21 5
+#define INT2  2
+#define INTF2 2
+#define ISC30 6
+#define ISC31 7
+#define INT3  3
+#define INTF3 3
+
+// port E, where the LED is
+extern volatile uint8_t PORTE, DDRE;
+
+// timer 0, which wakes the main loop every msec
+extern volatile uint8_t TCCR0A, TCCR0B, TIMSK0, TIFR0;
+
+#define CS00  0
+#define CS01  1
+#define CS02  2
+#define TOIE0 0
+#define TOV0  0
+
+// timer 1, the timebase. the shim only models it running free at /8, started at time 0, OCR1A/OCR1B's
+// compare interrupts, and input capture from PD4, which follows the PS/2 Clk wire as if it were jumpered to it.
+// TOV1 reads set once an overflow is due and until its ISR has run
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, OCR1B, ICR1;
+uint16_t host_read_TCNT1(void);
+#define TCNT1 host_read_TCNT1()
+
+#define CS10   0
+#define CS11   1
+#define CS12   2
+#define ICES1  6
+#define ICNC1  7
+#define TOIE1  0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1  5
+#define TOV1   0
+#define OCF1A  1
+#define OCF1B  2
+#define ICF1   5
+
+// timer 3, which paces the PS/2 transmitter. the shim only models CTC mode on OCR3A, and restarts
+// the count whenever the clock select or OCR3A changes
+extern volatile uint8_t TCCR3A, TCCR3B, TIMSK3, TIFR3;
+extern volatile uint16_t OCR3A, TCNT3;
+
+#define WGM32  3
+#define CS30   0
+#define CS31   1
+#define CS32   2
+#define OCIE3A 1
+#define OCF3A  1
+
+// USB endpoint registers. UEIENX and UEINTX are banked by UENUM like on the real part
+// (only TXINI is simulated in UEINTX)
+extern volatile uint8_t UENUM;
+volatile uint8_t* host_UEIENX(void);
+#define UEIENX (*host_UEIENX())
+volatile uint8_t* host_UEINTX(void);
+#define UEINTX (*host_UEINTX())
+
+#define TXINE 0
+#define TXINI 0
+
+#ifdef __cplusplus 
+} // end of extern "C"
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// host (linux) stand-in for <avr/sleep.h>. sleeping advances the simulated clock to the next interrupt
+
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE       0
+#define SLEEP_MODE_PWR_DOWN   2
+#define SLEEP_MODE_STANDBY    6
+
+#define set_sleep_mode(mode) do { } while (0)
+#define sleep_enable()       do { } while (0)
+#define sleep_disable()      do { } while (0)
+#define sleep_cpu()          host_sleep()
+
+void host_sleep(void);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// benchmark of the PS/2 scancode -> USB report hot path, run on the host
+//
+// main.c is #included so its static functions (update_matrix(), make_usb_report(), make_nkro_report(), main_tick(), keys_from_isr())
+// can be timed one at a time. The numbers are host nsec, not AVR cycles, but the ratios between
+// them, and between two versions of the code, are what we're after.
+//
+// usage: bench [iterations]
+
+#define main adapter_main
+#include "../main.c"
+#undef main
+
+#include <stdio.h>
+#include <time.h>
+#include "shim.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// scan code set 3 codes for "the quick brown fox jumps over the lazy dog"
+static const uint8_t text[] = {
+    0x2C, 0x33, 0x24, 0x29, 0x15, 0x3C, 0x43, 0x21, 0x42, 0x29, 0x32, 0x2D, 0x44, 0x1D, 0x31, 0x29,
+    0x2B, 0x44, 0x22, 0x29, 0x3B, 0x3C, 0x3A, 0x4D, 0x1B, 0x29, 0x44, 0x2A, 0x24, 0x2D, 0x29, 0x2C,
+    0x33, 0x24, 0x29, 0x4B, 0x1C, 0x1A, 0x35, 0x29, 0x23, 0x44, 0x34,
+};
+
+// the byte stream a fast typist produces: each key goes down before the previous one comes up,
+// and every 8th key is typed with the LEFT SHIFT held
+static uint8_t stream[sizeof(text)*8];
+static unsigned stream_len;
+
+static void build_stream(void) {
+    unsigned n = 0;
+    for (unsigned i=0; i<sizeof(text); i++) {
+        uint8_t shift = (i%8) == 0;
+        if (shift)
+            stream[n++] = 0x12;
+        stream[n++] = text[i];
+        if (i) {
+            stream[n++] = 0xf0;
+            stream[n++] = text[i-1];
+        }
+        if (shift) {
+            stream[n++] = 0xf0;
+            stream[n++] = 0x12;
+        }
+    }
+    stream[n++] = 0xf0;
+    stream[n++] = text[sizeof(text)-1];
+    stream_len = n;
+}
+
+static volatile uint32_t sink;
+
+static void bench_keycode(unsigned iterations) {
+    uint32_t s = 0;
+    double t0 = now_ns();
+    for (unsigned it=0; it<iterations; it++)
+        for (unsigned i=0; i<stream_len; i++)
+            s += ps2_to_usb_keycode(0, stream[i]);
+    double t1 = now_ns();
+    sink = s;
+    printf("ps2_to_usb_keycode     %8.2f ns/scancode\n", (t1-t0) / ((double)iterations*stream_len));
+}
+
+static void bench_matrix(unsigned iterations) {
+    // decode the stream once, then replay just the transitions
+    uint16_t mus[sizeof(stream)];
+    unsigned n = 0;
+    for (unsigned i=0; i<stream_len; i++) {
+        uint16_t mu = ps2_to_usb_keycode(0, stream[i]);
+        if (mu)
+            mus[n++] = mu;
+    }
+    memset(matrix, 0, sizeof(matrix));
+    rescan_keys_down();
+    double t0 = now_ns();
+    for (unsigned it=0; it<iterations; it++)
+        for (unsigned i=0; i<n; i++)
+            update_matrix(mus[i]);
+    double t1 = now_ns();
+    sink = matrix[0];
+    printf("update_matrix          %8.2f ns/transition\n", (t1-t0) / ((double)iterations*n));
+}
+
+static void bench_report(unsigned iterations) {
+    // time make_usb_report() with 0, 1, 2, 6 and 7 (rollover) keys down, plus a shift
+    // each report is rebuilt as if a key had just changed, which is the worst case; then time the unchanged case once
+    static const uint8_t down[] = { 0x04, 0x16, 0x2c, 0x28, 0x52, 0x3a, 0x63 };
+    static const uint8_t counts[] = { 0, 1, 2, 6, 7 };
+    uint8_t report[8];
+    uint32_t s = 0;
+    for (unsigned c=0; c<sizeof(counts); c++) {
+        memset(matrix, 0, sizeof(matrix));
+        for (unsigned i=0; i<counts[c]; i++)
+            matrix[down[i]>>3] |= 1 << (down[i]&7);
+        if (counts[c])
+            matrix[0xE1>>3] |= 1 << (0xE1&7);
+        rescan_keys_down();
+        double t0 = now_ns();
+        for (unsigned it=0; it<iterations*16; it++) {
+            usb_report_dirty = 1;
+            make_usb_report(report);
+            s += report[2];
+        }
+        double t1 = now_ns();
+        sink = s;
+        printf("make_usb_report        %8.2f ns/report (%u keys down)\n", (t1-t0) / ((double)iterations*16), counts[c]);
+    }
+    double t0 = now_ns();
+    for (unsigned it=0; it<iterations*16; it++) {
+        make_usb_report(report);
+        s += report[2];
+    }
+    double t1 = now_ns();
+    sink = s;
+    printf("make_usb_report        %8.2f ns/report (unchanged)\n", (t1-t0) / ((double)iterations*16));
+    // the NKRO report doesn't care how many keys are down
+    uint8_t nkro[NKRO_REPORT_SIZE];
+    t0 = now_ns();
+    for (unsigned it=0; it<iterations*16; it++) {
+        make_nkro_report(nkro);
+        s += nkro[1];
+    }
+    t1 = now_ns();
+    sink = s;
+    printf("make_nkro_report       %8.2f ns/report\n", (t1-t0) / ((double)iterations*16));
+    memset(matrix, 0, sizeof(matrix));
+    rescan_keys_down();
+}
+
+static void bench_pipeline(unsigned iterations) {
+    // the whole thing: each byte goes through USART1_RX_vect, main_tick() decodes it and
+    // HID_Device_USBTask() builds and queues a report, which the "host" polls out again.
+    // simulated time advances one PS/2 byte time (~1.1 msec) per byte so every byte gets its own USB frame
+    uint8_t buf[64];
+    unsigned reports = 0;
+    double spent = 0;
+    for (unsigned it=0; it<iterations; it++) {
+        for (unsigned i=0; i<stream_len; i++) {
+            host_advance_us(1100);
+            double t0 = now_ns();
+            host_ps2_rx(stream[i], 0);
+            main_tick();
+            spent += now_ns() - t0;
+            if (host_usb_in(1, buf) > 0)
+                reports++;
+        }
+    }
+    printf("pipeline               %8.2f ns/scancode\n", spent / ((double)iterations*stream_len));
+    printf("pipeline               %8.2f ns/report (%u reports for %u scancodes)\n",
+           spent / (reports ? reports : 1), reports/iterations, stream_len);
+}
+
+static void bench_isr_pipeline(unsigned iterations) {
+    // the same, but with the decode and the endpoint load done from USART1_RX_vect by keys_from_isr(), and main_tick() run
+    // afterwards only for whatever else it does (not timed)
+    uint8_t buf[64];
+    unsigned reports = 0;
+    double spent = 0;
+    ps2_rx_hook = keys_from_isr;
+    for (unsigned it=0; it<iterations; it++) {
+        for (unsigned i=0; i<stream_len; i++) {
+            host_advance_us(1100);
+            double t0 = now_ns();
+            host_ps2_rx(stream[i], 0);
+            spent += now_ns() - t0;
+            main_tick();
+            if (host_usb_in(1, buf) > 0)
+                reports++;
+        }
+    }
+    ps2_rx_hook = NULL;
+    printf("ISR pipeline           %8.2f ns/scancode\n", spent / ((double)iterations*stream_len));
+    printf("ISR pipeline           %8.2f ns/report (%u reports for %u scancodes)\n",
+           spent / (reports ? reports : 1), reports/iterations, stream_len);
+}
+
+int main(int argc, char** argv) {
+    unsigned iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+
+    build_stream();
+
+    timer0_init();
+    timebase_init();
+    ps2_init();
+    USB_Init();
+    host_usb_configure();
+    keycodes_select_set(0, 3);
+
+    bench_keycode(iterations);
+    bench_matrix(iterations);
+    bench_report(iterations);
+    bench_pipeline(iterations/20 ? iterations/20 : 1);
+    bench_isr_pipeline(iterations/20 ? iterations/20 : 1);
+
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// what the USB polling interval costs in keystroke latency, modeled on the host
+//
+// the keystrokes, synthetic or recorded, go through the firmware exactly as in replay.c, and a simulated host reads the
+// keyboard endpoint every 1, 2, 4, 8 or 10 msec. Each key transition the host sees is matched up with the PS/2 code
+// which caused it, and for each polling interval we print
+//   latency  from the arrival of the code's last byte to the host reading the report which has the transition in it
+//   merged   transitions which reached the host in the same report as another, so it can't tell which came first
+//   dropped  taps (a down and its up) which the host never saw at all
+// the key queue in main.c shouldn't drop anything unless 16 transitions pile up between two polls. It trades the
+// drops for latency instead, which is what the slower intervals show.
+//
+// the synthetic workloads are generated in scan code set 3 from a fixed seed, so runs compare. Traces recorded with
+// tools/tracedump -r (see tracefile.h) are added to them. Each workload is run at each interval in a process of its
+// own, because the firmware's state is all in globals, and as many of those run at once as there are cores.
+//
+// usage: pollsim [-s sec] [-j jobs] [trace.ps2 ...]
+//        -s  how long each synthetic workload types for (default 300 sec)
+//        -j  how many runs at once (the default is one per core)
+
+#define main adapter_main
+#include "../main.c"
+#undef main
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "shim.h"
+#include "tracefile.h"
+
+static const uint8_t intervals[] = { 1, 2, 4, 8, 10 }; // msec
+#define NUM_INTERVALS sizeof(intervals)
+
+#define BYTE_US 1100 // a PS/2 byte on the wire, 11 bits at a typical ~10 kHz clock
+#define SETTLE_US 50000 // the host has been polling a while before the first byte (see replay.c)
+#define DRAIN_US 100000
+
+//-------------------------------------------------------------------------
+// the synthetic workloads
+
+// the set 3 codes of the letter keys
+static uint8_t letters[32];
+static unsigned num_letters;
+
+static void find_letters(void) {
+    keycodes_select_set(0, 3);
+    for (unsigned pc=0x01; pc<0x80; pc++) {
+        uint8_t u = ps2_to_usb_keycode(0, pc);
+        if (u >= 0x04 && u <= 0x1d && num_letters < sizeof(letters))
+            letters[num_letters++] = pc;
+    }
+}
+
+// a key transition the keyboard is to send: the set 3 code goes down or up at time, or as soon after as the wire is free
+struct stroke {
+    uint64_t time;
+    uint8_t code;
+    uint8_t up;
+};
+
+static int by_time(const void* a, const void* b) {
+    const struct stroke* x = a;
+    const struct stroke* y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+static double uniform(double lo, double hi) {
+    return lo + (hi - lo) * (random() / (double)RAND_MAX);
+}
+
+// serialize the strokes into the bytes the keyboard puts on the wire, one after another
+static void strokes_to_trace(struct stroke* s, unsigned n, struct ps2_trace* tr) {
+    qsort(s, n, sizeof(*s), by_time);
+    ps2_trace_init(tr);
+    uint64_t wire = 0; // when the wire is free again
+    for (unsigned i=0; i<n; i++) {
+        uint64_t t = s[i].time > wire ? s[i].time : wire;
+        if (s[i].up) {
+            t += BYTE_US;
+            ps2_trace_add(tr, t, PS2_EV_BYTE, 0xf0);
+        }
+        t += BYTE_US;
+        ps2_trace_add(tr, t, PS2_EV_BYTE, s[i].code);
+        wire = t;
+    }
+}
+
+// a typist: a key goes down every interval, give or take, and is held for hold.
+// with a hold longer than the interval the keys roll over, the way fast typists' do
+static unsigned typing(struct stroke* s, unsigned max, uint64_t duration, double interval, double hold) {
+    unsigned n = 0;
+    uint64_t held_until[256] = { 0 };
+    for (uint64_t t = 0; t < duration && n+2 <= max; t += uniform(0.5, 1.5) * interval) {
+        uint8_t code;
+        do
+            code = letters[random() % num_letters];
+        while (held_until[code] > t); // (a key still down would have to come up first)
+        held_until[code] = t + uniform(0.7, 1.3) * hold;
+        s[n++] = (struct stroke){ t, code, 0 };
+        s[n++] = (struct stroke){ held_until[code], code, 1 };
+    }
+    return n;
+}
+
+// chords of 2 to 6 keys pressed within a few msec of each other, held a moment, and released the same way.
+// games and steno
+static unsigned chords(struct stroke* s, unsigned max, uint64_t duration) {
+    unsigned n = 0;
+    for (uint64_t t = 0; t < duration && n+12 <= max; t += uniform(150000, 400000)) {
+        unsigned keys = 2 + random() % 5;
+        uint64_t release = t + uniform(30000, 80000);
+        uint8_t used[6];
+        for (unsigned k=0; k<keys; k++) {
+            uint8_t code;
+            unsigned dup;
+            do {
+                code = letters[random() % num_letters];
+                dup = 0;
+                for (unsigned j=0; j<k; j++)
+                    dup |= used[j] == code;
+            } while (dup);
+            used[k] = code;
+            s[n++] = (struct stroke){ t + uniform(0, 8000), code, 0 };
+            s[n++] = (struct stroke){ release + uniform(0, 8000), code, 1 };
+        }
+    }
+    return n;
+}
+
+struct workload {
+    const char* name;
+    struct ps2_trace trace;
+};
+
+static struct workload* workloads;
+static unsigned num_workloads;
+
+static struct workload* new_workload(const char* name) {
+    workloads = realloc(workloads, (num_workloads+1) * sizeof(*workloads));
+    struct workload* w = &workloads[num_workloads++];
+    w->name = name;
+    ps2_trace_init(&w->trace);
+    return w;
+}
+
+static void make_workloads(uint64_t duration) {
+    find_letters();
+    unsigned max = duration / 1000; // more than enough strokes
+    struct stroke* s = malloc(max * sizeof(*s));
+    srandom(19);
+    strokes_to_trace(s, typing(s, max, duration, 150000, 100000), &new_workload("typing, 80 wpm")->trace);
+    strokes_to_trace(s, typing(s, max, duration, 75000, 90000), &new_workload("fast typing, 160 wpm, rolling over")->trace);
+    strokes_to_trace(s, typing(s, max, duration, 60000, 12000), &new_workload("quick taps, 12 msec each")->trace);
+    strokes_to_trace(s, typing(s, max, duration, 20000, 4000), &new_workload("a burst of 4 msec taps")->trace);
+    strokes_to_trace(s, chords(s, max, duration), &new_workload("chords of 2 to 6 keys")->trace);
+    free(s);
+}
+
+//-------------------------------------------------------------------------
+// a run: one workload at one polling interval
+
+// what a run sends back to main() down the pipe, in one write
+struct result {
+    uint16_t workload;
+    uint8_t interval;
+    uint32_t transitions; // that the keyboard sent
+    uint32_t seen; // that the host saw
+    uint32_t merged;
+    uint32_t dropped; // taps
+    uint32_t min, p50, p90, p99, max; // latency, usec
+    double mean;
+};
+
+// a transition as the keyboard sent it
+struct truth {
+    uint64_t time; // when the code's last byte arrived
+    uint8_t u; // USB key code
+    uint8_t up;
+};
+
+static struct truth* truths;
+static unsigned num_truths;
+static unsigned* next_truth; // per key code, the index in truths[] of its oldest transition the host hasn't seen yet
+static uint32_t* latencies;
+static unsigned num_latencies;
+static unsigned merged, orphans;
+
+// find_truths()'s decoding, which needs the simulated clock to run along with the trace for the tap-hold deadlines
+static uint32_t truths_start; // host_now_us at the start of the trace
+static uint64_t truths_now; // and the time in it
+static uint8_t truths_down[32];
+
+static void truths_clock(uint64_t t) {
+    host_advance_us(truths_start + (uint32_t)t - host_now_us);
+    truths_now = t;
+}
+
+// layers.c's queue, for the decoding
+static void add_truth(uint16_t mu, uint16_t rx) {
+    uint8_t u = mu, up = mu>>8;
+    if (!u || ((truths_down[u>>3] >> (u&7)) & 1) != up)
+        return; // not a key, or a typematic repeat
+    truths_down[u>>3] ^= 1 << (u&7);
+    truths[num_truths++] = (struct truth){ truths_now, u, up };
+}
+
+// decode the trace the way the firmware will, layers and all, to know which key transitions are in it, and when.
+// a tap-hold key's transitions are from when it was decided: its tap, the next key, or the main loop tick after its
+// deadline
+static void find_truths(const struct ps2_trace* tr) {
+    truths = malloc((2*tr->num + 1) * sizeof(*truths)); // a tap is two transitions from one byte
+    truths_start = host_now_us;
+    uint64_t tick = 0;
+    for (unsigned i=0; i<tr->num; i++) {
+        const struct ps2_event* ev = &tr->events[i];
+        if (ev->kind != PS2_EV_BYTE)
+            continue;
+        for (; tick < ev->time; tick += 1000) {
+            if (layers_waiting()) {
+                truths_clock(tick);
+                layers_tick(add_truth);
+            }
+        }
+        truths_clock(ev->time);
+        layers_key(ps2_to_usb_keycode(0, ev->value), now_us16(), add_truth);
+    }
+    for (; layers_waiting(); tick += 1000) {
+        truths_clock(tick);
+        layers_tick(add_truth);
+    }
+    layers_reset();
+}
+
+// the oldest transition of key u which the host hasn't seen, or NULL
+static struct truth* oldest(uint8_t u) {
+    for (unsigned i = next_truth[u]; i<num_truths; i++)
+        if (truths[i].u == u) {
+            next_truth[u] = i;
+            return &truths[i];
+        }
+    next_truth[u] = num_truths;
+    return NULL;
+}
+
+// the host read a report at time now (from the start of the trace) which changed the keys in changed[] to the state in state[]
+// each change is the oldest transition of that key the host hasn't seen. (the queue in main.c keeps them in order, so
+// unless it overflowed that is right. if it did, the transitions it folded away are left over at the end as dropped)
+static void host_saw(const uint8_t* state, const uint8_t* changed, uint64_t now) {
+    unsigned n = 0;
+    for (unsigned u=0; u<256; u++) {
+        if (!((changed[u>>3] >> (u&7)) & 1))
+            continue;
+        struct truth* t = oldest(u);
+        uint8_t up = !((state[u>>3] >> (u&7)) & 1);
+        if (!t || t->up != up || t->time > now) {
+            orphans++; // the host saw a transition the keyboard never sent
+            continue;
+        }
+        latencies[num_latencies++] = now - t->time;
+        next_truth[u]++;
+        n++;
+    }
+    if (n > 1)
+        merged += n-1;
+}
+
+// the keys held down as the host understands them, in the layout of matrix[]
+static uint8_t host_keys[32];
+
+static void host_poll(uint8_t report_protocol, uint64_t now) {
+    uint8_t buf[64], state[32];
+    if (report_protocol) {
+        if (host_usb_in(NKRO_IN_EPADDR & ENDPOINT_EPNUM_MASK, buf) != NKRO_REPORT_SIZE)
+            return;
+        memcpy(state, buf+1, 0xE0/8);
+        state[0xE0/8] = buf[0];
+        memset(state + 0xE0/8 + 1, 0, sizeof(state) - 0xE0/8 - 1);
+    } else {
+        if (host_usb_in(KEYBOARD_IN_EPADDR & ENDPOINT_EPNUM_MASK, buf) != 8 || buf[2] == 0x01)
+            return; // nothing, or rollover: the host keeps the keys it had
+        memset(state, 0, sizeof(state));
+        state[0xE0/8] = buf[0];
+        for (unsigned i=2; i<8; i++)
+            if (buf[i])
+                state[buf[i]>>3] |= 1 << (buf[i]&7);
+    }
+    uint8_t changed[32], any = 0;
+    for (unsigned i=0; i<sizeof(state); i++)
+        any |= changed[i] = state[i] ^ host_keys[i];
+    if (any)
+        host_saw(state, changed, now);
+    memcpy(host_keys, state, sizeof(state));
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const struct workload* w, unsigned wi, uint8_t interval, int fd) {
+    const struct ps2_trace* tr = &w->trace;
+    timer0_init();
+    timebase_init();
+    ps2_init();
+    USB_Init();
+    host_usb_configure();
+    sei();
+
+    keycodes_select_set(0, tr->set);
+    find_truths(tr);
+    next_truth = calloc(256, sizeof(*next_truth));
+    latencies = malloc((num_truths+1) * sizeof(*latencies));
+    host_hid_set_idle(KEYBOARD_INTERFACE, 0);
+    host_hid_set_idle(NKRO_INTERFACE, 0);
+    host_hid_set_protocol(KEYBOARD_INTERFACE, tr->report_protocol);
+    if (DECODE_IN_ISR)
+        ps2_rx_hook = keys_from_isr;
+
+    // the main loop wakes every msec, and the host polls every interval msec, on a frame boundary.
+    // times here are from the start of the trace, which is SETTLE_US into the simulated clock
+    uint32_t start = host_now_us + SETTLE_US;
+    int64_t tick = -SETTLE_US, poll = -SETTLE_US;
+    uint64_t end = (tr->num ? tr->events[tr->num-1].time : 0) + DRAIN_US;
+    unsigned i = 0;
+    int64_t now = -SETTLE_US;
+    while (now < (int64_t)end) {
+        int64_t next = tick < poll ? tick : poll;
+        if (i < tr->num && (int64_t)tr->events[i].time < next)
+            next = tr->events[i].time;
+        host_advance_us(start + (uint32_t)next - host_now_us);
+        now = next;
+        while (i < tr->num && (int64_t)tr->events[i].time == now) {
+            const struct ps2_event* ev = &tr->events[i++];
+            if (ev->kind == PS2_EV_BYTE)
+                host_ps2_rx(ev->value, 0);
+            else
+                host_hid_set_report(KEYBOARD_INTERFACE, 0, HID_REPORT_ITEM_Out, &ev->value, 1);
+        }
+        if (now == tick) {
+            main_tick();
+            tick += 1000;
+        }
+        if (now == poll) {
+            host_poll(tr->report_protocol, now < 0 ? 0 : now);
+            host_usb_in(DIAG_IN_EPADDR & ENDPOINT_EPNUM_MASK, (uint8_t[64]){0});
+            poll += interval * 1000;
+        }
+    }
+
+    struct result r = { .workload = wi, .interval = interval, .transitions = num_truths, .seen = num_latencies, .merged = merged };
+    // anything still unseen is dropped, in pairs: the host's view of each key ends up where the keyboard's did
+    unsigned unseen = num_truths - num_latencies;
+    r.dropped = unseen / 2;
+    if (num_latencies) {
+        double sum = 0;
+        for (unsigned k=0; k<num_latencies; k++)
+            sum += latencies[k];
+        qsort(latencies, num_latencies, sizeof(*latencies), cmp_u32);
+        r.min = latencies[0];
+        r.p50 = latencies[num_latencies/2];
+        r.p90 = latencies[(uint64_t)num_latencies*90/100];
+        r.p99 = latencies[(uint64_t)num_latencies*99/100];
+        r.max = latencies[num_latencies-1];
+        r.mean = sum / num_latencies;
+    }
+    if (orphans)
+        fprintf(stderr, "%s at %u msec: the host saw %u transitions the keyboard didn't send\n", w->name, interval, orphans);
+    if (write(fd, &r, sizeof(r)) != sizeof(r))
+        perror("write");
+}
+
+//-------------------------------------------------------------------------
+
+static int by_run(const void* a, const void* b) {
+    const struct result* x = a;
+    const struct result* y = b;
+    return x->workload != y->workload ? x->workload - y->workload : x->interval - y->interval;
+}
+
+int main(int argc, char** argv) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = 300;
+    int c;
+    while ((c = getopt(argc, argv, "s:j:")) != -1) {
+        switch (c) {
+            case 's': seconds = atof(optarg); break;
+            case 'j': jobs = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s sec] [-j jobs] [trace.ps2 ...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (jobs < 1)
+        jobs = 1;
+    make_workloads(seconds * 1e6);
+    for (int i=optind; i<argc; i++) {
+        struct workload* w = new_workload(argv[i]);
+        if (ps2_trace_load(&w->trace, argv[i], stderr) < 0)
+            return 2;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return 2;
+    }
+    unsigned total = num_workloads * NUM_INTERVALS, started = 0, running = 0, failed = 0;
+    while (started < total || running) {
+        if (started < total && running < jobs) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 2;
+            }
+            if (!pid) {
+                run(&workloads[started / NUM_INTERVALS], started / NUM_INTERVALS, intervals[started % NUM_INTERVALS], fds[1]);
+                _exit(0);
+            }
+            started++;
+            running++;
+            continue;
+        }
+        int st;
+        if (wait(&st) < 0)
+            break;
+        running--;
+        if (!WIFEXITED(st) || WEXITSTATUS(st))
+            failed++;
+    }
+    close(fds[1]);
+
+    struct result* results = calloc(total, sizeof(*results));
+    unsigned n = 0;
+    while (n < total && read(fds[0], &results[n], sizeof(*results)) == sizeof(*results))
+        n++;
+    qsort(results, n, sizeof(*results), by_run);
+
+    printf("latency from the last PS/2 byte to the host reading the report, in msec\n");
+    for (unsigned k=0; k<n; k++) {
+        const struct result* r = &results[k];
+        if (!k || r->workload != results[k-1].workload) {
+            const struct ps2_trace* tr = &workloads[r->workload].trace;
+            printf("\n%s: %u transitions in %.0f sec\n", workloads[r->workload].name, r->transitions,
+                   tr->num ? tr->events[tr->num-1].time * 1e-6 : 0.0);
+            printf("  poll    min    p50    p90    p99    max   mean   merged  dropped taps\n");
+        }
+        printf("  %2u ms %6.2f %6.2f %6.2f %6.2f %6.2f %6.2f %8u %8u\n", r->interval,
+               r->min * 1e-3, r->p50 * 1e-3, r->p90 * 1e-3, r->p99 * 1e-3, r->max * 1e-3, r->mean * 1e-3, r->merged, r->dropped);
+    }
+    if (failed || n != total) {
+        fprintf(stderr, "%u of the %u runs failed\n", total - n, total);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// replay recorded PS/2 byte streams through the firmware, and compare the USB reports it sends with golden files
+//
+// each byte goes in through USART1_RX_vect at the time it was recorded, and from there through ps2_to_usb_keycode(),
+// the matrix and the report queue, exactly as on the ATmega32u4, while a simulated host polls the keyboard endpoints
+// every 2 msec like a real one. The reports the host reads, in order, are the result. They aren't timestamped, so a
+// change which only moves a report by a poll or two doesn't upset the golden files; the latency histograms and the
+// bench are for that. A keymap or decoder change which changes what the host sees does.
+//
+// the traces are normally recorded off a real keyboard with tools/tracedump -r. the format is in tracefile.h.
+//
+// each trace is replayed by a process of its own, because the firmware's state is all in globals, so a corpus of them
+// is spread over all the cores.
+//
+// usage: replay [-u] [-p] [-j jobs] trace.ps2 ...
+//          compares the reports from each trace.ps2 with trace.golden
+//        -u  writes the .golden files instead (check the diff before committing them!)
+//        -p  prints the reports instead
+//        -j  replays that many traces at once (the default is one per core)
+
+#define main adapter_main
+#include "../main.c"
+#undef main
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "shim.h"
+#include "tracefile.h"
+
+#define POLL_US 2000 // the keyboard endpoints' polling interval (see descriptors.c)
+#define SETTLE_US 50000 // how long the host has been polling before the first byte. on a real one, since enumeration
+#define DRAIN_US 100000 // how long to run on after the last byte, for its reports to go out
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned reports;
+
+// what the host read from the endpoint, if anything, goes on a line of out
+static void poll_endpoint(uint8_t ep, const char* label, FILE* out) {
+    uint8_t buf[64];
+    int n = host_usb_in(ep, buf);
+    if (n <= 0)
+        return;
+    fputs(label, out);
+    for (int i=0; i<n; i++)
+        fprintf(out, " %02x", buf[i]);
+    fputc('\n', out);
+    reports++;
+}
+
+// run the firmware's main loop, and the host's polling, until simulated time t
+static uint32_t next_tick, next_poll;
+
+static void run_until(uint32_t t, uint8_t report_protocol, FILE* out) {
+    while ((int32_t)(host_now_us - t) < 0) {
+        uint32_t next = next_tick;
+        if ((int32_t)(next_poll - next) < 0)
+            next = next_poll;
+        if ((int32_t)(t - next) < 0)
+            next = t;
+        host_advance_us(next - host_now_us);
+        if (host_now_us == next_tick) {
+            main_tick(); // which Timer0 wakes every msec
+            next_tick += 1000;
+        }
+        if (host_now_us == next_poll) {
+            poll_endpoint(KEYBOARD_IN_EPADDR & ENDPOINT_EPNUM_MASK, "boot", out);
+            if (report_protocol)
+                poll_endpoint(NKRO_IN_EPADDR & ENDPOINT_EPNUM_MASK, "nkro", out);
+            host_usb_in(DIAG_IN_EPADDR & ENDPOINT_EPNUM_MASK, (uint8_t[64]){0}); // nobody is listening to the trace stream
+            next_poll += POLL_US;
+        }
+    }
+}
+
+// replay the trace, writing the reports the host reads to out. returns the simulated time it took
+static uint64_t replay(const struct ps2_trace* tr, FILE* out) {
+    timer0_init();
+    timebase_init();
+    ps2_init();
+    USB_Init();
+    host_usb_configure();
+    sei();
+    host_hid_set_idle(KEYBOARD_INTERFACE, 0);
+    host_hid_set_idle(NKRO_INTERFACE, 0);
+    host_hid_set_protocol(KEYBOARD_INTERFACE, tr->report_protocol);
+    keycodes_select_set(0, tr->set);
+    if (DECODE_IN_ISR)
+        ps2_rx_hook = keys_from_isr;
+
+    next_tick = next_poll = host_now_us;
+    uint32_t start = host_now_us + SETTLE_US;
+    for (unsigned i=0; i<tr->num; i++) {
+        const struct ps2_event* ev = &tr->events[i];
+        run_until(start + (uint32_t)ev->time, tr->report_protocol, out); // (the simulated clock wraps, like now_us())
+        if (ev->kind == PS2_EV_BYTE)
+            host_ps2_rx(ev->value, 0);
+        else
+            host_hid_set_report(KEYBOARD_INTERFACE, 0, HID_REPORT_ITEM_Out, &ev->value, 1);
+    }
+    uint64_t end = tr->num ? tr->events[tr->num-1].time : 0;
+    run_until(start + (uint32_t)end + DRAIN_US, tr->report_protocol, out);
+    return end;
+}
+
+// the golden file which goes with trace file name
+static char* golden_name(const char* name) {
+    size_t n = strlen(name);
+    if (n > 4 && !strcmp(name + n - 4, ".ps2"))
+        n -= 4;
+    char* g = malloc(n + sizeof(".golden"));
+    memcpy(g, name, n);
+    strcpy(g + n, ".golden");
+    return g;
+}
+
+// compare the reports with the golden file. returns 0 if they match, or describes the first difference in msg and returns 1
+static int compare(const char* golden, const char* got, FILE* msg) {
+    FILE* f = fopen(golden, "r");
+    if (!f) {
+        fprintf(msg, "  %s: %s (make it with replay -u)\n", golden, strerror(errno));
+        return 1;
+    }
+    char want[256];
+    unsigned lineno = 0;
+    const char* g = got;
+    int differ = 0;
+    while (!differ) {
+        lineno++;
+        const char* w = fgets(want, sizeof(want), f);
+        size_t glen = strcspn(g, "\n");
+        if (!w && !*g)
+            break;
+        differ = !w || !*g || strlen(w) != glen + 1 || memcmp(w, g, glen + 1);
+        if (differ) {
+            fprintf(msg, "  report %u differs from %s\n", lineno, golden);
+            fprintf(msg, "    want: %s", w ? w : "(no more)\n");
+            fprintf(msg, "    got:  %.*s\n", *g ? (int)glen : 9, *g ? g : "(no more)");
+        }
+        g += glen + (g[glen] == '\n');
+    }
+    fclose(f);
+    return differ;
+}
+
+// replay one trace and say how it went, in one write so the lines from the processes running at once don't mix.
+// the simulated time goes down times_fd, for main() to add up
+enum { CHECK, UPDATE, PRINT };
+static int times_fd;
+
+static int run_one(const char* name, int mode) {
+    char* msg = NULL;
+    size_t msg_len = 0;
+    FILE* m = open_memstream(&msg, &msg_len);
+    struct ps2_trace tr;
+    int status = 2;
+    if (ps2_trace_load(&tr, name, m) == 0) {
+        char* got = NULL;
+        size_t got_len = 0;
+        FILE* out = mode == PRINT ? stdout : open_memstream(&got, &got_len);
+        double t0 = now_sec();
+        uint64_t us = replay(&tr, out);
+        double wall = now_sec() - t0;
+        if (write(times_fd, &us, sizeof(us)) != sizeof(us))
+            perror("write");
+        char* golden = golden_name(name);
+        char* diff = NULL;
+        size_t diff_len = 0;
+        FILE* d = open_memstream(&diff, &diff_len);
+        status = 0;
+        if (mode == PRINT) {
+            fflush(stdout);
+        } else {
+            fclose(out);
+            if (mode == CHECK) {
+                status = compare(golden, got, d);
+            } else {
+                FILE* g = fopen(golden, "w");
+                if (!g || fwrite(got, 1, got_len, g) != got_len || fclose(g)) {
+                    fprintf(d, "  %s: %s\n", golden, strerror(errno));
+                    status = 2;
+                }
+            }
+        }
+        fclose(d);
+        fprintf(m, "%-5s %s: %u bytes, %.1f sec of typing, %u reports, replayed in %.3f sec\n%s",
+                status ? "FAIL" : mode == UPDATE ? "wrote" : "ok", name, tr.num, us * 1e-6, reports, wall, diff);
+        free(diff);
+        free(got);
+        free(golden);
+        ps2_trace_free(&tr);
+    }
+    fclose(m);
+    fwrite(msg, 1, msg_len, stdout);
+    fflush(stdout);
+    free(msg);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    int mode = CHECK;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+    while ((c = getopt(argc, argv, "upj:")) != -1) {
+        switch (c) {
+            case 'u': mode = UPDATE; break;
+            case 'p': mode = PRINT; break;
+            case 'j': jobs = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-u] [-p] [-j jobs] trace.ps2 ...\n", argv[0]);
+                return 2;
+        }
+    }
+    if (jobs < 1 || mode == PRINT)
+        jobs = 1;
+    if (optind == argc) {
+        fprintf(stderr, "%s: no traces to replay\n", argv[0]);
+        return 2;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return 2;
+    }
+    times_fd = fds[1];
+    int total = argc - optind, started = 0, running = 0, failed = 0;
+    double t0 = now_sec();
+    while (started < total || running) {
+        if (started < total && running < jobs) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 2;
+            }
+            if (!pid)
+                _exit(run_one(argv[optind + started], mode));
+            started++;
+            running++;
+            continue;
+        }
+        int st;
+        if (wait(&st) < 0)
+            break;
+        running--;
+        if (!WIFEXITED(st) || WEXITSTATUS(st))
+            failed++;
+    }
+    double wall = now_sec() - t0;
+    close(fds[1]);
+    double typing = 0;
+    uint64_t us;
+    while (read(fds[0], &us, sizeof(us)) == sizeof(us))
+        typing += us * 1e-6;
+    if (mode != PRINT)
+        printf("%d traces, %d failed: %.1f sec of typing replayed in %.2f sec on %ld cores, %.0f times real time\n",
+               total, failed, typing, wall, jobs, wall > 0 ? typing / wall : 0);
+    return failed != 0;
+}
@@ -0,0 +1,907 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// host (linux) implementation of the AVR registers and the LUFA calls the firmware makes
+// see shim.h for the calls a harness uses to drive it
+
+#include <LUFA/Drivers/USB/USB.h>
+#include "shim.h"
+
+//-------------------------------------------------------------------------
+// registers
+
+volatile uint8_t SREG;
+volatile uint8_t UCSR1A, UCSR1B, UCSR1C;
+volatile uint8_t PORTD, DDRD;
+volatile uint8_t PORTE, DDRE;
+volatile uint8_t TCCR0A, TCCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, OCR1B, ICR1;
+volatile uint8_t EICRA, EIMSK, EIFR;
+volatile uint8_t TCCR3A, TCCR3B, TIMSK3, TIFR3;
+volatile uint16_t OCR3A, TCNT3;
+volatile uint8_t UENUM;
+
+#define CLK _BV(PD5)
+#define DATA _BV(PD2)
+#define MCLK _BV(PD0) // the mouse's
+#define MDATA _BV(PD1)
+#define KCLK2 _BV(PD3) // the second keyboard's
+#define KDATA2 _BV(PD7)
+
+//-------------------------------------------------------------------------
+// the simulated keyboard
+
+static void kbd_poll(void);
+static void kbd_event(void);
+
+static uint8_t kbd_drive; // CLK and/or DATA when the keyboard is pulling that wire low
+
+enum { KBD_IDLE, KBD_RX_LOW, KBD_RX_HIGH, KBD_ACK_LOW, KBD_ACK_HIGH };
+static uint8_t kbd_state;
+static uint8_t kbd_bit;
+static uint16_t kbd_bits; // what we clocked in; data, parity and stop bits
+
+static struct {
+    uint8_t c;
+    uint32_t when;
+} kbd_tx[64];
+static unsigned kbd_tx_len;
+
+uint8_t host_kbd_log[256];
+unsigned host_kbd_log_len;
+
+void host_kbd_send(uint8_t c, uint32_t delay_us) {
+    if (kbd_tx_len < sizeof(kbd_tx)/sizeof(kbd_tx[0])) {
+        kbd_tx[kbd_tx_len].c = c;
+        kbd_tx[kbd_tx_len].when = host_now_us + delay_us;
+        kbd_tx_len++;
+    }
+}
+
+void host_kbd_ack(uint8_t c) {
+    if (host_kbd_log_len < sizeof(host_kbd_log))
+        host_kbd_log[host_kbd_log_len++] = c;
+    host_kbd_send(0xFA, 1000);
+}
+
+void (*host_kbd_command)(uint8_t c) = host_kbd_ack;
+
+//-------------------------------------------------------------------------
+// the devices on the bit-banged ports (see ps2soft.h): the mouse and the second keyboard. unlike the first keyboard
+// they clock their bytes out bit by bit, since the firmware receives them through INTn_vect and not a UART
+
+enum { DEV_IDLE, DEV_TX_LOW, DEV_TX_HIGH, DEV_RX_LOW, DEV_RX_HIGH, DEV_ACK_LOW, DEV_ACK_HIGH };
+
+struct soft_dev {
+    uint8_t clk, data; // its wires
+    void (*command)(uint8_t c); // what it does with a byte the firmware sends it
+    uint8_t plugged;
+    uint8_t drive; // clk and/or data when it is pulling that wire low
+    uint8_t state;
+    uint8_t bit;
+    uint16_t bits; // clocking out: the frame, from the start bit on. clocking in: data, parity and stop
+    struct {
+        uint8_t c;
+        uint32_t when;
+    } tx[64];
+    unsigned tx_len;
+    uint32_t next; // when event() is next due
+    uint8_t pending; // next is valid
+};
+
+static void dev_poll(struct soft_dev* d);
+static void dev_event(struct soft_dev* d);
+
+static void dev_send(struct soft_dev* d, uint8_t c, uint32_t delay_us) {
+    if (d->tx_len < sizeof(d->tx)/sizeof(d->tx[0])) {
+        d->tx[d->tx_len].c = c;
+        d->tx[d->tx_len].when = host_now_us + delay_us;
+        d->tx_len++;
+    }
+}
+
+//-------------------------------------------------------------------------
+// the simulated mouse
+
+static void mouse_command(uint8_t c);
+static struct soft_dev mouse = { MCLK, MDATA, mouse_command };
+
+static uint8_t mouse_has_wheel, mouse_wheel_on;
+static uint8_t mouse_rate_next; // the next byte is F3's argument
+static uint8_t mouse_rates[3]; // the last three sample rates set, for the IntelliMouse knock
+uint8_t host_mouse_streaming;
+uint8_t host_mouse_log[256];
+unsigned host_mouse_log_len;
+
+static void mouse_send(uint8_t c, uint32_t delay_us) {
+    dev_send(&mouse, c, delay_us);
+}
+
+static void mouse_command(uint8_t c) {
+    if (host_mouse_log_len < sizeof(host_mouse_log))
+        host_mouse_log[host_mouse_log_len++] = c;
+    mouse.tx_len = 0; // a command throws away whatever the mouse had yet to send
+    mouse_send(0xFA, 500);
+    if (mouse_rate_next) {
+        mouse_rate_next = 0;
+        mouse_rates[0] = mouse_rates[1];
+        mouse_rates[1] = mouse_rates[2];
+        mouse_rates[2] = c;
+        if (mouse_has_wheel && mouse_rates[0] == 200 && mouse_rates[1] == 100 && mouse_rates[2] == 80)
+            mouse_wheel_on = 1;
+        return;
+    }
+    switch (c) {
+      case 0xFF:
+        host_mouse_streaming = mouse_wheel_on = 0;
+        mouse_send(0xAA, 500000); // the self test
+        mouse_send(0x00, 0);
+        break;
+      case 0xF3: mouse_rate_next = 1; break;
+      case 0xF2: mouse_send(mouse_wheel_on ? 0x03 : 0x00, 0); break;
+      case 0xF4: host_mouse_streaming = 1; break;
+      case 0xF5: host_mouse_streaming = 0; break;
+    }
+}
+
+void host_mouse_plug(uint8_t wheel) {
+    mouse.plugged = 1;
+    mouse_has_wheel = wheel;
+    mouse_wheel_on = host_mouse_streaming = 0;
+    mouse.tx_len = 0;
+    mouse_send(0xAA, 500000);
+    mouse_send(0x00, 0);
+}
+
+void host_mouse_move(uint8_t buttons, int dx, int dy, int wheel) {
+    if (!host_mouse_streaming)
+        return;
+    dy = -dy; // PS/2 counts up as positive
+    mouse_send(0x08 | (buttons & 7) | (dx < 0 ? 0x10 : 0) | (dy < 0 ? 0x20 : 0), 0);
+    mouse_send(dx, 0);
+    mouse_send(dy, 0);
+    if (mouse_wheel_on)
+        mouse_send(-wheel, 0);
+}
+
+
+//-------------------------------------------------------------------------
+// the simulated second keyboard
+
+static void kbd2_command(uint8_t c);
+static struct soft_dev kbd2 = { KCLK2, KDATA2, kbd2_command };
+
+static uint8_t kbd2_set3_ok;
+static uint8_t kbd2_arg; // the command whose argument the next byte is, or 0
+static uint8_t kbd2_last; // the last byte it sent, for FE
+uint8_t host_kbd2_set = 2;
+uint8_t host_kbd2_leds;
+uint8_t host_kbd2_log[256];
+unsigned host_kbd2_log_len;
+
+void host_kbd2_send(uint8_t c, uint32_t delay_us) {
+    dev_send(&kbd2, c, delay_us);
+}
+
+static void kbd2_command(uint8_t c) {
+    if (host_kbd2_log_len < sizeof(host_kbd2_log))
+        host_kbd2_log[host_kbd2_log_len++] = c;
+    if (c == 0xFE) {
+        host_kbd2_send(kbd2_last, 500);
+        return;
+    }
+    host_kbd2_send(0xFA, 500);
+    uint8_t cmd = kbd2_arg;
+    kbd2_arg = 0;
+    if (cmd == 0xF0) {
+        if (c == 0)
+            host_kbd2_send(host_kbd2_set, 0);
+        else if (c == 2 || (c == 3 && kbd2_set3_ok))
+            host_kbd2_set = c; // (and like some real ones, it ACKs set 3 without going into it unless set3_ok)
+        return;
+    }
+    if (cmd == 0xED) {
+        host_kbd2_leds = c;
+        return;
+    }
+    switch (c) {
+      case 0xF0: case 0xED: kbd2_arg = c; break;
+      case 0xFF:
+        kbd2.tx_len = 0;
+        host_kbd2_set = 2;
+        host_kbd2_send(0xFA, 500);
+        host_kbd2_send(0xAA, 500000);
+        break;
+    }
+}
+
+void host_kbd2_plug(uint8_t set3_ok) {
+    kbd2.plugged = 1;
+    kbd2_set3_ok = set3_ok;
+    kbd2_arg = 0;
+    host_kbd2_set = 2;
+    kbd2.tx_len = 0;
+    host_kbd2_send(0xAA, 500000);
+}
+
+void host_kbd2_unplug(void) {
+    kbd2.plugged = 0;
+    kbd2.tx_len = 0;
+    kbd2.drive = 0;
+    kbd2.state = DEV_IDLE;
+    kbd2.pending = 0;
+}
+
+// the wires, as pulled low by either end, or pulled up. PD4 is jumpered to Clk, for input capture
+static uint8_t lines(void) {
+    uint8_t l = ~((DDRD & ~PORTD) | kbd_drive | mouse.drive | kbd2.drive);
+    return l & CLK ? l | _BV(PD4) : l & ~_BV(PD4);
+}
+
+//-------------------------------------------------------------------------
+// the simulated clock
+
+uint32_t host_now_us;
+uint32_t host_eeprom_ready_at;
+unsigned host_eeprom_writes;
+static uint32_t next_timer0_ovf = 1024; // timer0 at /64 overflows every 256*64 cycles = 1024 usec
+static uint32_t next_timer3;
+static uint8_t timer3_running;
+static uint8_t timer3_cs;
+static uint16_t timer3_ocr;
+static uint32_t next_timer1_ovf = 32768; // timer1 at /8 overflows every 65536/2 usec
+static uint32_t next_cmp[2]; // when TCNT1 next matches OCR1A and OCR1B
+static uint8_t cmp_enabled[2];
+static uint16_t cmp_ocr[2];
+static uint32_t next_sof = 1000;
+static uint8_t sof_enabled;
+static uint32_t next_kbd;
+static uint8_t kbd_pending; // next_kbd is valid
+static uint8_t in_isr; // interrupts don't nest, so time passing inside an ISR doesn't fire any others
+static uint8_t prev_lines = 0xff; // as of the last wires_poll()
+static uint8_t wires_played; // the harness drove Data itself for the byte host_ps2_rx() is about to deliver
+
+#define DUE(t) ((int32_t)((t) - host_now_us) <= 0)
+#define EARLIER(a,b) ((int32_t)((a) - (b)) < 0)
+
+static uint32_t timer3_period_us(void) {
+    static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    uint32_t us = ((uint32_t)OCR3A + 1) * prescale[TCCR3B & 7] / (F_CPU/1000000);
+    return us ? us : 1;
+}
+
+// notice the firmware (re)starting or stopping Timer3
+// TCNT3 isn't simulated; it's left at 1 after each poll, so the firmware writing 0 to it shows up as a restart
+static void timer3_poll(void) {
+    uint8_t running = (TCCR3B & 7) && (TIMSK3 & _BV(OCIE3A));
+    if (running && (!timer3_running || timer3_cs != (TCCR3B & 7) || timer3_ocr != OCR3A || TCNT3 == 0))
+        next_timer3 = host_now_us + timer3_period_us();
+    timer3_running = running;
+    timer3_cs = TCCR3B & 7;
+    timer3_ocr = OCR3A;
+    TCNT3 = 1;
+}
+
+static uint8_t timer1_running(void) {
+    return (TCCR1B & 7) == _BV(CS11);
+}
+
+// notice the firmware setting up a compare match. like the real part, it matches once per trip around the counter
+static void timer1_poll(void) {
+    volatile uint16_t* ocr[2] = { &OCR1A, &OCR1B };
+    for (uint8_t i=0; i<2; i++) {
+        uint8_t enabled = timer1_running() && (TIMSK1 & _BV(OCIE1A+i));
+        if (enabled && (!cmp_enabled[i] || cmp_ocr[i] != *ocr[i])) {
+            uint16_t delta = *ocr[i] - (uint16_t)(host_now_us*2); // in ticks
+            next_cmp[i] = host_now_us + (delta ? (delta+1)/2 : 32768);
+        }
+        cmp_enabled[i] = enabled;
+        cmp_ocr[i] = *ocr[i];
+    }
+}
+
+// notice the wires changing, and run TIMER1_CAPT_vect and INT2_vect for the edges they are set up to catch.
+// an edge made by the firmware writing DDRD or PORTD is only seen at the next step(), or PIND read
+static void wires_poll(void) {
+    if (in_isr)
+        return; // it'll be noticed once the ISR returns
+    uint8_t l = lines();
+    uint8_t changed = l ^ prev_lines;
+    prev_lines = l;
+    if (!changed)
+        return;
+    in_isr = 1;
+    if ((changed & CLK) && timer1_running() && !(l & CLK) == !(TCCR1B & _BV(ICES1))) {
+        ICR1 = (uint16_t)(host_now_us*2);
+        if (TIMSK1 & _BV(ICIE1))
+            TIMER1_CAPT_vect();
+        else
+            TIFR1 |= _BV(ICF1);
+    }
+    if ((changed & MCLK) && !(l & MCLK) && (EIMSK & _BV(INT0)) && ((EICRA >> ISC00) & 3) == 2)
+        INT0_vect();
+    if ((changed & KCLK2) && !(l & KCLK2) && (EIMSK & _BV(INT3)) && ((EICRA >> ISC30) & 3) == 2)
+        INT3_vect();
+    if ((changed & DATA) && (EIMSK & _BV(INT2))) {
+        uint8_t isc = (EICRA >> ISC20) & 3; // 1 = any edge, 2 = falling, 3 = rising
+        if (isc == 1 || (isc == 2 && !(l & DATA)) || (isc == 3 && (l & DATA)))
+            INT2_vect();
+    }
+    in_isr = 0;
+}
+
+uint16_t host_read_TCNT1(void) {
+    if (DUE(next_timer1_ovf))
+        TIFR1 |= _BV(TOV1); // it's overflowed, and the ISR hasn't been run yet
+    return (uint16_t)(host_now_us*2);
+}
+
+// run the events which are due, then move time forward to whichever comes first of the next event and end
+// returns true when end has been reached
+static uint8_t step(uint32_t end) {
+    wires_poll();
+    kbd_poll();
+    dev_poll(&mouse);
+    dev_poll(&kbd2);
+    timer3_poll();
+    timer1_poll();
+
+    uint32_t next = end;
+    if (EARLIER(next_timer0_ovf, next))
+        next = next_timer0_ovf;
+    if (timer3_running && EARLIER(next_timer3, next))
+        next = next_timer3;
+    if (EARLIER(next_timer1_ovf, next))
+        next = next_timer1_ovf;
+    for (uint8_t i=0; i<2; i++)
+        if (cmp_enabled[i] && EARLIER(next_cmp[i], next))
+            next = next_cmp[i];
+    if (EARLIER(next_sof, next))
+        next = next_sof;
+    if (kbd_pending && EARLIER(next_kbd, next))
+        next = next_kbd;
+    if (mouse.pending && EARLIER(mouse.next, next))
+        next = mouse.next;
+    if (kbd2.pending && EARLIER(kbd2.next, next))
+        next = kbd2.next;
+    if (EARLIER(host_now_us, next))
+        host_now_us = next;
+
+    in_isr = 1;
+    if (DUE(next_timer0_ovf)) {
+        next_timer0_ovf += 1024;
+        if ((TCCR0B & 7) && (TIMSK0 & _BV(TOIE0)))
+            TIMER0_OVF_vect();
+    }
+    if (DUE(next_timer1_ovf)) {
+        next_timer1_ovf += 32768;
+        TIFR1 &= ~_BV(TOV1);
+        if (timer1_running() && (TIMSK1 & _BV(TOIE1)))
+            TIMER1_OVF_vect();
+    }
+    for (uint8_t i=0; i<2; i++) {
+        if (cmp_enabled[i] && DUE(next_cmp[i])) {
+            next_cmp[i] += 32768;
+            if (TIMSK1 & _BV(OCIE1A+i))
+                (i ? TIMER1_COMPB_vect : TIMER1_COMPA_vect)();
+        }
+    }
+    if (timer3_running && DUE(next_timer3)) {
+        next_timer3 += timer3_period_us();
+        TIMER3_COMPA_vect();
+    }
+    if (DUE(next_sof)) {
+        next_sof += 1000;
+        if (sof_enabled && USB_DeviceState == DEVICE_STATE_Configured)
+            EVENT_USB_Device_StartOfFrame();
+    }
+    if (kbd_pending && DUE(next_kbd))
+        kbd_event();
+    if (mouse.pending && DUE(mouse.next))
+        dev_event(&mouse);
+    if (kbd2.pending && DUE(kbd2.next))
+        dev_event(&kbd2);
+    in_isr = 0;
+    wires_poll();
+
+    return DUE(end);
+}
+
+void host_advance_us(uint32_t us) {
+    uint32_t end = host_now_us + us;
+    if (in_isr) {
+        host_now_us = end;
+        return;
+    }
+    while (!step(end))
+        ;
+}
+
+// sleep until the next interrupt (or anything else which happens on the clock)
+void host_sleep(void) {
+    if (in_isr)
+        return;
+    step(host_now_us + 1000);
+}
+
+// a line reads high unless we or the keyboard are driving it low
+// each read takes a usec of simulated time, which is what lets the firmware's polling loops time out
+uint8_t host_read_PIND(void) {
+    host_advance_us(1);
+    return lines();
+}
+
+//-------------------------------------------------------------------------
+// the simulated keyboard's side of the wires
+
+void host_kbd_wires(uint8_t clk, uint8_t data) {
+    kbd_drive = (clk ? 0 : CLK) | (data ? 0 : DATA);
+    wires_played = 1;
+    wires_poll();
+}
+
+// keyboard clock half-period, in usec
+#define KBD_HALF_CLK 40
+
+static void kbd_schedule(uint32_t us) {
+    next_kbd = host_now_us + us;
+    kbd_pending = 1;
+}
+
+// look at what the firmware is doing with the wires
+static void kbd_poll(void) {
+    if (kbd_state != KBD_IDLE || kbd_pending)
+        return;
+    uint8_t driven = DDRD & ~PORTD; // the wires the firmware is pulling low
+    if ((driven & (CLK|DATA)) == DATA) {
+        // request to send: Data low and Clk released. start clocking the bits in after a while, like the Northgate does
+        kbd_state = KBD_RX_LOW;
+        kbd_bit = 0;
+        kbd_bits = 0;
+        kbd_schedule(350);
+    } else if (kbd_tx_len && !(driven & (CLK|DATA))) {
+        // we've something to say, and the bus isn't inhibited
+        next_kbd = EARLIER(kbd_tx[0].when, host_now_us) ? host_now_us : kbd_tx[0].when;
+        kbd_pending = 1;
+    }
+}
+
+static void kbd_event(void) {
+    kbd_pending = 0;
+    switch (kbd_state) {
+      case KBD_IDLE:
+        if (kbd_tx_len && !((DDRD & ~PORTD) & (CLK|DATA))) {
+            uint8_t c = kbd_tx[0].c;
+            kbd_tx_len--;
+            memmove(&kbd_tx[0], &kbd_tx[1], kbd_tx_len*sizeof(kbd_tx[0]));
+            // the byte takes a ~1.1 msec to clock out; we deliver it all at once, then keep the bus busy for that long
+            host_ps2_rx(c, 0);
+            if (kbd_tx_len && EARLIER(kbd_tx[0].when, host_now_us + 1100))
+                kbd_tx[0].when = host_now_us + 1100;
+        }
+        break;
+      case KBD_RX_LOW:
+        kbd_drive = CLK;
+        kbd_state = KBD_RX_HIGH;
+        kbd_schedule(KBD_HALF_CLK);
+        break;
+      case KBD_RX_HIGH:
+        // the host changed Data while Clk was low; sample it as we release Clk
+        kbd_drive = 0;
+        if (lines() & DATA)
+            kbd_bits |= 1 << kbd_bit;
+        kbd_state = ++kbd_bit < 10 ? KBD_RX_LOW : KBD_ACK_LOW;
+        kbd_schedule(KBD_HALF_CLK);
+        break;
+      case KBD_ACK_LOW:
+        kbd_drive = CLK | DATA;
+        kbd_state = KBD_ACK_HIGH;
+        kbd_schedule(KBD_HALF_CLK);
+        break;
+      case KBD_ACK_HIGH: {
+        kbd_drive = 0;
+        kbd_state = KBD_IDLE;
+        uint8_t c = kbd_bits;
+        uint8_t ones = __builtin_popcount(kbd_bits & 0x1ff);
+        if ((ones & 1) && (kbd_bits & 0x200))
+            host_kbd_command(c);
+        else
+            host_kbd_send(0xFE, 1000);
+        break;
+      }
+    }
+}
+
+//-------------------------------------------------------------------------
+// the bit-banged devices' side of their wires
+
+#define DEV_HALF_CLK 40
+
+static void dev_schedule(struct soft_dev* d, uint32_t us) {
+    d->next = host_now_us + us;
+    d->pending = 1;
+}
+
+static void dev_poll(struct soft_dev* d) {
+    if (!d->plugged || d->state != DEV_IDLE || d->pending)
+        return;
+    uint8_t driven = DDRD & ~PORTD;
+    if ((driven & (d->clk|d->data)) == d->data) {
+        // request to send
+        d->state = DEV_RX_LOW;
+        d->bit = 0;
+        d->bits = 0;
+        dev_schedule(d, 100);
+    } else if (d->tx_len && !(driven & (d->clk|d->data))) {
+        d->next = EARLIER(d->tx[0].when, host_now_us) ? host_now_us : d->tx[0].when;
+        d->pending = 1;
+    }
+}
+
+static void dev_event(struct soft_dev* d) {
+    d->pending = 0;
+    uint8_t inhibited = (DDRD & ~PORTD) & d->clk;
+    switch (d->state) {
+      case DEV_IDLE:
+        if (d->tx_len && !((DDRD & ~PORTD) & (d->clk|d->data))) {
+            uint8_t c = d->tx[0].c;
+            uint8_t ones = __builtin_popcount(c);
+            d->bits = (uint16_t)c << 1 | (ones & 1 ? 0 : 1) << 9 | 1 << 10; // start, data, odd parity, stop
+            d->bit = 0;
+            d->drive = d->bits & 1 ? 0 : d->data;
+            d->state = DEV_TX_LOW;
+            dev_schedule(d, 20);
+        }
+        break;
+      case DEV_TX_LOW:
+        if (inhibited) {
+            // the host wants the bus. give up on the byte, and send it again once it's done
+            d->drive = 0;
+            d->state = DEV_IDLE;
+            break;
+        }
+        d->drive |= d->clk;
+        d->state = DEV_TX_HIGH;
+        dev_schedule(d, DEV_HALF_CLK);
+        break;
+      case DEV_TX_HIGH:
+        if (++d->bit == 11) {
+            d->drive = 0;
+            d->state = DEV_IDLE;
+            if (d == &kbd2)
+                kbd2_last = d->tx[0].c;
+            d->tx_len--;
+            memmove(&d->tx[0], &d->tx[1], d->tx_len*sizeof(d->tx[0]));
+            if (d->tx_len && EARLIER(d->tx[0].when, host_now_us + 100))
+                d->tx[0].when = host_now_us + 100;
+            break;
+        }
+        d->drive = (d->bits >> d->bit) & 1 ? 0 : d->data;
+        d->state = DEV_TX_LOW;
+        dev_schedule(d, DEV_HALF_CLK);
+        break;
+      case DEV_RX_LOW:
+        d->drive = d->clk;
+        d->state = DEV_RX_HIGH;
+        dev_schedule(d, DEV_HALF_CLK);
+        break;
+      case DEV_RX_HIGH:
+        d->drive = 0;
+        if (lines() & d->data)
+            d->bits |= 1 << d->bit;
+        d->state = ++d->bit < 10 ? DEV_RX_LOW : DEV_ACK_LOW;
+        dev_schedule(d, DEV_HALF_CLK);
+        break;
+      case DEV_ACK_LOW:
+        d->drive = d->clk | d->data;
+        d->state = DEV_ACK_HIGH;
+        dev_schedule(d, DEV_HALF_CLK);
+        break;
+      case DEV_ACK_HIGH: {
+        d->drive = 0;
+        d->state = DEV_IDLE;
+        uint8_t ones = __builtin_popcount(d->bits & 0x1ff);
+        if ((ones & 1) && (d->bits & 0x200))
+            d->command(d->bits);
+        else
+            dev_send(d, 0xFE, 500);
+        break;
+      }
+    }
+}
+
+//-------------------------------------------------------------------------
+// USART1 rx fifo. like the real part it is 2 bytes deep, and the error bits in UCSR1A belong to the byte at the head
+
+static struct {
+    uint8_t c, status;
+} rx_fifo[2];
+static uint8_t rx_count;
+
+static void rx_update_status(void) {
+    UCSR1A &= ~(_BV(RXC1) | _BV(FE1) | _BV(DOR1) | _BV(UPE1));
+    if (rx_count)
+        UCSR1A |= _BV(RXC1) | rx_fifo[0].status;
+}
+
+uint8_t host_read_UDR1(void) {
+    uint8_t c = rx_fifo[0].c;
+    if (rx_count) {
+        rx_fifo[0] = rx_fifo[1];
+        rx_count--;
+    }
+    rx_update_status();
+    return c;
+}
+
+void host_ps2_rx(uint8_t c, uint8_t status) {
+    // the start bit pulls Data low, which is INT2's falling edge. (unless the harness played the byte out on the wires.
+    // and a byte delivered all at once has no edges to capture, so it doesn't pretend to have one for that)
+    if ((EIMSK & _BV(INT2)) && !wires_played && ((EICRA >> ISC20) & 3) == 2)
+        INT2_vect();
+    wires_played = 0;
+    if (!(UCSR1B & _BV(RXEN1)))
+        return; // receiver is off (we're transmitting); the byte is lost like it would be on the wire
+    if (rx_count == sizeof(rx_fifo)/sizeof(rx_fifo[0])) {
+        // the UART overran. the byte in the shift register is lost, and the next one read is flagged
+        rx_fifo[1].status |= _BV(DOR1);
+    } else {
+        rx_fifo[rx_count].c = c;
+        rx_fifo[rx_count].status = status & (_BV(FE1) | _BV(DOR1) | _BV(UPE1));
+        rx_count++;
+    }
+    rx_update_status();
+    if (UCSR1B & _BV(RXCIE1))
+        USART1_RX_vect();
+}
+
+//-------------------------------------------------------------------------
+// USB device and HID class driver
+
+volatile uint8_t USB_DeviceState;
+
+#define MAX_INTERFACES 8
+#define MAX_ENDPOINTS 7 // the ATmega32u4 has endpoints 0..6
+
+static USB_ClassInfo_HID_Device_t* interfaces[MAX_INTERFACES];
+
+static struct {
+    uint8_t banks;
+    uint8_t used;
+    uint8_t len[2];
+    uint8_t data[2][64];
+    uint8_t fill; // bytes written so far into the free bank
+    volatile uint8_t ueienx;
+    volatile uint8_t ueintx;
+} endpoints[MAX_ENDPOINTS];
+
+uint8_t Endpoint_GetCurrentEndpoint(void) {
+    // every endpoint but 0 is an IN endpoint in this device
+    return (UENUM & ENDPOINT_EPNUM_MASK) | (UENUM ? ENDPOINT_DIR_IN : 0);
+}
+
+void Endpoint_SelectEndpoint(const uint8_t addr) {
+    UENUM = addr & ENDPOINT_EPNUM_MASK;
+}
+
+// TXINI: the selected endpoint has a free bank to write into
+bool Endpoint_IsINReady(void) {
+    uint8_t ep = UENUM % MAX_ENDPOINTS;
+    return endpoints[ep].used < endpoints[ep].banks;
+}
+
+bool Endpoint_IsReadWriteAllowed(void) {
+    return Endpoint_IsINReady();
+}
+
+volatile uint8_t* host_UEIENX(void) {
+    return &endpoints[UENUM % MAX_ENDPOINTS].ueienx;
+}
+
+// TXINI is set by the "hardware" when a bank frees up, or when loading one leaves the other free,
+// and cleared by loading a bank, or by the firmware acknowledging it
+volatile uint8_t* host_UEINTX(void) {
+    return &endpoints[UENUM % MAX_ENDPOINTS].ueintx;
+}
+
+// writes go into the selected endpoint's free bank, and Endpoint_ClearIN() hands it to the "host"
+void Endpoint_Write_8(const uint8_t b) {
+    uint8_t ep = UENUM % MAX_ENDPOINTS;
+    uint8_t k = endpoints[ep].used;
+    if (k < 2 && endpoints[ep].fill < sizeof(endpoints[ep].data[k]))
+        endpoints[ep].data[k][endpoints[ep].fill++] = b;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void* const buf, uint16_t len, uint16_t* const processed) {
+    const uint8_t* p = buf;
+    while (len--)
+        Endpoint_Write_8(*p++);
+    return ENDPOINT_RWSTREAM_NoError;
+}
+
+void Endpoint_ClearIN(void) {
+    uint8_t ep = UENUM % MAX_ENDPOINTS;
+    if (endpoints[ep].used >= endpoints[ep].banks)
+        return;
+    endpoints[ep].len[endpoints[ep].used++] = endpoints[ep].fill;
+    endpoints[ep].fill = 0;
+    // clearing TXINI sends the bank, and if the other bank is free the hardware sets it right back
+    if (endpoints[ep].used < endpoints[ep].banks)
+        endpoints[ep].ueintx |= _BV(TXINI);
+    else
+        endpoints[ep].ueintx &= ~_BV(TXINI);
+}
+
+uint8_t Endpoint_GetBusyBanks(void) {
+    return endpoints[UENUM % MAX_ENDPOINTS].used;
+}
+
+void USB_Init(void) {
+    USB_DeviceState = DEVICE_STATE_Powered;
+}
+
+void USB_USBTask(void) {
+    // control requests are injected by the harness through host_hid_*() instead
+}
+
+void USB_Device_EnableSOFEvents(void) {
+    sof_enabled = 1;
+}
+
+void USB_Device_DisableSOFEvents(void) {
+    sof_enabled = 0;
+}
+
+uint16_t USB_Device_GetFrameNumber(void) {
+    return (host_now_us / 1000) & 0x7ff;
+}
+
+bool USB_Device_RemoteWakeupEnabled;
+unsigned host_usb_remote_wakeups;
+
+void USB_Device_SendRemoteWakeup(void) {
+    host_usb_remote_wakeups++;
+}
+
+void host_usb_suspend(void) {
+    USB_DeviceState = DEVICE_STATE_Suspended;
+    in_isr = 1;
+    EVENT_USB_Device_Suspend();
+    in_isr = 0;
+}
+
+void host_usb_resume(void) {
+    USB_DeviceState = DEVICE_STATE_Configured;
+    in_isr = 1;
+    EVENT_USB_Device_WakeUp();
+    in_isr = 0;
+}
+
+void host_usb_configure(void) {
+    USB_DeviceState = DEVICE_STATE_Configured;
+    EVENT_USB_Device_Connect();
+    EVENT_USB_Device_ConfigurationChanged();
+}
+
+bool HID_Device_ConfigureEndpoints(USB_ClassInfo_HID_Device_t* const intf) {
+    memset(&intf->State, 0, sizeof(intf->State));
+    intf->State.UsingReportProtocol = true;
+    intf->State.IdleCount = 500;
+    if (intf->Config.InterfaceNumber < MAX_INTERFACES)
+        interfaces[intf->Config.InterfaceNumber] = intf;
+    uint8_t ep = intf->Config.ReportINEndpoint.Address & ENDPOINT_EPNUM_MASK;
+    if (ep >= MAX_ENDPOINTS)
+        return false;
+    endpoints[ep].banks = intf->Config.ReportINEndpoint.Banks ? intf->Config.ReportINEndpoint.Banks : 1;
+    endpoints[ep].used = 0;
+    endpoints[ep].fill = 0;
+    endpoints[ep].ueintx = _BV(TXINI);
+    return true;
+}
+
+void HID_Device_ProcessControlRequest(USB_ClassInfo_HID_Device_t* const intf) {
+}
+
+void HID_Device_MillisecondElapsed(USB_ClassInfo_HID_Device_t* const intf) {
+    if (intf->State.IdleMSRemaining)
+        intf->State.IdleMSRemaining--;
+}
+
+void HID_Device_USBTask(USB_ClassInfo_HID_Device_t* const intf) {
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return;
+    if (intf->State.PrevFrameNum == USB_Device_GetFrameNumber())
+        return; // LUFA sends at most one report per frame
+
+    uint8_t ep = intf->Config.ReportINEndpoint.Address & ENDPOINT_EPNUM_MASK;
+    Endpoint_SelectEndpoint(ep); // LUFA leaves it selected while it calls back
+    if (endpoints[ep].used >= endpoints[ep].banks)
+        return; // no free bank; the host hasn't polled the last report out yet
+
+    uint8_t data[intf->Config.PrevReportINBufferSize];
+    uint8_t id = 0;
+    uint16_t size = 0;
+    memset(data, 0, sizeof(data));
+    bool force = CALLBACK_HID_Device_CreateHIDReport(intf, &id, HID_REPORT_ITEM_In, data, &size);
+    bool changed = false;
+    bool idle_elapsed = intf->State.IdleCount && !intf->State.IdleMSRemaining;
+    if (intf->Config.PrevReportINBuffer) {
+        changed = memcmp(data, intf->Config.PrevReportINBuffer, size) != 0;
+        memcpy(intf->Config.PrevReportINBuffer, data, intf->Config.PrevReportINBufferSize);
+    }
+    if (size && (force || changed || idle_elapsed)) {
+        intf->State.IdleMSRemaining = intf->State.IdleCount;
+        if (id)
+            Endpoint_Write_8(id);
+        Endpoint_Write_Stream_LE(data, size, NULL);
+        Endpoint_ClearIN();
+    }
+    intf->State.PrevFrameNum = USB_Device_GetFrameNumber();
+}
+
+int host_usb_in(uint8_t ep, uint8_t* buf) {
+    if (ep >= MAX_ENDPOINTS || !endpoints[ep].used)
+        return -1;
+    int len = endpoints[ep].len[0];
+    memcpy(buf, endpoints[ep].data[0], len);
+    endpoints[ep].len[0] = endpoints[ep].len[1];
+    memcpy(endpoints[ep].data[0], endpoints[ep].data[1], sizeof(endpoints[ep].data[0]));
+    endpoints[ep].used--;
+    // freeing the bank sets TXINI, which interrupts if it is enabled
+    endpoints[ep].ueintx |= _BV(TXINI);
+    if (endpoints[ep].ueienx & _BV(TXINE))
+        USB_COM_vect();
+    return len;
+}
+
+void host_hid_set_protocol(uint8_t i, uint8_t report_protocol) {
+    if (i < MAX_INTERFACES && interfaces[i])
+        interfaces[i]->State.UsingReportProtocol = report_protocol != 0;
+}
+
+void host_hid_set_idle(uint8_t i, uint16_t ms) {
+    if (i < MAX_INTERFACES && interfaces[i]) {
+        interfaces[i]->State.IdleCount = ms;
+        interfaces[i]->State.IdleMSRemaining = 0;
+    }
+}
+
+void host_hid_set_report(uint8_t i, uint8_t id, uint8_t type, const void* data, uint16_t len) {
+    if (i < MAX_INTERFACES && interfaces[i])
+        CALLBACK_HID_Device_ProcessHIDReport(interfaces[i], id, type, data, len);
+}
+
+uint16_t host_hid_get_report(uint8_t i, uint8_t id, uint8_t type, void* out) {
+    if (i >= MAX_INTERFACES || !interfaces[i])
+        return 0;
+    USB_ClassInfo_HID_Device_t* intf = interfaces[i];
+    uint8_t data[intf->Config.PrevReportINBufferSize];
+    uint16_t size = 0;
+    memset(data, 0, sizeof(data));
+    CALLBACK_HID_Device_CreateHIDReport(intf, &id, type, data, &size);
+    // LUFA overwrites the previous IN report with whatever GET_REPORT returned; so do we
+    if (intf->Config.PrevReportINBuffer)
+        memcpy(intf->Config.PrevReportINBuffer, data, intf->Config.PrevReportINBufferSize);
+    uint8_t* p = out;
+    if (id)
+        *p++ = id;
+    memcpy(p, data, size);
+    return size + (id ? 1 : 0);
+}
@@ -0,0 +1,100 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// the harness side of the host shim: the calls a Linux program uses to play the part of the
+// PS/2 keyboard, the timers and the USB host around the unmodified firmware sources
+
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the simulated clock, in usec since the start of the run. PIND reads and _delay_us() advance it
+// too so the firmware's timeouts expire in simulated time; Timer0 overflows and SOF events fire as it passes
+extern uint32_t host_now_us;
+void host_advance_us(uint32_t us);
+
+// the keyboard sends byte c. it lands in the UART's rx fifo and USART1_RX_vect is run, as on the
+// real part. status can carry the FE1/DOR1/UPE1 error bits of UCSR1A to inject errors
+void host_ps2_rx(uint8_t c, uint8_t status);
+
+// the simulated keyboard on the other end of the wires. it clocks in the bytes the firmware writes,
+// bit by bit, and hands each one to host_kbd_command (by default host_kbd_ack(), which answers 0xFA
+// and records the byte in host_kbd_log[]). a byte with a bad parity or stop bit is answered with 0xFE instead
+extern void (*host_kbd_command)(uint8_t c);
+void host_kbd_ack(uint8_t c);
+extern uint8_t host_kbd_log[256];
+extern unsigned host_kbd_log_len;
+
+// queue byte c for the keyboard to send delay_us from now, once nobody is holding the bus
+void host_kbd_send(uint8_t c, uint32_t delay_us);
+
+// the keyboard releases (1) or pulls low (0) the Clk and Data wires, to play out a frame edge by edge for the
+// signal capture (see capture.h). deliver the byte with host_ps2_rx() afterwards, and release both wires
+void host_kbd_wires(uint8_t clk, uint8_t data);
+
+// the simulated mouse on the second port (see mouse.h). it isn't there until host_mouse_plug(), which plugs it in: it
+// sends AA 00 half a second later, and from then on answers commands like a 3 button mouse, with a wheel the
+// IntelliMouse knock turns on if wheel is set. the commands it got are in host_mouse_log[]. once the firmware has
+// turned on streaming, host_mouse_move() sends a packet (dy is down, and the wheel away from the user, as for USB)
+void host_mouse_plug(uint8_t wheel);
+void host_mouse_move(uint8_t buttons, int dx, int dy, int wheel);
+extern uint8_t host_mouse_streaming;
+extern uint8_t host_mouse_log[256];
+extern unsigned host_mouse_log_len;
+
+// the simulated second keyboard (see ps2.h). it isn't there until host_kbd2_plug(), which plugs it in in set 2; it
+// sends AA half a second later. it goes into set 3 only if set3_ok (else it ACKs F0 03 and stays in set 2, as some
+// real ones do), and answers F0 00, ED, F8, FE and FF. the commands it got are in host_kbd2_log[]. host_kbd2_send()
+// queues a byte for it to send delay_us from now, once the bus is free. host_kbd2_unplug() pulls it out again
+void host_kbd2_plug(uint8_t set3_ok);
+void host_kbd2_unplug(void);
+void host_kbd2_send(uint8_t c, uint32_t delay_us);
+extern uint8_t host_kbd2_set;
+extern uint8_t host_kbd2_leds;
+extern uint8_t host_kbd2_log[256];
+extern unsigned host_kbd2_log_len;
+
+// bring the USB device up to the Configured state, as host enumeration would
+void host_usb_configure(void);
+
+// the host suspends the bus (stops sending SOFs), and later resumes it. USB_Device_SendRemoteWakeup() only counts
+// the requests in host_usb_remote_wakeups; the harness decides whether, and when, the host resumes
+void host_usb_suspend(void);
+void host_usb_resume(void);
+extern unsigned host_usb_remote_wakeups;
+
+// the host polls IN endpoint ep. returns the length of the report copied into buf, or -1 for a NAK
+int host_usb_in(uint8_t ep, uint8_t* buf);
+
+// control requests on the HID interface whose class driver is intf
+void host_hid_set_protocol(uint8_t intf, uint8_t report_protocol);
+void host_hid_set_idle(uint8_t intf, uint16_t ms); // 0 sends reports only when they change, as most OSes ask for
+void host_hid_set_report(uint8_t intf, uint8_t id, uint8_t type, const void* data, uint16_t len);
+uint16_t host_hid_get_report(uint8_t intf, uint8_t id, uint8_t type, void* data);
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tracefile.h"
+
+void ps2_trace_init(struct ps2_trace* tr) {
+    memset(tr, 0, sizeof(*tr));
+    tr->set = 3;
+    tr->report_protocol = 1;
+}
+
+void ps2_trace_add(struct ps2_trace* tr, uint64_t time, uint8_t kind, uint8_t value) {
+    if (tr->num == tr->size) {
+        tr->size = tr->size ? tr->size*2 : 1024;
+        tr->events = realloc(tr->events, tr->size * sizeof(*tr->events));
+    }
+    struct ps2_event* ev = &tr->events[tr->num++];
+    ev->time = time;
+    ev->kind = kind;
+    ev->value = value;
+}
+
+int ps2_trace_load(struct ps2_trace* tr, const char* name, FILE* err) {
+    FILE* f = fopen(name, "r");
+    if (!f) {
+        fprintf(err, "%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    ps2_trace_init(tr);
+    char line[256];
+    unsigned lineno = 0;
+    unsigned long long prev = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || !*p)
+            continue;
+        unsigned long long t;
+        unsigned v;
+        char word[16];
+        uint8_t kind;
+        if (sscanf(p, "set %u", &v) == 1 && (v == 2 || v == 3)) {
+            tr->set = v;
+            continue;
+        } else if (sscanf(p, "protocol %15s", word) == 1 && (!strcmp(word, "boot") || !strcmp(word, "report"))) {
+            tr->report_protocol = !strcmp(word, "report");
+            continue;
+        } else if (sscanf(p, "%llu leds %x", &t, &v) == 2 && v <= 0xff) {
+            kind = PS2_EV_LEDS;
+        } else if (sscanf(p, "%llu %x", &t, &v) == 2 && v <= 0xff) {
+            kind = PS2_EV_BYTE;
+        } else {
+            fprintf(err, "%s:%u: can't make sense of: %s", name, lineno, p);
+            fclose(f);
+            ps2_trace_free(tr);
+            return -1;
+        }
+        if (t < prev) {
+            fprintf(err, "%s:%u: time %llu is before the one on the line before\n", name, lineno, t);
+            fclose(f);
+            ps2_trace_free(tr);
+            return -1;
+        }
+        prev = t;
+        ps2_trace_add(tr, t, kind, v);
+    }
+    fclose(f);
+    return 0;
+}
+
+void ps2_trace_free(struct ps2_trace* tr) {
+    free(tr->events);
+    ps2_trace_init(tr);
+}
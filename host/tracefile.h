@@ -0,0 +1,68 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// PS/2 byte stream traces, as recorded by tools/tracedump -r and replayed by replay.c and pollsim.c
+//
+// a trace is a text file:
+//
+//   # comments
+//   set 3                  the scan code set the keyboard is in (3, the default, or 2)
+//   protocol report        the host uses report protocol (the default, like an OS) or boot protocol (like a BIOS)
+//   0 1c                   the keyboard sent byte 0x1c at time 0 (usec)
+//   95000 f0
+//   96100 1c
+//   200000 leds 02         the host set the LEDs (the USB bits, 2 = CapsLock)
+//
+// the times must not go backwards
+
+#ifndef HOST_TRACEFILE_H
+#define HOST_TRACEFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { PS2_EV_BYTE, PS2_EV_LEDS };
+
+struct ps2_event {
+    uint64_t time; // usec from the start of the trace
+    uint8_t kind; // PS2_EV_xxx
+    uint8_t value; // the byte, or the USB LED bits
+};
+
+struct ps2_trace {
+    uint8_t set;
+    uint8_t report_protocol;
+    unsigned num, size;
+    struct ps2_event* events;
+};
+
+void ps2_trace_init(struct ps2_trace* tr); // an empty trace, in set 3 and report protocol
+void ps2_trace_add(struct ps2_trace* tr, uint64_t time, uint8_t kind, uint8_t value);
+int ps2_trace_load(struct ps2_trace* tr, const char* name, FILE* err); // parse a file. returns 0, or prints what's wrong with it to err and returns -1
+void ps2_trace_free(struct ps2_trace* tr);
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "inject.h"
+
+static struct inject_stroke queue[INJECT_QUEUE];
+static uint8_t head, num; // the oldest is queue[head]
+static uint16_t typed;
+static uint8_t refused, unknown;
+static uint8_t last; // the last character of the last INJECT_TEXT
+
+// the US keyboard's key for each ASCII character, with SHIFT in the top bit. 0 for none
+#define S 0x80
+static const uint8_t PROGMEM ascii_keys[128] = {
+    /* 00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0x2a /* \b */, 0x2b /* \t */, 0x28 /* \n */, 0, 0, 0x28 /* \r */, 0, 0,
+    /* 10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x29 /* ESC */, 0, 0, 0, 0,
+    /* 20 */ 0x2c, S|0x1e, S|0x34, S|0x20, S|0x21, S|0x22, S|0x24, 0x34, S|0x26, S|0x27, S|0x25, S|0x2e, 0x36, 0x2d, 0x37, 0x38, //  !"#$%&'()*+,-./
+    /* 30 */ 0x27, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, S|0x33, 0x33, S|0x36, 0x2e, S|0x37, S|0x38,      // 0123456789:;<=>?
+    /* 40 */ S|0x1f, S|0x04, S|0x05, S|0x06, S|0x07, S|0x08, S|0x09, S|0x0a, S|0x0b, S|0x0c, S|0x0d, S|0x0e, S|0x0f, S|0x10, S|0x11, S|0x12, // @A-O
+    /* 50 */ S|0x13, S|0x14, S|0x15, S|0x16, S|0x17, S|0x18, S|0x19, S|0x1a, S|0x1b, S|0x1c, S|0x1d, 0x2f, 0x31, 0x30, S|0x23, S|0x2d,      // P-Z[\]^_
+    /* 60 */ 0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,                          // `a-o
+    /* 70 */ 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, S|0x2f, S|0x31, S|0x30, S|0x35, 0,                      // p-z{|}~
+};
+#undef S
+
+// the key for c, or 0 if there isn't one. a \n right after a \r is skipped, so CRLF line endings are one ENTER, as
+// are a lone \r or \n. that holds when the two come in separate requests, too
+static uint8_t key_for(uint8_t c, uint8_t prev) {
+    if (c >= 0x80 || (c == '\n' && prev == '\r'))
+        return 0;
+    return pgm_read_byte(&ascii_keys[c]);
+}
+
+uint8_t inject_peek(struct inject_stroke* s) {
+    if (!num)
+        return 0;
+    *s = queue[head];
+    return 1;
+}
+
+void inject_pop(void) {
+    head = (head+1) & (INJECT_QUEUE-1);
+    num--;
+    typed++;
+}
+
+static void add(uint8_t mods, uint8_t key) {
+    struct inject_stroke* s = &queue[(head + num) & (INJECT_QUEUE-1)];
+    s->mods = mods;
+    s->key = key;
+    num++;
+}
+
+void inject_request(const void* data, uint16_t len) {
+    const struct inject_request* r = data;
+    if (len < 2 || r->len > INJECT_REQUEST_BYTES || len < 2 + r->len)
+        goto refused;
+    switch (r->op) {
+        case INJECT_TEXT: {
+            uint8_t n = 0;
+            uint8_t prev = last;
+            for (uint8_t i=0; i<r->len; i++) {
+                n += key_for(r->data[i], prev) != 0;
+                prev = r->data[i];
+            }
+            if (n > INJECT_QUEUE - num)
+                goto refused;
+            for (uint8_t i=0; i<r->len; i++) {
+                uint8_t c = r->data[i];
+                uint8_t k = key_for(c, last);
+                if (k)
+                    add(k & 0x80 ? 0x02 : 0, k & 0x7f); // (LEFT SHIFT)
+                else if (!(c == '\n' && last == '\r') && unknown != 0xff)
+                    unknown++;
+                last = c;
+            }
+            return;
+        }
+        case INJECT_KEYS: {
+            uint8_t n = r->len / sizeof(struct inject_stroke);
+            if (n > INJECT_QUEUE - num)
+                goto refused;
+            const struct inject_stroke* s = (const struct inject_stroke*)r->data;
+            for (uint8_t i=0; i<n; i++)
+                if (s[i].key >= 0xE0)
+                    goto refused; // modifiers go in mods. (and main.c's matrix[] stops at E7)
+            for (uint8_t i=0; i<n; i++)
+                add(s[i].mods, s[i].key);
+            return;
+        }
+        case INJECT_CLEAR:
+            num = 0;
+            last = 0;
+            return;
+    }
+refused:
+    if (refused != 0xff)
+        refused++;
+}
+
+uint8_t inject_get_status(uint8_t* buf) {
+    struct inject_status* st = (struct inject_status*)buf;
+    st->free = INJECT_QUEUE - num;
+    st->queued = num;
+    st->typed = typed;
+    st->refused = refused;
+    st->unknown = unknown;
+    return sizeof(*st);
+}
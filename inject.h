@@ -0,0 +1,86 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// typing on the host's behalf
+//
+// the host queues text (or raw keystrokes) with SET_REPORT(Feature) on the diagnostics interface, which tools/inject
+// does from its arguments or stdin, and the adapter types it as if it came from the keyboard. each keystroke is
+// pressed in one keyboard report, with exactly the modifiers it needs (the real ones are left out of that report),
+// and released in the next, so a repeated character is two keystrokes and not one long one. the reports go out as
+// fast as the host polls for them, so at the 2 msec polling interval that's 250 characters a second.
+//
+// the real keys come first. a report which has real key transitions in it doesn't start a keystroke, and a
+// keystroke waits while its own key is held down for real. main.c does the typing (see next_injected()); this is the
+// queue, and the ASCII to USB table
+
+#ifndef INJECT_H
+#define INJECT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a keystroke
+struct inject_stroke {
+    uint8_t mods; // the modifiers to hold, as in the first byte of a boot report (bit 0 is LEFT CTRL, bit 1 LEFT SHIFT, ...)
+    uint8_t key; // the USB key code, or 0 for just the modifiers
+};
+
+#define INJECT_QUEUE 64 // keystrokes. a power of 2, and at most 128
+
+// the requests
+enum {
+    INJECT_TEXT = 1, // type data[] as US ASCII. characters with no key on a US keyboard are skipped (and counted)
+                     // \r, \n and \r\n are each one ENTER
+    INJECT_KEYS,     // type data[] as struct inject_strokes
+    INJECT_CLEAR,    // forget whatever hasn't been typed yet
+};
+
+// the feature report, as SET_REPORT takes it. a request only goes into the queue if it all fits; otherwise none of it does
+#define INJECT_REQUEST_BYTES 60 // as many as fit in a 64 byte packet along with the report ID
+struct inject_request {
+    uint8_t op; // INJECT_TEXT etc
+    uint8_t len; // how many bytes of data[] there are
+    uint8_t data[INJECT_REQUEST_BYTES];
+};
+
+// and as GET_REPORT returns it
+struct inject_status {
+    uint8_t free; // how many more keystrokes the queue has room for
+    uint8_t queued; // how many are waiting to be typed
+    uint16_t typed; // keystrokes typed since power up (wraps)
+    uint8_t refused; // requests which didn't fit, or made no sense (saturates at 255)
+    uint8_t unknown; // characters which were skipped (saturates at 255)
+};
+
+// main.c's part
+uint8_t inject_peek(struct inject_stroke* s); // the next keystroke to type. returns false if there isn't one
+void inject_pop(void); // it's been typed
+
+// the diagnostics interface's part
+uint8_t inject_get_status(uint8_t* buf); // fill in a struct inject_status; returns its size
+void inject_request(const void* data, uint16_t len);
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
@@ -26,8 +26,14 @@
 extern "C" {
 #endif
 
-// map a PS/2 key code to USB. returns 0 if there is no mapping
-uint16_t ps2_to_usb_keycode(uint8_t);
+// map a PS/2 key code from keyboard port (0 or 1, see ps2.h) to USB. returns 0 if there is no mapping
+uint16_t ps2_to_usb_keycode(uint8_t port, uint8_t pc);
+
+// which PS/2 codeset (2 or 3) ps2_to_usb_keycode() should decode for the keyboard on port. it loads the tables, so it
+// has to be called before anything is decoded
+void keycodes_select_set(uint8_t port, uint8_t set);
+// load the tables again, after the remapping in EEPROM has changed (see remap.h)
+void keycodes_reload(void);
 
 #ifdef __cplusplus 
 } // end of extern "C"
@@ -0,0 +1,125 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+#include <LUFA/Drivers/USB/USB.h>
+#include "ps2.h"
+#include "latency.h"
+#include "budget.h"
+
+static struct latency_report hist;
+
+uint8_t latency_pending;
+static uint16_t pending_rx; // rx time of the oldest transition not yet in a report
+
+// the report we are waiting for the host to read
+// only one is timed at once; transitions which come along meanwhile are only timed as far as being put in a report
+static volatile uint8_t in_flight; // 1 once a report with a timed transition is built, 2 once the endpoint interrupt is armed
+static uint16_t in_flight_rx, in_flight_report;
+static uint8_t in_flight_ep; // the IN endpoint the report is going out on (the boot keyboard's or the NKRO keyboard's)
+static volatile uint8_t in_flight_banks; // the endpoint has 2 banks; how many the host has yet to read out before it has read ours
+
+// add a measurement of dt usec to histogram h
+static void record(uint8_t h, uint16_t dt) {
+    uint8_t b = dt >> LATENCY_BUCKET_SHIFT;
+    if (dt >= (LATENCY_BUCKETS << LATENCY_BUCKET_SHIFT))
+        b = LATENCY_BUCKETS-1;
+    if (hist.hist[h].buckets[b] != 0xffff) // saturate rather than wrap
+        hist.hist[h].buckets[b]++;
+    if (dt > hist.hist[h].max_us)
+        hist.hist[h].max_us = dt;
+}
+
+void latency_keystroke(uint16_t rx_time) {
+    // if an earlier transition is still waiting, that is the one whose latency the host sees, so keep it
+    if (!latency_pending) {
+        latency_pending = 1;
+        pending_rx = rx_time;
+    }
+}
+
+void latency_report(uint8_t epaddr) {
+    uint16_t now = now_us16();
+    record(LATENCY_RX_TO_REPORT, now - pending_rx);
+    latency_pending = 0;
+    if (!in_flight) {
+        in_flight_rx = pending_rx;
+        in_flight_report = now;
+        in_flight_ep = epaddr;
+        in_flight = 1;
+    }
+}
+
+// the host has read the timed report
+static void read_out(void) {
+    uint16_t now = now_us16();
+    record(LATENCY_REPORT_TO_READ, now - in_flight_report);
+    record(LATENCY_RX_TO_READ, now - in_flight_rx);
+    in_flight = 0;
+}
+
+void latency_arm(void) {
+    if (in_flight == 1) {
+        // the report is in an endpoint bank, possibly behind one already waiting in the other bank.
+        // each bank the host reads out sets TXINI, so count those until it gets to ours
+        uint8_t ep = Endpoint_GetCurrentEndpoint();
+        Endpoint_SelectEndpoint(in_flight_ep);
+        uint8_t oldSREG = SREG;
+        cli();
+        UEINTX &= ~(1<<TXINI); // TXINI is also set if loading our report left the other bank free; that doesn't count
+        in_flight_banks = Endpoint_GetBusyBanks();
+        if (in_flight_banks) {
+            in_flight = 2;
+            UEIENX |= (1<<TXINE);
+        } else {
+            read_out(); // already gone
+        }
+        SREG = oldSREG;
+        Endpoint_SelectEndpoint(ep);
+    }
+}
+
+// LUFA only defines this ISR when INTERRUPT_CONTROL_ENDPOINT is set, which we don't (see LUFAConfig.h)
+// so it is ours to use for the keyboard endpoint's TXINI
+// (it doesn't nest: TXINI stays set until it is cleared, so interrupts can't be re-enabled any earlier than the end anyway)
+ISR(USB_COM_vect) {
+    uint16_t start = budget_start();
+    uint8_t ep = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(in_flight_ep);
+    if (UEINTX & (1<<TXINI)) {
+        // the host has read out a bank
+        UEINTX &= ~(1<<TXINI);
+        if (in_flight == 2 && !--in_flight_banks) {
+            // and it was ours
+            UEIENX &= ~(1<<TXINE);
+            read_out();
+        }
+    }
+    Endpoint_SelectEndpoint(ep);
+    budget_end(BUDGET_USB_COM, start);
+}
+
+uint8_t latency_get_report(uint8_t* buf) {
+    hist.bucket_us = 1 << LATENCY_BUCKET_SHIFT;
+    memcpy(buf, &hist, sizeof(hist));
+    return sizeof(hist);
+}
+
+void latency_clear(void) {
+    memset(&hist, 0, sizeof(hist));
+}
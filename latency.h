@@ -0,0 +1,71 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it 
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ * 
+ */
+
+// keystroke latency measurement
+//
+// each key transition is timestamped three times:
+//   rx     in USART1_RX_vect, when the last byte of the make or break code arrives
+//   report when CALLBACK_HID_Device_CreateHIDReport first puts the transition into a report
+//   read   when the host reads that report out of the IN endpoint
+// and the differences are accumulated in histograms which the host can read with a
+// GET_REPORT(Feature) on the diagnostics interface (see diag.h)
+// the timestamps are now_us16(), so a latency over 65 msec is recorded as that much less
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+#define LATENCY_BUCKETS       16
+#define LATENCY_BUCKET_SHIFT  8 // histogram buckets are 1<<8 = 256 usec wide
+
+enum {
+    LATENCY_RX_TO_REPORT,
+    LATENCY_REPORT_TO_READ,
+    LATENCY_RX_TO_READ,
+    LATENCY_NUM_HISTOGRAMS
+};
+
+// the feature report, as the host sees it (little endian, like the AVR)
+struct latency_report {
+    uint16_t bucket_us; // width of each bucket. the last bucket also counts everything past the end
+    struct {
+        uint16_t max_us; // largest single measurement
+        uint16_t buckets[LATENCY_BUCKETS];
+    } hist[LATENCY_NUM_HISTOGRAMS];
+};
+
+extern uint8_t latency_pending; // non-zero when a transition is waiting to be put into a report
+
+void latency_keystroke(uint16_t rx_time); // a key transition whose last byte arrived at rx_time (in now_us16()) was applied to matrix[]
+void latency_report(uint8_t epaddr); // the report being built for IN endpoint epaddr contains the pending transition
+void latency_arm(void); // call after the report has been handed to the endpoint
+
+uint8_t latency_get_report(uint8_t* buf); // fill in a struct latency_report; returns its size
+void latency_clear(void);
+
+#ifdef __cplusplus 
+} // end of extern "C"
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "layers.h"
+#include "timebase.h"
+#include "trace.h"
+
+// the layer tables and the tap-hold keys
+#define KEYMAP_LAYERS
+#include "keymap.h"
+
+static const struct {
+    const uint8_t* map; // in flash
+    uint8_t base, len;
+} layer_maps[NUM_LAYERS] = {
+    { layer1_map, LAYER1_MAP_BASE, sizeof(layer1_map) },
+    { layer2_map, LAYER2_MAP_BASE, sizeof(layer2_map) },
+    { layer3_map, LAYER3_MAP_BASE, sizeof(layer3_map) },
+};
+
+static uint8_t momentary, toggled; // bit n-1 for layer n
+static uint8_t on; // momentary | toggled
+
+static uint8_t down[0xE8/8]; // the keys layers_key() has seen go down and not yet up, by the USB code they came in as
+
+// the keys which went down as something else, and have to come back up as that too
+#define SHIFTED_KEYS 8 // held down at once. past that a key goes down as itself, so it can come back up as itself
+static struct {
+    uint8_t key; // as it came in
+    uint8_t sent; // as it went down
+} shifted[SHIFTED_KEYS];
+static uint8_t num_shifted;
+
+// the tap-hold key which is down and hasn't been decided yet, as it came in. 0 if there isn't one
+static uint8_t waiting;
+static uint8_t waiting_hold, waiting_tap; // from its tap_hold_keys[] entry
+
+// what key u is on the layers which are on
+static uint8_t translate(uint8_t u) {
+    for (uint8_t l=NUM_LAYERS; l--; ) {
+        if (on & (1<<l)) {
+            uint8_t i = u - layer_maps[l].base;
+            if (i < layer_maps[l].len) {
+                uint8_t v = pgm_read_byte(&layer_maps[l].map[i]);
+                if (v)
+                    return v;
+            } // else the layer doesn't mention it, so look at the one below
+        }
+    }
+    return u;
+}
+
+// send u down or up: a layer key is acted on here, and anything else goes to main.c
+static void send(uint8_t u, uint8_t up, uint16_t rx, layers_queue_fn queue) {
+    if (!IS_LAYER_KEY(u)) {
+        queue(u | (uint16_t)up<<8, rx);
+        return;
+    }
+    if (u < LAYER_TOGGLE) {
+        uint8_t bit = 1 << (u - LAYER_MOMENTARY);
+        if (up)
+            momentary &= ~bit;
+        else
+            momentary |= bit;
+    } else if (!up) {
+        toggled ^= 1 << (u - LAYER_TOGGLE);
+    }
+    if (on != (momentary | toggled)) {
+        on = momentary | toggled;
+        trace(TRACE_LAYERS, on);
+    }
+}
+
+static uint8_t find_shifted(uint8_t key) {
+    uint8_t i = 0;
+    while (i < num_shifted && shifted[i].key != key)
+        i++;
+    return i;
+}
+
+// what key went down as
+static uint8_t sent_as(uint8_t key) {
+    uint8_t i = find_shifted(key);
+    return i < num_shifted ? shifted[i].sent : key;
+}
+
+// returns what key is to go down as: sent, or key itself if there's no room to remember that
+static uint8_t remember(uint8_t key, uint8_t sent) {
+    if (num_shifted == SHIFTED_KEYS)
+        return key;
+    shifted[num_shifted].key = key;
+    shifted[num_shifted].sent = sent;
+    num_shifted++;
+    return sent;
+}
+
+// what key went down as, now that it has come back up
+static uint8_t forget(uint8_t key) {
+    uint8_t i = find_shifted(key);
+    if (i == num_shifted)
+        return key;
+    uint8_t sent = shifted[i].sent;
+    shifted[i] = shifted[--num_shifted];
+    return sent;
+}
+
+// the waiting tap-hold key is held, as decided at time rx. (the hold goes to main.c with that time rather than when
+// the key went down, which can be further back than a 16 bit time reaches. so the latency measurements leave out
+// the wait, which TAP_HOLD_US bounds anyway)
+static void hold(uint16_t rx, layers_queue_fn queue) {
+    alarm_cancel(ALARM_KEYS);
+    trace(TRACE_HELD, waiting_hold);
+    send(remember(waiting, waiting_hold), 0, rx, queue);
+    waiting = 0;
+}
+
+void layers_key(uint16_t mu, uint16_t rx, layers_queue_fn queue) {
+    uint8_t u = (uint8_t)mu;
+    uint8_t up = mu>>8;
+    if (!u)
+        return; // a prefix byte, or a key with no mapping
+    uint8_t bit = 1 << (u&7);
+    uint8_t was_down = down[u>>3] & bit;
+    if (up)
+        down[u>>3] &= ~bit;
+    else
+        down[u>>3] |= bit;
+
+    if (!(on | num_shifted | waiting) && !(pgm_read_byte(&special_keys[u>>3]) & bit)) {
+        // no layer is on, nor has left anything behind, and it isn't a layer or tap-hold key. so it's just a key
+        queue(mu, rx);
+        return;
+    }
+
+    if (waiting) {
+        if (!alarm_pending(ALARM_KEYS)) {
+            // it was held past its deadline, and the main loop hasn't got around to layers_tick() yet
+            hold(now_us16(), queue);
+        } else if (u == waiting) {
+            if (up) {
+                trace(TRACE_TAPPED, waiting_tap);
+                alarm_cancel(ALARM_KEYS);
+                waiting = 0;
+                send(waiting_tap, 0, rx, queue);
+                send(waiting_tap, 1, rx, queue);
+            } // else the keyboard repeating it (in set 2), which doesn't decide anything
+            return;
+        } else if (!up) {
+            // another key going down while it's down means it's being used as the modifier (or layer)
+            hold(rx, queue);
+        }
+    }
+
+    if (up) {
+        send(forget(u), 1, rx, queue);
+        return;
+    }
+    if (was_down) {
+        // the keyboard repeating it (in set 2). it's still whatever it went down as, whatever the layers are now
+        send(sent_as(u), 0, rx, queue);
+        return;
+    }
+
+    uint8_t v = translate(u);
+    if (pgm_read_byte(&special_keys[v>>3]) & (1 << (v&7))) {
+        for (uint8_t i=0; i<NUM_TAP_HOLD_KEYS; i++) {
+            if (pgm_read_byte(&tap_hold_keys[i].key) == v) {
+                // wait until we know which it is
+                waiting = u;
+                waiting_hold = pgm_read_byte(&tap_hold_keys[i].hold);
+                waiting_tap = pgm_read_byte(&tap_hold_keys[i].tap);
+                alarm_set(ALARM_KEYS, TAP_HOLD_US, NULL); // which wakes the main loop, for layers_tick()
+                return;
+            }
+        }
+    }
+    if (v != u)
+        v = remember(u, v);
+    send(v, 0, rx, queue);
+}
+
+void layers_tick(layers_queue_fn queue) {
+    if (waiting && !alarm_pending(ALARM_KEYS))
+        hold(now_us16(), queue);
+}
+
+uint8_t layers_waiting(void) {
+    return waiting != 0;
+}
+
+void layers_reset(void) {
+    alarm_cancel(ALARM_KEYS);
+    waiting = 0;
+    num_shifted = 0;
+    memset(down, 0, sizeof(down));
+    momentary = toggled = 0;
+    if (on) {
+        on = 0;
+        trace(TRACE_LAYERS, on);
+    }
+}
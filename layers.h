@@ -0,0 +1,79 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// layers and tap-hold keys, between ps2_to_usb_keycode() and the key queue in main.c
+//
+// layout.txt can map a key to one of the layer keys below rather than to a USB key. while a momentary layer key is
+// held, or once a toggle key has turned it on, that layer's section of layout.txt ([layer 1] etc) maps the USB codes
+// of the keys to others. a key the layer doesn't mention falls through to the layers below it, and in the end sends
+// its own code. the highest layer which is on wins. a key which went down on a layer comes back up as the key it went
+// down as, whatever the layers have done meanwhile, so nothing is left stuck.
+//
+// a tap-hold key ([tap hold] in layout.txt) is a USB code which sends one key when tapped and another when held,
+// say ESC and CTRL for caps lock, or the OMNI key which is DOWN ARROW when tapped and layer 1 when held. it is held
+// once it has been down for TAP_HOLD_US, or as soon as another key goes down meanwhile (so CAPS+C is CTRL+C without
+// any wait), and tapped if it comes back up before either. until then it sends nothing; the ALARM_KEYS alarm wakes
+// the main loop at the deadline, and layers_tick() decides it's held.
+//
+// only the tap-hold keys ever wait. every other key goes straight through, after a bit test when no layer is on and
+// one pgm_read_byte() per layer which is on
+
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the layer keys. A5-AF are reserved in the USB keyboard page, so no real key is lost to them
+#define NUM_LAYERS 3
+#define LAYER_MOMENTARY 0xA5 // A5-A7: layer 1-3 is on while the key is down
+#define LAYER_TOGGLE 0xA8    // A8-AA: each press turns layer 1-3 on, or back off
+#define IS_LAYER_KEY(u) ((u) >= LAYER_MOMENTARY && (u) < LAYER_TOGGLE + NUM_LAYERS)
+
+// how long a tap-hold key has to be down before it counts as held. build with -DTAP_HOLD_US=<usec> for another.
+// long enough that a relaxed tap isn't mistaken for a hold, short enough that a held modifier doesn't feel sluggish
+#ifndef TAP_HOLD_US
+#define TAP_HOLD_US 200000
+#endif
+
+// a [tap hold] line of layout.txt, as tools/mklayout writes it into keymap.h
+struct tap_hold_key {
+    uint8_t key; // the USB code (after the scan code tables and the layers)
+    uint8_t hold; // what it sends while held. can be a layer key
+    uint8_t tap; // and what it sends, down and straight back up, when tapped. can be a toggle key
+};
+
+// main.c's key queue, which layers_key() and layers_tick() pass the keys on to, as (USB code | UP flag<<8, rx time)
+typedef void (*layers_queue_fn)(uint16_t mu, uint16_t rx);
+
+// take a key from ps2_to_usb_keycode(), and pass whatever it means on to queue
+void layers_key(uint16_t mu, uint16_t rx, layers_queue_fn queue);
+// from the main loop. a tap-hold key whose deadline has passed is held
+void layers_tick(layers_queue_fn queue);
+uint8_t layers_waiting(void); // true while a tap-hold key is down and hasn't been decided yet
+void layers_reset(void); // forget every key and layer, when main.c lets go of all the keys
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
@@ -33,7 +33,8 @@
  * because I don't have anything else to test with. If you want to use this with a different language
  * you should edit the CountryCode field in the descriptor (google for the USB 1.1 HID spec for the
  * value you need, or use 0 like most keyboards do), AND you must edit the mapping from PS/2 keycodes
- * to USB keycodes in keycodes.c. The latter step will be tedious. Tough. It was for me as well :-)
+ * to USB keycodes in layout.txt. The latter step will be tedious. Tough. It was for me as well :-)
+ * (or upload just the keys which differ to the EEPROM with tools/remap, without reflashing; see remap.h)
  *
  * If you have measured it you can set the correct power requirement in the descriptor in the
  * MaxPowerConsumption field.
@@ -134,6 +135,7 @@
  *
  *  Note that these timing numbers are different than what other people report seeing from
  *  their keyboards. Since the keyboard decides the clock rate it can very easily vary.
+ *  (with PD4 jumpered to Clk, tools/ps2timing measures them for whatever keyboard is attached. see capture.h)
  *
  *   1 clock wire, open collector, pull-ups
  *   1 data wire, open collector, pull-ups
@@ -186,6 +188,16 @@
 #include <LUFA/Drivers/USB/USB.h>
 #include "ps2.h"
 #include "keycodes.h"
+#include "descriptors.h"
+#include "latency.h"
+#include "diag.h"
+#include "budget.h"
+#include "timebase.h"
+#include "capture.h"
+#include "remap.h"
+#include "layers.h"
+#include "inject.h"
+#include "mouse.h"
 
 // blink the byte c on the LED slow and noticeably enough that a human can write it down
 static void blink_byte(uint8_t c) {
@@ -227,107 +239,255 @@ void die_blinking(uint8_t c) {
     }
 }
 
-//-------------------------------------------------------------------------
-// hack so I can send debug messages as ascii text over USB
-// (no more debugging with only a single red LED to blink out bytes on :-)
-#if 1
-#include <stdio.h>
-#include <stdarg.h>
-
-char debug_buf[800];
-char* debug_tail; // once it's a 16 bit index it might as well be a pointer
-char* debug_head; // technically these shoud be volatile, but given the structure of the current code it isn't necessary
-
-void debug(const char* fmt, ...) {
-  return;
-    // if we've caught up; reset to the start of the buffer
-    // (this is easier than a real circular buffer, and for debug
-    // purposes as useful)
-    if (debug_head == debug_tail)
-        debug_head = debug_tail = debug_buf;
-    va_list va;
-    va_start(va,fmt);
-    char* buf = debug_head;
-    size_t left = debug_buf + sizeof(debug_buf) - debug_head;
-    vsnprintf(buf, left, fmt, va);
-    debug_head += strlen(debug_head);
-    va_end(va);
-}
-
-#endif
-
-
 //-------------------------------------------------------------------------
 // the keyboard array, as reported over USB
 // USB HID sees a keyboard as a large bit array, each bit representing a single key, where 1=key is pressed, and 0=key is released
 // USB HIB reports (the packets sent back to the host) contain an slice of the bitmap (range 0xE0-E7) where the modifier (shift/ctrl/alt) keys
 // are found, and an array of up to 6 bit numbers to represent up to 6 down keys.
+// That's the boot protocol report, and it is all a BIOS understands. Once the OS has put us in report protocol we
+// send the bitmap itself instead (see make_nkro_report()), so any number of keys can be down at once.
 
 uint8_t matrix[0xE8/8]; // 29 bytes, the last of which is the modifier keys
 
+// rather than rescan matrix[] for each boot report, keep a list of the (non-modifier) keys which are down as they
+// go up and down, and only rebuild the report when something changed. That makes the report O(keys down) to build
+// once, and a copy after that.
+#define MAX_BOOT_KEYS 6 // the boot report has room for 6 keys
+static uint8_t keys_down[MAX_BOOT_KEYS]; // the keys which are down, in the order they went down
+static uint8_t num_keys_down; // how many are down. can be > MAX_BOOT_KEYS, in which case keys_down[] isn't kept up to date
+static uint8_t usb_report[8]; // the boot report for the current matrix[], valid when !usb_report_dirty
+static uint8_t usb_report_dirty = 1;
+
+// rebuild keys_down[] and num_keys_down from scratch. needed when matrix[] was changed behind update_matrix()'s back,
+// or when we come back out of rollover and don't know which of the keys are the remaining ones
+static void rescan_keys_down(void) {
+    num_keys_down = 0;
+    for (uint8_t i=0; i<sizeof(matrix)-1; i++) {
+        uint8_t m = matrix[i];
+        uint8_t k = i<<3;
+        while (m) {
+            if (m & 1) {
+                if (num_keys_down < MAX_BOOT_KEYS)
+                    keys_down[num_keys_down] = k;
+                num_keys_down++;
+            }
+            m >>= 1;
+            k++;
+        }
+    }
+    usb_report_dirty = 1;
+}
+
+// key u (not a modifier) has just gone down in matrix[]
+static void key_went_down(uint8_t u) {
+    if (num_keys_down < MAX_BOOT_KEYS)
+        keys_down[num_keys_down] = u;
+    num_keys_down++;
+}
+
+// key u (not a modifier) has just gone up in matrix[]
+static void key_went_up(uint8_t u) {
+    num_keys_down--;
+    if (num_keys_down == MAX_BOOT_KEYS) {
+        // back out of rollover. keys_down[] is stale, so start over
+        rescan_keys_down();
+    } else if (num_keys_down < MAX_BOOT_KEYS) {
+        // remove u, keeping the rest in order
+        uint8_t i = 0;
+        while (keys_down[i] != u)
+            i++;
+        for (; i<num_keys_down; i++)
+            keys_down[i] = keys_down[i+1];
+    } // else we're still in rollover
+}
+
+// apply a (USB keycode | UP flag<<8) from ps2_to_usb_keycode() to matrix[], and to keys_down[]
+// returns true if the key changed state
+static uint8_t update_matrix(uint16_t mu) {
+    uint8_t u = (uint8_t)mu;
+    uint8_t up = mu>>8;
+    if (u && ((matrix[u>>3] >> (u&7)) & 1) == up) {
+        matrix[u>>3] ^= 1 << (u&7);
+        usb_report_dirty = 1;
+        if (u < 0xE0) {
+            if (up)
+                key_went_up(u);
+            else
+                key_went_down(u);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// key transitions waiting to go into a report
+// the host only sees matrix[] when it polls, so a key which goes down and back up between two polls, or the up of one
+// key and the down of the next, would get merged or lost. so instead main_tick() queues the transitions here, and each
+// IN report takes as many of them as it can without changing any key twice (see apply_pending()).
+// when the queue is empty a transition goes into the very next report, same as if it had gone straight into matrix[]
+#define PENDING_KEYS 16 // a power of 2
+static struct {
+    uint16_t mu; // from ps2_to_usb_keycode()
+    uint16_t rx; // when its last byte arrived, from ps2_read_time()
+} pending[PENDING_KEYS];
+static uint8_t pending_head, num_pending;
+
+// apply the oldest pending transition to matrix[]
+static void apply_oldest(void) {
+    uint8_t h = pending_head;
+    if (update_matrix(pending[h].mu))
+        latency_keystroke(pending[h].rx);
+    pending_head = (h+1) & (PENDING_KEYS-1);
+    num_pending--;
+}
+
+static void queue_key(uint16_t mu, uint16_t rx) {
+    if (!(uint8_t)mu)
+        return; // not a key
+    if (num_pending == PENDING_KEYS)
+        // no one has been reading reports (we're not configured yet, or the host stopped polling). fold the oldest into matrix[]
+        apply_oldest();
+    uint8_t t = (pending_head + num_pending) & (PENDING_KEYS-1);
+    pending[t].mu = mu;
+    pending[t].rx = rx;
+    num_pending++;
+}
+
+// apply the pending transitions to matrix[] up to the first which would change a key already changed by this batch
+// called as each IN report is built, so every transition is in some report the host reads, in order
+static void apply_pending(void) {
+    uint8_t changed[PENDING_KEYS];
+    uint8_t n = 0;
+    while (num_pending) {
+        uint16_t mu = pending[pending_head].mu;
+        uint8_t u = (uint8_t)mu;
+        if (((matrix[u>>3] >> (u&7)) & 1) == (mu>>8)) {
+            // it changes u. if u already changed in this report, that has to wait for the next one
+            for (uint8_t i=0; i<n; i++)
+                if (changed[i] == u)
+                    return;
+            changed[n++] = u;
+        } // else it's a no-op (a typematic repeat, most likely), and can go in any report
+        apply_oldest();
+    }
+}
+
+// the keystroke being typed for the host (see inject.h). it's pressed in one report, and released in the next
+static struct inject_stroke injected;
+static uint8_t injecting; // true while injected is pressed
+
+// called as each IN report is built, after apply_pending(). real is how many real key transitions were waiting for it
+static void next_injected(uint8_t real) {
+    if (injecting) {
+        injecting = 0; // and this report releases it
+        return;
+    }
+    if (real || !inject_peek(&injected))
+        return; // the real keys go first
+    uint8_t u = injected.key;
+    if (u && (((matrix[u>>3] >> (u&7)) & 1) || num_keys_down >= MAX_BOOT_KEYS))
+        return; // pressing a key held down for real wouldn't show, and releasing it would let go of the real one. and a full boot report has no room
+    inject_pop();
+    injecting = 1;
+}
+
+// put the injected keystroke into a report made by make_usb_report() or make_nkro_report(), in place of the real modifiers
+static void add_injected(uint8_t* report, uint8_t nkro) {
+    uint8_t u = injected.key;
+    report[0] = injected.mods;
+    if (!u)
+        return;
+    if (nkro) {
+        report[1 + (u>>3)] |= 1 << (u&7);
+    } else {
+        uint8_t j = 2;
+        while (j < 8 && report[j])
+            j++;
+        if (j < 8) // (next_injected() made sure there's room)
+            report[j] = u;
+    }
+}
+
+// the keys each keyboard (see ps2.h) holds down. matrix[] is the two merged: a key's reference count is how many of
+// the keyboards hold it, and its break only goes on to the layers once that is back to 0, so the same key held on
+// both doesn't come up when the first lets go of it. it's a bitmap per keyboard rather than a count, since set 2's
+// typematic repeats would count one keyboard's key again and again
+static uint8_t port_keys[PS2_PORTS][sizeof(matrix)];
+
+// let go of every key, including any still queued. their breaks would be decoded with a different table from their
+// makes, after the remapping changed, and come out as some other key, or not at all
+static void release_all_keys(void) {
+    layers_reset();
+    num_pending = 0;
+    memset(matrix, 0, sizeof(matrix));
+    memset(port_keys, 0, sizeof(port_keys));
+    rescan_keys_down();
+}
+
+// keyboard port sent AA: it was plugged back in, or browned out (ps2.c sets it up again). the breaks of the keys it
+// held are never coming, so make them up, through the layers like any other breaks and behind whatever is still
+// queued, the other keyboard's typing included. keys the other keyboard holds too stay down
+static void port_reset(uint8_t port, uint16_t rx) {
+    for (uint8_t i=0; i<sizeof(matrix); i++) {
+        uint8_t m = port_keys[port][i];
+        port_keys[port][i] = 0;
+        for (uint8_t p=0; p<PS2_PORTS; p++)
+            m &= ~port_keys[p][i];
+        for (uint8_t u=i<<3; m; u++, m>>=1)
+            if (m & 1)
+                layers_key(0x100 | u, rx, queue_key);
+    }
+}
+
+// decode byte c from keyboard port, which arrived at rx, and pass the key on unless the other keyboard still holds it
+static void key_from_port(uint8_t port, uint8_t c, uint16_t rx) {
+    uint16_t mu = ps2_to_usb_keycode(port, c); // (which also forgets any prefix it was in the middle of)
+    if (c == 0xAA) {
+        port_reset(port, rx);
+        return;
+    }
+    uint8_t u = (uint8_t)mu;
+    if (u) {
+        uint8_t bit = 1 << (u&7);
+        if (mu>>8) {
+            port_keys[port][u>>3] &= ~bit;
+            for (uint8_t p=0; p<PS2_PORTS; p++)
+                if (port_keys[p][u>>3] & bit)
+                    return;
+        } else {
+            port_keys[port][u>>3] |= bit; // (if the other keyboard holds it too, the make is like a typematic repeat)
+        }
+    }
+    layers_key(mu, rx, queue_key);
+}
+
 // build a USB keyboard report in the given 8-byte buffer
 static void make_usb_report(uint8_t* report) {
-    report[0] = matrix[0xE0/8];
-    report[1] = 0; // always 
-    uint8_t j = 2; // our index into the report[] 
-    // if we have debug stuff buffered up, send the next char
-    if (debug_tail != debug_head) {
-        uint8_t c = *debug_tail++;
-        uint8_t m = 0;
-        // convert ascii c into usb keycode
-        if ('a' <= c && c <= 'z')
-            c = c - 'a' + 4;
-        else if ('A' <= c && c <= 'Z') {
-            c = c - 'A' + 4;
-            m = 1<<1; // left shift key
-        } else if ('1' <= c && c <= '9')
-            c = c - '1' + 0x1e;
-        else switch (c) {
-          // decode a smattering of other chars
-          case '(': c = 0x26; m = 2; break;
-          case ')': m = 2; // fall through
-          case '0': c = 0x27; break;
-          case ' ': c = 0x2c; break;
-          case '_': m = 2; // fall through
-          case '-': c = 0x2d; break;
-          case '+': m = 2; // fall through
-          case '=': c = 0x2e; break;
-          case '[': c = 0x2f; break;
-          case ']': c = 0x30; break;
-          case ';': c = 0x33; break;
-          case ',': c = 0x36; break;
-          case '.': c = 0x37; break;
-          case '/': c = 0x38; break;
-          case '\n': c = 0x28; break;
-          default: c = 0x55; // keypad '*' for non-decoding chars
+    if (usb_report_dirty) {
+        usb_report_dirty = 0;
+        usb_report[0] = matrix[0xE0/8];
+        usb_report[1] = 0; // always
+        uint8_t j = 0;
+        if (num_keys_down > MAX_BOOT_KEYS) {
+            // overflow; sent a report array filled with 0x01
+            for (; j<MAX_BOOT_KEYS; j++)
+                usb_report[2+j] = 0x01;
+        } else {
+            for (; j<num_keys_down; j++)
+                usb_report[2+j] = keys_down[j];
+            // zero out the rest of the report
+            for (; j<MAX_BOOT_KEYS; j++)
+                usb_report[2+j] = 0;
         }
-        report[0] = m; // just stomp it, in case other keys are held down right now
-        report[j++] = c;
-    } else
-    for (uint8_t i=0; i<sizeof(matrix)-1; i++) {
-        uint8_t m = matrix[i];
-        if (m) {
-            // one or more bits are set; decode which they are and encode those keys
-            uint8_t k = i<<3;
-            do {
-                if (m & 1) {
-                    // key k is pressed
-                    if (j < 8)
-                        report[j++] = k;
-                    else {
-                        // overflow; sent a report array filled with 0x01
-                        report[2] = report[3] = report[4] = report[5] = report[6] = report[7] = 0x01;
-                        return;
-                    }
-                }
-                m >>= 1;
-                k++;
-            } while (m);
-        } // else skip the whole byte m and move on
     }
-    // zero out the rest of the report
-    while (j < 8)
-        report[j++] = 0;
+    memcpy(report, usb_report, 8);
+}
+
+// build an N-key-rollover report (see usb_nkro_report_desc in descriptors.c) in the given NKRO_REPORT_SIZE-byte buffer
+// it's the modifier keys followed by the rest of matrix[], as-is
+static void make_nkro_report(uint8_t* report) {
+    report[0] = matrix[0xE0/8];
+    memcpy(report+1, matrix, 0xE0/8);
 }
 
 //-------------------------------------------------------------------------
@@ -338,26 +498,57 @@ static uint8_t prev_report[8];
 
 static USB_ClassInfo_HID_Device_t usb_hid_keyboard = {
     .Config = {
-        .InterfaceNumber = 0,
+        .InterfaceNumber = KEYBOARD_INTERFACE,
         .ReportINEndpoint = {
-            .Address = ENDPOINT_DIR_IN | 1,
-            .Size = 8,
-            .Banks = 1,
+            .Address = KEYBOARD_IN_EPADDR,
+            .Size = KEYBOARD_IN_EPSIZE,
+            .Banks = 2, // so the next report can be loaded while the host hasn't yet read out the last one
         },
         .PrevReportINBuffer         = prev_report,
         .PrevReportINBufferSize     = sizeof(prev_report),
     },
     // and the rest is init'ed to 0 and maintained by the HID class driver
+    // (including State.UsingReportProtocol, which tracks the host's SET_PROTOCOL and is reset to report protocol at each SetConfig)
 };
 
+static uint8_t prev_nkro_report[NKRO_REPORT_SIZE];
 
-static uint8_t usb_report_proto; // we don't use this, but we need to keep track for the host of whether we are in the normal or boot report mode. 1=normal, 0=boot (matches what USB HID sends)
+static USB_ClassInfo_HID_Device_t usb_hid_nkro = {
+    .Config = {
+        .InterfaceNumber = NKRO_INTERFACE,
+        .ReportINEndpoint = {
+            .Address = NKRO_IN_EPADDR,
+            .Size = NKRO_IN_EPSIZE,
+            .Banks = 2,
+        },
+        .PrevReportINBuffer         = prev_nkro_report,
+        .PrevReportINBufferSize     = sizeof(prev_nkro_report),
+    },
+};
+
+static uint8_t prev_mouse_report[sizeof(struct mouse_report)];
+
+static USB_ClassInfo_HID_Device_t usb_hid_mouse = {
+    .Config = {
+        .InterfaceNumber = MOUSE_INTERFACE,
+        .ReportINEndpoint = {
+            .Address = MOUSE_IN_EPADDR,
+            .Size = MOUSE_IN_EPSIZE,
+            .Banks = 1, // so a report is only made once the host has taken the last one, and has all the movement up to then
+        },
+        .PrevReportINBuffer         = prev_mouse_report,
+        .PrevReportINBufferSize     = sizeof(prev_mouse_report),
+    },
+};
+
+// whether the host is reading the NKRO interface. a host in report protocol doesn't have to be; it might not have
+// a driver bound to interface 2, or might be some half-baked HID stack which only looks at the first keyboard it finds.
+// so until the host reads out an NKRO report the boot keyboard keeps sending 6-key reports as well
+static uint8_t nkro_state; // 0=haven't sent an NKRO report yet, 1=sent one, waiting for the host to read it, 2=host has read it; NKRO is live
 
 // USB bus is connected and USB host is enumerating us
 void EVENT_USB_Device_Connect(void) {
     //PORTE = 1<<6; // light LED for debug
-    // just in case we happened to have power before this (if we were not USB bus powered) reset our USB state
-    usb_report_proto = 1; // go back to normal report protocol (not that we do anything with it)
 }
 
 // USB host is sending a SetConfig packet. it's time to setup the endpoints
@@ -366,22 +557,51 @@ void EVENT_USB_Device_ConfigurationChanged(void) {
     //PORTE = 1<<6; // light LED for debug
     //Endpoint_ConfigureEndpoint(ENDPOINT_DIR_IN|1, EP_TYPE_INTERRUPT, 8, 1);
     HID_Device_ConfigureEndpoints(&usb_hid_keyboard);
+    HID_Device_ConfigureEndpoints(&usb_hid_nkro); // endpoint 3 for the NKRO keyboard
+    HID_Device_ConfigureEndpoints(&usb_hid_mouse); // endpoint 4 for the mouse
+    nkro_state = 0; // we have to find out again whether the host reads it
+    diag_configure(); // and endpoint 2 for the diagnostics interface
     USB_Device_EnableSOFEvents(); // enable EVENT_USB_Device_StartOfFrame() callback
 }
 
-// called when the SOF packet is seen [once a millisecond). the HID class driver uses these ticks to handle the Idle timeouts
+// called when the SOF packet is seen [once a millisecond). the HID class driver uses these ticks to handle the Idle timeouts.
+// this runs inside LUFA's USB_GEN_vect with interrupts off, so it only counts them, and main_tick() passes them on
+static volatile uint8_t frames_elapsed;
+
 void EVENT_USB_Device_StartOfFrame(void) {
-    HID_Device_MillisecondElapsed(&usb_hid_keyboard);
+    uint16_t start = budget_start();
+    frames_elapsed++;
+    budget_end(BUDGET_SOF, start);
+}
+
+// the host suspends the bus when it goes to sleep (or just has no use for us for a while), and resumes it later.
+// LUFA calls these from USB_GEN_vect, so they only note it, and main_tick() does the rest
+static volatile uint8_t usb_suspended;
+
+void EVENT_USB_Device_Suspend(void) {
+    usb_suspended = 1;
+}
+
+void EVENT_USB_Device_WakeUp(void) {
+    usb_suspended = 0;
 }
 
 // USB host send a control packet
 // the lightly decoded packet is stored in the global USB_ControlRequest
 void EVENT_USB_Device_ControlRequest(void) {
+    // each class driver ignores requests addressed to interfaces other than its own
     HID_Device_ProcessControlRequest(&usb_hid_keyboard);
+    HID_Device_ProcessControlRequest(&usb_hid_nkro);
+    HID_Device_ProcessControlRequest(&usb_hid_diag);
+    HID_Device_ProcessControlRequest(&usb_hid_mouse);
 }
 
+static uint8_t host_leds; // the keyboard LEDs the host last asked for, in PS/2 order
+
 void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const intf, const uint8_t id, const uint8_t type, const void* data, const uint16_t len) {
-    if (len == 1) {
+    if (intf == &usb_hid_diag) {
+        diag_process_report(id, type, data, len);
+    } else if (len == 1 && intf != &usb_hid_mouse) {
         // set the keyboard LEDs given the lower bits of report[0]
         uint8_t led = *(const uint8_t*)data;
         // conveniently the USB and PS/2 encodings of the LED bits are different :-)
@@ -397,27 +617,240 @@ void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const intf
         //  bit 2...CapsLock
         led = (led << 1) | ((led >> 2) & 1);
         led &= 7; // remove extra ScrollLock bit as well as any Compose/Kana and other garbage
-        ps2_set_leds(led);
+        host_leds = led; // (so they can be put back after a suspend)
+        ps2_update_leds(led); // and don't wait around for the keyboard to do it; we're in the middle of a control request
     } // else we don't understand what the host just sent, so do nothing
 }
 
+// set while a report is being made for an IN endpoint, by HID_Device_USBTask() or load_report(). LUFA asks for a
+// GET_REPORT(Input) over the control endpoint with HID_REPORT_ITEM_In too, and that must not take anything (queued key
+// transitions, typing, mouse movement) away from the reports the interrupt endpoints send
+static uint8_t filling_endpoint;
+
+// the mouse's report (see mouse.h). only an IN endpoint's report takes the movement out of what's been added up; a
+// GET_REPORT over the control endpoint just gets the buttons
+static bool make_mouse_report(uint8_t* const id, void* data, uint16_t* const len) {
+    struct mouse_report* r = (struct mouse_report*)data;
+    uint8_t boot = !usb_hid_mouse.State.UsingReportProtocol;
+    *id = 0;
+    *len = boot ? 3 : sizeof(*r); // the boot mouse report has no wheel
+    if (!filling_endpoint) {
+        memset(r, 0, sizeof(*r));
+        r->buttons = mouse_buttons();
+        return false;
+    }
+    // movement has to go out even when it's the same as last time's
+    return mouse_make_report(r, boot);
+}
+
 bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const intf, uint8_t* const id, const uint8_t type, void* data, uint16_t* const len) {
+    if (intf == &usb_hid_diag)
+        return diag_create_report(id, type, data, len);
+    if (intf == &usb_hid_mouse)
+        return make_mouse_report(id, data, len);
+
     uint8_t* report = (uint8_t*)data;
+    uint8_t in = type == HID_REPORT_ITEM_In && filling_endpoint; // (anything else is a snapshot, for the control endpoint)
+    *id = 0; // we aren't using report IDs on the keyboard interfaces since each has only one possible report to send to the host
+    // the protocol is selected on the boot keyboard's interface; that's the one the BIOS talks to
+    uint8_t report_proto = usb_hid_keyboard.State.UsingReportProtocol;
+
+    // whichever interface the host is taking the keys from gets the next batch of key transitions, and the typing
+    uint8_t active = intf == (report_proto && nkro_state == 2 ? &usb_hid_nkro : &usb_hid_keyboard);
+    if (in && active) {
+        uint8_t real = num_pending;
+        apply_pending();
+        next_injected(real);
+    }
+
+    if (intf == &usb_hid_nkro) {
+        if (!report_proto) {
+            // in boot protocol the boot keyboard does all the work, and this interface stays quiet
+            *len = 0;
+            return false;
+        }
+        *len = NKRO_REPORT_SIZE;
+        make_nkro_report(report);
+        if (injecting && active)
+            add_injected(report, 1);
+        if (!in)
+            return false; // a GET_REPORT over the control endpoint says nothing about whether the interrupt endpoint is being read
+        // the class driver has the endpoint selected. once neither bank holds a report the host has read the one we sent
+        if (nkro_state == 1 && !Endpoint_GetBusyBanks())
+            nkro_state = 2;
+        if (latency_pending && memcmp(report, prev_nkro_report, sizeof(prev_nkro_report)))
+            latency_report(NKRO_IN_EPADDR);
+        if (!nkro_state) {
+            // always send the first report, so we find out whether anyone reads them
+            nkro_state = 1;
+            return true;
+        }
+        return false;
+    }
+
     *len = 8;
-    *id = 0; // we aren't using report IDs since we only have one possible report to send to the host
-    make_usb_report(report);
+    if (report_proto && nkro_state == 2)
+        // the keys are going out on the NKRO interface. send nothing here, or else the host would see each key twice
+        memset(report, 0, 8);
+    else
+        make_usb_report(report);
+    if (injecting && active)
+        add_injected(report, 0);
+    // if this report differs from the last one the class driver is going to send it, and with it any key transition we are timing
+    if (in && latency_pending && memcmp(report, prev_report, sizeof(prev_report)))
+        latency_report(KEYBOARD_IN_EPADDR);
     return false; // let HID class driver decide if this new report should be sent
 }
 
 
 //-------------------------------------------------------------------------
 
-int main(void) {
+// set while main_tick() is running, so keys_from_isr() knows to keep its hands off the key queue and the endpoints
+static volatile uint8_t in_main_tick;
+
+// one pass of the main loop, run each time something wakes us up
+// (split out of main() so the host build in host/ can drive it too)
+// while the bus is suspended the keyboard LEDs are off, and once the PS/2 side has nothing left to do we sleep in
+// standby instead of idle (see main()). a key transition then asks the host to resume the bus, if the host allowed
+// that, and waits in pending[] until the host polls for it. if the host didn't, the transitions just update matrix[],
+// so the first report after the host resumes shows the keys held down then, and not ones typed while it slept
+#define REMOTE_WAKEUP_DELAY_US 3000 // LUFA tells us after 3 msec of idle bus, and we mustn't signal resume until after 5
+static uint8_t suspended; // usb_suspended, as of the last main_tick()
+static uint8_t wakeup_sent;
+static uint32_t suspend_time; // now_us() when suspended was set
+
+static void suspend_tick(void) {
+    if (suspended != usb_suspended) {
+        suspended = usb_suspended;
+        ps2_update_leds(suspended ? 0 : host_leds);
+        mouse_forget(); // the mouse doesn't wake the host, and what it did while the host slept is of no use afterwards
+        wakeup_sent = 0;
+        suspend_time = now_us();
+    }
+    if (suspended && num_pending) {
+        if (!USB_Device_RemoteWakeupEnabled) {
+            while (num_pending)
+                apply_oldest();
+        } else if (!wakeup_sent && now_us() - suspend_time >= REMOTE_WAKEUP_DELAY_US) {
+            USB_Device_SendRemoteWakeup();
+            wakeup_sent = 1; // once is enough; the host resumes the bus, or it doesn't want to
+        }
+    }
+}
+
+// can main() sleep in standby, which stops the I/O clock (so the timers and the UART) and the 1 msec wakeups?
+static uint8_t can_standby(void) {
+    return suspended && ps2_idle() && !capture_running() && !remap_busy() && !layers_waiting() && mouse_idle() && now_us() - suspend_time >= REMOTE_WAKEUP_DELAY_US;
+}
+
+static void main_tick(void) {
+    in_main_tick = 1;
+    suspend_tick();
+    ps2_tick();
+    if (remap_tick()) {
+        // a new remapping was uploaded. (keys_from_isr() isn't decoding anything while in_main_tick is set)
+        keycodes_reload();
+        release_all_keys();
+    }
+    layers_tick(queue_key); // before any new bytes, which came after a deadline which has passed
+
+    while (ps2_available()) {
+        uint8_t c = ps2_read();
+        key_from_port(ps2_read_port(), c, ps2_read_time());
+
+        // for debug, blink out the PS/2 code and the USB code
+        //static uint8_t blinkie;
+        //if (blinkie) blink_byte(c);
+        //if (blinkie && u) blink_byte(u);
+        //blinkie ^= (mu == 0x56); // keypad '-' toggles blinkie
+    }
+
+    if (1) {
+        cli();
+        uint8_t ms = frames_elapsed;
+        frames_elapsed = 0;
+        sei();
+        while (ms--) {
+            HID_Device_MillisecondElapsed(&usb_hid_keyboard);
+            HID_Device_MillisecondElapsed(&usb_hid_nkro);
+            HID_Device_MillisecondElapsed(&usb_hid_mouse);
+        }
+        filling_endpoint = 1;
+        HID_Device_USBTask(&usb_hid_keyboard);
+        HID_Device_USBTask(&usb_hid_nkro);
+        // the mouse only once the keyboard's report is on its way
+        mouse_tick();
+        HID_Device_USBTask(&usb_hid_mouse);
+        filling_endpoint = 0;
+        HID_Device_USBTask(&usb_hid_diag);
+        latency_arm();
+        USB_USBTask();
+    }
+    in_main_tick = 0;
+}
+
+// the fast path, which main() installs as ps2_rx_hook. USART1_RX_vect calls it as each byte arrives, and it decodes
+// the byte right there and, if the endpoint has a free bank, loads the new report into it. That saves waiting for
+// the main loop to wake up, get around to the byte and then to HID_Device_USBTask(), and for the next frame if
+// HID_Device_USBTask() already sent a report in this one.
+#ifndef DECODE_IN_ISR
+#define DECODE_IN_ISR 1
+#endif
+
+// do what HID_Device_USBTask() would, for the interface the host is taking the keys from
+static void load_report(void) {
+    USB_ClassInfo_HID_Device_t* intf = usb_hid_keyboard.State.UsingReportProtocol && nkro_state == 2 ? &usb_hid_nkro : &usb_hid_keyboard;
+    uint8_t ep = Endpoint_GetCurrentEndpoint();
+    Endpoint_SelectEndpoint(intf->Config.ReportINEndpoint.Address);
+    if (Endpoint_IsReadWriteAllowed()) {
+        uint8_t report[NKRO_REPORT_SIZE];
+        uint8_t id;
+        uint16_t len = 0;
+        filling_endpoint = 1;
+        CALLBACK_HID_Device_CreateHIDReport(intf, &id, HID_REPORT_ITEM_In, report, &len);
+        filling_endpoint = 0;
+        if (len && memcmp(report, intf->Config.PrevReportINBuffer, len)) {
+            memcpy(intf->Config.PrevReportINBuffer, report, len);
+            Endpoint_Write_Stream_LE(report, len, NULL);
+            Endpoint_ClearIN();
+            intf->State.IdleMSRemaining = intf->State.IdleCount;
+            latency_arm();
+        }
+    }
+    Endpoint_SelectEndpoint(ep);
+}
+
+static void keys_from_isr(void) {
+    if (in_main_tick)
+        return; // we interrupted the main loop, which will deal with the byte itself
+    do {
+        while (ps2_available()) {
+            uint8_t c = ps2_read();
+            key_from_port(ps2_read_port(), c, ps2_read_time());
+        }
+        if (USB_DeviceState == DEVICE_STATE_Configured)
+            load_report();
+        // USART1_RX_vect doesn't call us again for a byte which arrives while we are running, so look for one
+    } while (ps2_available());
+}
 
-    // init timer0 sufficiently that TIMER0_OVF_vect() and thus millis() will work
+// timer0 used to keep millis() for us, arduino style. the time comes from Timer1 now (see timebase.h), and timer0
+// is only left to wake the main loop every msec. USB needs that while it enumerates: LUFA polls for control requests,
+// and there are no SOF events until we're configured
+ISR(TIMER0_OVF_vect) {
+}
+
+// start timer0 overflowing (and so waking us) every 1.024 msec
+static void timer0_init(void) {
     TCCR0A = 0;
     TCCR0B = _BV(CS00) | _BV(CS01); // /64 prescalar
     TIMSK0 = _BV(TOIE0); // enable overflow interrupt
+}
+
+int main(void) {
+
+    timer0_init();
+    timebase_init();
 
     // make bit 6 (the LED) an output for testing/status
     DDRE = 1<<6;
@@ -425,17 +858,26 @@ int main(void) {
     PORTE = 1<<6;
 
     ps2_init();
+    mouse_init(); // it sets itself up from the main loop, in the background
+    remap_init();
 
     USB_Init();
     
     // now that everything is setup, enable interrupts
     sei();
 
-    // put the keyboard in the easiest scan set for us to deal with
-    ps2_set_scan_set(3);
-    // set all keys to make/break with no repeat (USB does the repeat at the host side)
-    _delay_us(1000);
-    ps2_write_and_ack(0xf8);
+    // put the keyboard in the easiest scan set for us to deal with, if it will go. some keyboards refuse set 3,
+    // and some ACK it and then stay in set 2 anyhow, so ask it afterwards too
+    if (ps2_set_scan_set(3) && ps2_get_scan_set() != 2) {
+        keycodes_select_set(0, 3);
+        // set all keys to make/break with no repeat (USB does the repeat at the host side)
+        _delay_us(1000);
+        ps2_write_and_ack(0xf8);
+    } else {
+        // make sure it's in set 2, which every keyboard does. the typematic repeats it sends in set 2 don't change matrix[], so they are harmless
+        ps2_set_scan_set(2);
+        keycodes_select_set(0, 2);
+    }
 
     // and show a rapid pattern on the keyboard LEDs to indicate
     // we have a succesfull connection over PS/2
@@ -450,91 +892,31 @@ int main(void) {
         PORTE = 0;
     } // else leave it on since it seems something is not right
 
+    if (DECODE_IN_ISR)
+        ps2_rx_hook = keys_from_isr;
+
     while (1) {
         if (1) {
             // sleep until there's something of interest
-            set_sleep_mode(SLEEP_MODE_IDLE);
-            sleep_enable();
-            sleep_cpu();
-            // <sleeping>
-            sleep_disable();
-        }
-
-        ps2_tick();
-
-        if (ps2_available()) {
-            uint8_t c = ps2_read();
-            uint16_t mu = ps2_to_usb_keycode(c);
-            uint8_t u = (uint8_t)mu;
-            uint8_t up = mu>>8;
-            if (u && ((matrix[u>>3] >> (u&7)) & 1) == up) {
-                matrix[u>>3] ^= 1 << (u&7);
+            // but not if a byte arrived while main_tick() was running; keys_from_isr() left that one for us.
+            // (sei() takes effect after the next instruction, so no interrupt can sneak in between it and the sleep)
+            // while the bus is suspended we can sleep deeper, until the keyboard starts to send or the host resumes the bus
+            // (USB_GEN_vect's wakeup interrupt works without the I/O clock). now_us() stands still meanwhile
+            uint8_t standby = can_standby();
+            set_sleep_mode(standby ? SLEEP_MODE_STANDBY : SLEEP_MODE_IDLE);
+            cli();
+            if (!ps2_available()) {
+                if (standby)
+                    ps2_wake_on_data();
+                sleep_enable();
+                sei();
+                sleep_cpu();
+                // <sleeping>
+                sleep_disable();
             }
-
-            // for debug, blink out the PS/2 code and the USB code
-            //static uint8_t blinkie;
-            //if (blinkie) blink_byte(c);
-            //if (blinkie && u) blink_byte(u);
-            //blinkie ^= (mu == 0x56); // keypad '-' toggles blinkie
+            sei();
         }
 
-        if (1) {
-            HID_Device_USBTask(&usb_hid_keyboard);
-            USB_USBTask();
-        }
+        main_tick();
     }
 }
-
-// pull in pieces of arduino standard library that we need for millis() to work
-// (nice and quick and a dirty hack :-)
-
-
-volatile unsigned long timer0_millis = 0;
-static unsigned char timer0_fract = 0;
-
-unsigned long millis() {
-    unsigned long m;
-    uint8_t oldSREG = SREG;
-
-    // disable interrupts while we read timer0_millis or we might get an
-    // inconsistent value (e.g. in the middle of a write to timer0_millis)
-    cli();
-    m = timer0_millis;
-    SREG = oldSREG;
-
-    return m;
-}
-
-#define clockCyclesPerMicrosecond() ( F_CPU / 1000000L )
-#define clockCyclesToMicroseconds(a) ( (a) / clockCyclesPerMicrosecond() )
-
-// the prescaler is set so that timer0 ticks every 64 clock cycles, and the
-// the overflow handler is called every 256 ticks.
-#define MICROSECONDS_PER_TIMER0_OVERFLOW (clockCyclesToMicroseconds(64 * 256))
-
-// the whole number of milliseconds per timer0 overflow
-#define MILLIS_INC (MICROSECONDS_PER_TIMER0_OVERFLOW / 1000)
-
-// the fractional number of milliseconds per timer0 overflow. we shift right
-// by three to fit these numbers into a byte. (for the clock speeds we care
-// about - 8 and 16 MHz - this doesn't lose precision.)
-#define FRACT_INC ((MICROSECONDS_PER_TIMER0_OVERFLOW % 1000) >> 3)
-#define FRACT_MAX (1000 >> 3)
-
-ISR(TIMER0_OVF_vect) {
-    // copy these to local variables so they can be stored in registers
-    // (volatile variables must be read from memory on every access)
-    unsigned long m = timer0_millis;
-    unsigned char f = timer0_fract;
-
-    m += MILLIS_INC;
-    f += FRACT_INC;
-    if (f >= FRACT_MAX) {
-        f -= FRACT_MAX;
-        m += 1;
-    }
-
-    timer0_fract = f;
-    timer0_millis = m;
-}
-
@@ -0,0 +1,263 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include "mouse.h"
+#include "ps2.h"
+#include "budget.h"
+#include "trace.h"
+#include "ps2soft.h"
+
+//-------------------------------------------------------------------------
+// the wires, in INT0_vect (see ps2soft.h)
+
+#define RX_BYTES 16 // the bytes waiting for mouse_tick(). a power of 2, and at most 128
+#define RX_ERROR PS2SOFT_ERROR // in rx[]: a frame went wrong here, so the packet it was part of is lost
+
+static struct ps2soft wires = PS2SOFT_PORT(MOUSE_CLK_PIN, MOUSE_DATA_PIN, INTF0);
+static volatile uint16_t rx[RX_BYTES];
+static volatile uint8_t rx_head, rx_tail; // bytes go in at rx[rx_head % RX_BYTES] and come out at rx_tail
+
+ISR(INT0_vect) {
+    uint16_t start = budget_start();
+    uint16_t c = ps2soft_edge(&wires, start);
+    if (c != PS2SOFT_NONE) {
+        if ((uint8_t)(rx_head - rx_tail) == RX_BYTES) {
+            // mouse_tick() has fallen way behind. the newest byte is lost, and the packet it was part of with it
+            rx[(rx_head-1) & (RX_BYTES-1)] = RX_ERROR;
+        } else {
+            rx[rx_head & (RX_BYTES-1)] = c;
+            rx_head++;
+        }
+    }
+    budget_end(BUDGET_MOUSE, start);
+}
+
+//-------------------------------------------------------------------------
+// the setup, in mouse_tick()
+
+// each byte is answered with FA. the reset's answer goes on with AA 00 once the self test is done, and Get ID's
+// with the ID, which is 03 if the knock turned on the wheel. the sample rate is set last, since the knock changes it
+static const uint8_t PROGMEM setup[] = {
+    0xFF,             // reset
+    0xF3, 200,        // the IntelliMouse knock: sample rates of 200, 100 and 80
+    0xF3, 100,
+    0xF3, 80,
+    0xF2,             // get ID
+    0xF3, 200,        // 200 samples a second, the most there is
+    0xF4,             // start streaming
+};
+
+#define REPLY_US 25000 // for the answer to a byte. the spec says 25 msec
+#define BAT_US 1000000 // for the reset's self test to finish. the spec says 500 to 750 msec
+
+enum { MOUSE_ABSENT, MOUSE_SETUP, MOUSE_STREAM };
+static uint8_t state;
+static uint8_t step; // the byte of setup[] being sent or answered
+static uint8_t replies; // how many answers to it there have been
+static uint32_t since; // now_us() of the last thing which happened
+static uint8_t wheel; // the mouse sends 4-byte packets, with the wheel in the last
+static uint8_t packet[4]; // the one coming in, once it's streaming
+static uint8_t packet_len;
+
+static void setup_send(void) {
+    replies = 0;
+    ps2soft_send(&wires, pgm_read_byte(&setup[step]));
+}
+
+static void setup_start(uint8_t s) {
+    state = MOUSE_SETUP;
+    step = s;
+    since = now_us();
+    setup_send();
+}
+
+static void setup_failed(void) {
+    if (step || replies) // (not every retry while there's no mouse)
+        trace(TRACE_MOUSE_FAILED, pgm_read_byte(&setup[step]));
+    ps2soft_stop(&wires);
+    state = MOUSE_ABSENT;
+    since = now_us();
+}
+
+// a mouse has just been plugged in (or reset), and sent AA. the ID comes next; then set it up
+static void plugged_in(void) {
+    state = MOUSE_SETUP;
+    step = 0;
+    replies = 2; // as if we'd reset it ourselves
+    since = now_us();
+}
+
+static void setup_reply(uint16_t c) {
+    uint8_t cmd = pgm_read_byte(&setup[step]);
+    if (c == RX_ERROR || (!replies && c != 0xFA) || (cmd == 0xFF && replies == 1 && c != 0xAA)) {
+        setup_failed(); // not what it should have said. (or FE, resend, which isn't worth the trouble; start over)
+        return;
+    }
+    if (cmd == 0xF2 && replies == 1)
+        wheel = c == 0x03;
+    since = now_us();
+    if (++replies < (cmd == 0xFF ? 3 : cmd == 0xF2 ? 2 : 1))
+        return;
+    if (++step < sizeof(setup)) {
+        setup_send();
+        return;
+    }
+    trace(TRACE_MOUSE_READY, wheel);
+    state = MOUSE_STREAM;
+    packet_len = 0;
+}
+
+//-------------------------------------------------------------------------
+// the packets, added up until the host polls for them
+
+#define BATCHES 4 // how many button changes the host can fall behind by before they start to merge
+static struct batch {
+    uint8_t buttons;
+    int16_t x, y, wheel;
+} batches[BATCHES];
+static uint8_t num_batches = 1; // batches[0] goes in the next report, and the packets are added to batches[num_batches-1]
+
+static int16_t add(int16_t sum, int16_t d) {
+    int16_t s = sum + d; // (d is at most 255 either way)
+    if (d > 0 && s < sum)
+        return INT16_MAX;
+    if (d < 0 && s > sum)
+        return INT16_MIN;
+    return s;
+}
+
+static void add_packet(void) {
+    uint8_t b = packet[0] & 7; // left, right and middle, the same as USB
+    struct batch* last = &batches[num_batches-1];
+    if (b != last->buttons) {
+        if (num_batches < BATCHES) {
+            last = &batches[num_batches++];
+            last->x = last->y = last->wheel = 0;
+        } // else the host is that far behind; the change goes in with the last one
+        last->buttons = b;
+    }
+    // 9 bit deltas, the sign bits in the first byte. PS/2 counts up as positive, USB down; and the wheel is the other
+    // way around as well. (the overflow bits are no use; the count is already as far as it goes)
+    last->x = add(last->x, packet[1] - (packet[0] & 0x10 ? 256 : 0));
+    last->y = add(last->y, -(packet[2] - (packet[0] & 0x20 ? 256 : 0)));
+    if (wheel)
+        last->wheel = add(last->wheel, -(int8_t)packet[3]);
+}
+
+static void stream_byte(uint16_t c) {
+    if (c == RX_ERROR) {
+        packet_len = 0; // and the rest of it is skipped, until a byte which can start a packet
+        return;
+    }
+    if (!packet_len && !(c & 0x08))
+        return; // the first byte always has bit 3 set. this isn't one, so we're out of step
+    packet[packet_len++] = c;
+    if (packet_len == 2 && packet[0] == 0xAA && packet[1] == 0x00) {
+        // not a packet; the mouse was unplugged, and this is another one's power up (the same as Linux decides it).
+        // that was the reset's answer, so go on from there
+        packet_len = 0;
+        setup_start(1);
+        return;
+    }
+    if (packet_len == (wheel ? 4 : 3)) {
+        add_packet();
+        packet_len = 0;
+    }
+}
+
+//-------------------------------------------------------------------------
+
+void mouse_init(void) {
+    ps2soft_init(&wires);
+    EICRA = (EICRA & ~_BV(ISC00)) | _BV(ISC01); // INT0 on the falling edge
+    EIFR = _BV(INTF0);
+    EIMSK |= _BV(INT0);
+    // a mouse plugged in with us sends AA after its self test, which starts the setup. if it doesn't, try a reset in a while
+    state = MOUSE_ABSENT;
+    since = now_us();
+}
+
+void mouse_tick(void) {
+    if (ps2soft_sending(&wires)) {
+        uint8_t r = ps2soft_tick(&wires);
+        if (!r)
+            return;
+        if (r == 2) {
+            setup_failed(); // no mouse, most likely
+            return;
+        }
+        since = now_us();
+    }
+
+    while (rx_head != rx_tail) {
+        uint16_t c = rx[rx_tail & (RX_BYTES-1)];
+        rx_tail++;
+        if (state == MOUSE_STREAM) {
+            stream_byte(c);
+        } else if (state == MOUSE_SETUP) {
+            setup_reply(c);
+            if (ps2soft_sending(&wires))
+                return; // the rest are the next byte's
+        } else if (c == 0xAA) {
+            plugged_in();
+        }
+    }
+
+    uint32_t waited = now_us() - since;
+    if (state == MOUSE_ABSENT && waited >= MOUSE_RETRY_US)
+        setup_start(0);
+    else if (state == MOUSE_SETUP && waited >= (step == 0 && replies == 1 ? BAT_US : REPLY_US))
+        setup_failed();
+}
+
+uint8_t mouse_idle(void) {
+    // the setup's timeouts need now_us() to keep going
+    return ps2soft_idle(&wires) && state != MOUSE_SETUP;
+}
+
+static int8_t take(int16_t* sum) {
+    int16_t v = *sum > 127 ? 127 : *sum < -127 ? -127 : *sum;
+    *sum -= v;
+    return v;
+}
+
+uint8_t mouse_make_report(struct mouse_report* r, uint8_t boot) {
+    struct batch* b = &batches[0];
+    r->buttons = b->buttons;
+    r->x = take(&b->x);
+    r->y = take(&b->y);
+    r->wheel = take(&b->wheel); // (and in boot protocol it goes nowhere)
+    if (!b->x && !b->y && !b->wheel && num_batches > 1) {
+        // this batch is all reported. the next has the next state of the buttons
+        num_batches--;
+        for (uint8_t i=0; i<num_batches; i++)
+            batches[i] = batches[i+1];
+    }
+    return r->x || r->y || (r->wheel && !boot);
+}
+
+uint8_t mouse_buttons(void) {
+    return batches[0].buttons;
+}
+
+void mouse_forget(void) {
+    batches[0] = batches[num_batches-1];
+    num_batches = 1;
+    batches[0].x = batches[0].y = batches[0].wheel = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// a PS/2 mouse on a second port, passed through to the host as a USB mouse
+//
+// the UART is the keyboard's, so the mouse's Clk is on INT0 and its ISR clocks the bits in (and out) one at a time
+// (see ps2soft.h). it does no more than that, so it's a few usec each time, and everything else happens in
+// mouse_tick() from the main loop, after the keyboard has had its turn. nothing on the keyboard's side ever waits for the mouse.
+//
+// mouse_tick() resets the mouse and sets it up without blocking: 200 samples a second (F3 C8), the IntelliMouse
+// knock (F3 C8 F3 64 F3 50) to turn on the wheel if it has one, and then stream mode. it starts over whenever a mouse
+// is plugged in (it sends AA 00 when it powers up), and tries again every MOUSE_RETRY_US while there is none.
+//
+// the host polls far less often than the mouse sends, so the movements of all the packets since the last poll are
+// added up and go out in one report. a report carries at most 127 each way, and whatever is left over goes in the next
+// one, so no motion is dropped. a button which goes down and back up between two polls would be lost that way, so
+// the movement is only added up while the buttons stay the same; each change of the buttons starts a new report.
+
+#ifndef MOUSE_H
+#define MOUSE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MOUSE_CLK_PIN  PD0 // must be INT0, whose ISR does the clocking
+#define MOUSE_DATA_PIN PD1
+
+#define MOUSE_RETRY_US 1000000 // how often to look for a mouse when there isn't one
+
+// the report on the mouse interface (see usb_mouse_report_desc in descriptors.c). the first three bytes are the boot
+// protocol's, and the wheel is left off in boot protocol
+struct mouse_report {
+    uint8_t buttons; // bit 0 is the left button, 1 the right, 2 the middle
+    int8_t x, y; // right and down are positive
+    int8_t wheel; // away from the user is positive
+};
+
+void mouse_init(void);
+void mouse_tick(void); // runs the setup, and adds up the packets which have come in
+uint8_t mouse_idle(void); // true when nothing is going on which needs the timers (so main() can sleep in standby)
+
+// fill in the next report, taking the movement it carries out of what's been added up. returns true if it has
+// movement in it, which must go to the host even if it looks like the last report. boot leaves out the wheel
+uint8_t mouse_make_report(struct mouse_report* r, uint8_t boot);
+uint8_t mouse_buttons(void); // the buttons the next report has, for a GET_REPORT (which mustn't take any movement)
+void mouse_forget(void); // drop the movement which hasn't been reported yet (it happened while the host slept)
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
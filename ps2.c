@@ -17,22 +17,86 @@
  * 
  */
 
+#include <string.h>
 #include "ps2.h"
+#include "trace.h"
+#include "budget.h"
+#include "capture.h"
+#include "ps2soft.h"
+#include "keycodes.h"
 
 static volatile uint8_t buffer[42]; // buffer of unread bytes from the ps/2 keyboard
+static volatile uint16_t arrival[sizeof(buffer)]; // when each byte in buffer[] arrived, in now_us16()
 static volatile uint8_t head, tail; // indexes into buffer[]
+static uint16_t last_read_time; // arrival[] of the byte last returned by ps2_read()
+static uint8_t last_read_port; // and which keyboard it was from
+
+void (* volatile ps2_rx_hook)(void);
 
 static volatile uint8_t send_FE; // boolean; when non-zero we should send send_FE (resend) to the keyboard because we received a byte with bad parity
+static volatile uint8_t bat; // the keyboard sent AA: it was plugged back in, or browned out, and has forgotten how it was set up
+
+static struct ps2_counters counters;
+
+// bump one of counters, sticking at 0xffff
+static inline void count(uint16_t* c) {
+    uint16_t v = *c + 1;
+    if (v)
+        *c = v;
+}
+
+// commands waiting for the transmitter. ps2_tick() sends them one at a time, oldest first
+static struct {
+    uint8_t a, b, len;
+} cmd_queue[4];
+static uint8_t cmd_count;
+
+// the keyboard LEDs are handled apart from the queue, since only the newest setting matters
+// and hosts like to send the same one over and over (every focus change, every VM switch...)
+static uint8_t leds_wanted; // the LEDs the host wants
+static uint8_t leds_set = 0xff; // the LEDs the keyboard last ACKed, or 0xff if we don't know
+static uint8_t leds_sending = 0xff; // the LEDs being written, or 0xff if the write in progress isn't an LED write
+
+// the state of the host -> keyboard transmitter (see below)
+enum {
+    TX_IDLE,
+    TX_GAP,       // pausing a msec before retrying (alarm)
+    TX_WAIT_BUS,  // waiting for the bus to be idle for ~20 usec
+    TX_INHIBIT,   // holding Clk low (alarm)
+    TX_REQUEST,   // holding Clk and Data low (alarm)
+    TX_BITS,      // the keyboard is clocking in the data, parity and stop bits
+    TX_HANDSHAKE, // waiting for the keyboard's handshake bit
+    TX_RELEASE,   // waiting for the bus to be idle again
+    TX_WAIT_ACK,  // waiting for the 0xFA byte (alarm, for the timeout)
+    TX_WAIT_ANSWER, // waiting for the byte F0 00 answers after its ACK (alarm, for the timeout)
+};
+static volatile uint8_t tx_state;
+static volatile uint8_t tx_status = PS2_WRITE_OK;
+static volatile uint8_t tx_answer; // F0 00's answer, or 0 if there wasn't one
+static uint8_t tx_reply(uint8_t c, uint8_t bad);
+static uint8_t write_start(uint8_t a, uint8_t b, uint8_t len, uint8_t ack);
 
 ISR(USART1_RX_vect) {
+    uint16_t start = budget_start();
     // unload the UART receive buffer and stash it in buffer[]
     uint8_t status;
     while ((status = UCSR1A) & (1<<RXC1)) {
         // Note: the error flags in UCSR1A apply to the byte yet to be read from UDR1
         // in other words, once we read UDR1 the fifo advances and the bits in UCSR1A apply to the byte after c, so don't re-read UCSR1A
         uint8_t c = UDR1;
-        if (status & ((1<<FE1)|(1<<DOR1)|(1<<UPE1))) {
-            debug("UART err 0x%x\n", status);
+        uint8_t bad = status & ((1<<FE1)|(1<<DOR1)|(1<<UPE1));
+        if (bad) {
+            if (status & (1<<FE1))
+                count(&counters.framing_errors);
+            if (status & (1<<DOR1))
+                count(&counters.overruns);
+            if (status & (1<<UPE1))
+                count(&counters.parity_errors);
+        }
+        if ((tx_state == TX_WAIT_ACK || tx_state == TX_WAIT_ANSWER) && tx_reply(c, bad)) {
+            // it was the keyboard's answer to the command we are sending
+        } else if (bad) {
+            trace(TRACE_UART_ERROR, status);
             // rx has failed in some way
             //  FE1 (framing error) means the Stop bit wasn't a 1, which means we're out of sync somehow
             //  DOR1 (data overrun) means the interrupt didn't happen faster enough
@@ -43,268 +107,818 @@ ISR(USART1_RX_vect) {
             PORTE = 1<<6; // and light the LED until we get the proper code back
             // and we throw away 'c'
         } else {
+            if (c == 0xAA)
+                bat = 1; // its self test passed (see ps2_tick()). the byte goes on into buffer[] too, so main.c lets go of its keys
             // stash c in the buffer
             uint8_t h = head + 1;
             if (h == sizeof(buffer))
                 h = 0;
             if (h != tail) {
                 buffer[h] = c;
+                arrival[h] = now_us16();
                 head = h;
+                uint8_t n = h >= tail ? h - tail : h + sizeof(buffer) - tail;
+                if (n > counters.peak_buffered)
+                    counters.peak_buffered = n;
             } else {
                 // else we've overflowing buffer. buffer[] is large and this shouldn't happen
-                debug("buffer[] full\n");
+                trace(TRACE_RX_OVERFLOW, c);
+                count(&counters.buffer_overflows);
             }
         }
     }
+    budget_end(BUDGET_USART1_RX, start);
+    static uint8_t in_hook;
+    if (head != tail && ps2_rx_hook && !in_hook) {
+        // the hook is slow (it builds a USB report), so let the other ISRs, and the next byte, in while it runs.
+        // that byte's USART1_RX_vect leaves it in buffer[] for the hook to find, rather than calling the hook again
+        in_hook = 1;
+        start = budget_start();
+        sei();
+        ps2_rx_hook();
+        cli();
+        budget_end(BUDGET_KEYS, start);
+        in_hook = 0;
+    }
+}
+
+//-------------------------------------------------------------------------
+// setting a keyboard up
+//
+// it's done like main() sets up the first keyboard at power up: set 3 with F8 (make/break for every key), if it will
+// go, and set 2 if not. the second keyboard is set up this way whenever it's plugged in, and the first whenever it
+// resets itself, both in the background. each state is the command being sent
+enum {
+    KBD_ABSENT,  // nothing there (or it stopped answering)
+    KBD_SET3,    // F0 03
+    KBD_ASK_SET, // F0 00, since some keyboards ACK set 3 and stay in set 2 anyhow
+    KBD_F8,
+    KBD_SET2,    // F0 02
+    KBD_READY,   // and from now on, LED writes and resend requests
+};
+
+static const struct {
+    uint8_t a, b, len;
+} setup_cmd[] = {
+    [KBD_SET3]    = { 0xf0, 3, 2 },
+    [KBD_ASK_SET] = { 0xf0, 0, 2 },
+    [KBD_F8]      = { 0xf8, 0, 1 },
+    [KBD_SET2]    = { 0xf0, 2, 2 },
+};
+
+// the state after state's command is done. ok says whether it was ACKed, and answer is F0 00's answer.
+// when it's KBD_READY, the keyboard is in set 3 if state was KBD_F8, and set 2 if not
+static uint8_t setup_next(uint8_t state, uint8_t ok, uint16_t answer) {
+    switch (state) {
+      case KBD_SET3:
+        return ok ? KBD_ASK_SET : KBD_SET2;
+      case KBD_ASK_SET:
+        return ok && answer == 2 ? KBD_SET2 : KBD_F8; // (no answer is as good as a 3, the same as in main())
+      case KBD_SET2:
+        return ok ? KBD_READY : KBD_ABSENT;
+    }
+    return KBD_READY;
+}
+
+// the first keyboard's setup, after it resets itself. (main() does it at power up.) ps2_tick() sends the commands
+static uint8_t kbd_state = KBD_READY;
+static uint8_t kbd_sending; // true while the command of kbd_state is being written
+
+//-------------------------------------------------------------------------
+// the second keyboard (see ps2.h)
+//
+// what's sent to it goes out from ps2_tick(), without Timer3 or the alarms, so it never waits on the first keyboard's
+// transmitter, nor that on it. an LED change goes out to both at once.
+
+#define KBD2_BYTES 16 // its ring, as buffer[] is the first's. a power of 2, and at most 128
+#define KBD2_REPLY_US 25000 // for the answer to a byte. the spec says 25 msec
+
+static struct ps2soft kbd2 = PS2SOFT_PORT(PS2_2_CLK_PIN, PS2_2_DATA_PIN, INTF3);
+static volatile uint8_t kbd2_buffer[KBD2_BYTES];
+static volatile uint16_t kbd2_arrival[KBD2_BYTES]; // in now_us16(), as arrival[]
+static volatile uint8_t kbd2_head, kbd2_tail; // bytes go in at kbd2_buffer[kbd2_head % KBD2_BYTES] and come out at kbd2_tail
+
+// what INT3_vect does with the next byte. normally it's a keystroke, for the ring, but from when ps2_tick() starts
+// sending a byte the ACK (or resend request) which answers it is put in kbd2_reply instead, and for F0 00 the byte
+// after the ACK goes in kbd2_answer. they can come before the next ps2_tick(), so it's the ISR which moves along
+enum { KBD2_KEYS, KBD2_WANT_ACK, KBD2_WANT_ANY };
+static volatile uint8_t kbd2_want;
+static volatile uint8_t kbd2_then_answer; // the byte being sent is answered after its ACK
+static volatile uint16_t kbd2_reply, kbd2_answer;
+static volatile uint8_t kbd2_send_FE; // a byte came in garbled. ask for it again
+static volatile uint8_t kbd2_bat; // it sent AA: it was just plugged in, or reset itself, and is back in set 2
+
+ISR(INT3_vect) {
+    uint16_t start = budget_start();
+    uint16_t c = ps2soft_edge(&kbd2, start);
+    if (c == PS2SOFT_NONE) {
+        // the frame's still coming
+    } else if (kbd2_want == KBD2_WANT_ACK && (c == 0xFA || c == 0xFE || c == PS2SOFT_ERROR)) {
+        kbd2_reply = c;
+        kbd2_want = c == 0xFA && kbd2_then_answer ? KBD2_WANT_ANY : KBD2_KEYS;
+    } else if (kbd2_want == KBD2_WANT_ANY) {
+        kbd2_answer = c;
+        kbd2_want = KBD2_KEYS;
+    } else if (c == PS2SOFT_ERROR) {
+        kbd2_send_FE = 1;
+    } else if ((uint8_t)(kbd2_head - kbd2_tail) == KBD2_BYTES) {
+        trace(TRACE_RX_OVERFLOW, c); // (kbd2_buffer[] is as big as the first keyboard's needs to be at its fastest, so this shouldn't happen)
+    } else {
+        if (c == 0xAA)
+            kbd2_bat = 1; // (and it goes in the ring too, like the first keyboard's)
+        kbd2_buffer[kbd2_head & (KBD2_BYTES-1)] = c;
+        kbd2_arrival[kbd2_head & (KBD2_BYTES-1)] = start;
+        kbd2_head++;
+    }
+    budget_end(BUDGET_KBD2, start);
+}
+
+static uint8_t kbd2_state; // (see above.) while it's KBD_ABSENT, look again every PS2_2_RETRY_US
+static uint32_t kbd2_since; // now_us() when it went KBD_ABSENT, or the last byte was sent
+static uint8_t kbd2_leds_set = 0xff, kbd2_leds_sending = 0xff; // as leds_set and leds_sending are the first keyboard's
+
+// the command being sent. each byte goes out on the wires, then its ACK comes back, and maybe an answer after that
+enum { KBD2_IDLE, KBD2_SENDING, KBD2_ACK, KBD2_ANSWER };
+static uint8_t kbd2_phase;
+static uint8_t kbd2_cmd[2], kbd2_len, kbd2_pos, kbd2_tries;
+static uint8_t kbd2_answers; // the last byte is answered after its ACK (F0 00 is, with the scan set), in kbd2_answer
+static uint8_t kbd2_heard; // it replied something to the write, even if the write failed
+
+static void kbd2_send_byte(void) {
+    // (the keyboard can't send while we are, so nothing's lost by waiting for the answer from now on)
+    kbd2_then_answer = kbd2_answers && kbd2_pos == kbd2_len-1;
+    kbd2_want = kbd2_cmd[0] == 0xFE ? KBD2_KEYS : KBD2_WANT_ACK;
+    ps2soft_send(&kbd2, kbd2_cmd[kbd2_pos]);
+    kbd2_phase = KBD2_SENDING;
+}
+
+static void kbd2_write(uint8_t a, uint8_t b, uint8_t len, uint8_t answers) {
+    kbd2_cmd[0] = a;
+    kbd2_cmd[1] = b;
+    kbd2_len = len;
+    kbd2_pos = 0;
+    kbd2_tries = 0;
+    kbd2_answers = answers;
+    kbd2_heard = 0;
+    kbd2_send_byte();
+}
+
+// move the write along. returns PS2_WRITE_BUSY until it's done, and then how it went
+static uint8_t kbd2_write_tick(void) {
+    switch (kbd2_phase) {
+      case KBD2_SENDING: {
+        uint8_t r = ps2soft_tick(&kbd2);
+        if (!r)
+            return PS2_WRITE_BUSY;
+        if (r == 2)
+            break; // it didn't clock the byte in. there's likely nothing there
+        if (kbd2_cmd[0] == 0xFE) {
+            kbd2_phase = KBD2_IDLE; // a resend request isn't ACKed; the answer is the byte again
+            return PS2_WRITE_OK;
+        }
+        kbd2_phase = KBD2_ACK;
+        kbd2_since = now_us();
+        return PS2_WRITE_BUSY;
+      }
+
+      case KBD2_ACK:
+        if (kbd2_want == KBD2_WANT_ACK) {
+            if (now_us() - kbd2_since < KBD2_REPLY_US)
+                return PS2_WRITE_BUSY;
+            break;
+        }
+        kbd2_heard = 1;
+        if (kbd2_reply != 0xFA) {
+            // it wants the byte again, or we couldn't read what it said
+            if (++kbd2_tries < 3) {
+                kbd2_send_byte();
+                return PS2_WRITE_BUSY;
+            }
+            break;
+        }
+        kbd2_tries = 0;
+        if (++kbd2_pos < kbd2_len) {
+            kbd2_send_byte();
+            return PS2_WRITE_BUSY;
+        }
+        if (kbd2_answers) {
+            kbd2_phase = KBD2_ANSWER;
+            kbd2_since = now_us();
+            return PS2_WRITE_BUSY;
+        }
+        kbd2_phase = KBD2_IDLE;
+        return PS2_WRITE_OK;
+
+      case KBD2_ANSWER:
+        if (kbd2_want == KBD2_WANT_ANY) {
+            if (now_us() - kbd2_since < KBD2_REPLY_US)
+                return PS2_WRITE_BUSY;
+            break;
+        }
+        kbd2_phase = KBD2_IDLE;
+        return PS2_WRITE_OK;
+    }
+    kbd2_want = KBD2_KEYS;
+    kbd2_phase = KBD2_IDLE;
+    return PS2_WRITE_FAILED;
+}
+
+static void kbd2_absent(void) {
+    kbd2_state = KBD_ABSENT;
+    kbd2_since = now_us();
+}
+
+// start the setup's next command
+static void kbd2_setup(uint8_t state) {
+    kbd2_state = state;
+    kbd2_send_FE = 0; // (what it was sending before it's set up isn't worth having again)
+    kbd2_write(setup_cmd[state].a, setup_cmd[state].b, setup_cmd[state].len, state == KBD_ASK_SET);
+}
+
+static void kbd2_ready(uint8_t set) {
+    trace(TRACE_KBD2_READY, set);
+    keycodes_select_set(1, set);
+    kbd2_state = KBD_READY;
+    kbd2_leds_set = 0xff; // whatever they show, it isn't what the host wants
+}
+
+// the write in progress is done, and ok says whether it worked
+static void kbd2_done(uint8_t ok) {
+    if (kbd2_state != KBD_READY) {
+        uint8_t next = setup_next(kbd2_state, ok, kbd2_answer);
+        if (next == KBD_READY) {
+            kbd2_ready(kbd2_state == KBD_F8 ? 3 : 2);
+        } else if (next == KBD_ABSENT) {
+            if (kbd2_heard)
+                trace(TRACE_KBD2_FAILED, 0xf0); // (not every look while there's nothing plugged in)
+            kbd2_absent();
+        } else {
+            kbd2_setup(next);
+        }
+    } else if (kbd2_leds_sending != 0xff) {
+        if (ok || kbd2_heard) {
+            // it took them, or it said no, which a keypad without LEDs might. either way, don't send them again
+            kbd2_leds_set = kbd2_leds_sending;
+        } else {
+            trace(TRACE_KBD2_FAILED, 0xed);
+            kbd2_absent(); // it's gone quiet. most likely it was unplugged
+        }
+        kbd2_leds_sending = 0xff;
+    }
+}
+
+static void kbd2_tick(void) {
+    if (kbd2_phase != KBD2_IDLE) {
+        uint8_t r = kbd2_write_tick();
+        if (r == PS2_WRITE_BUSY)
+            return;
+        kbd2_done(r == PS2_WRITE_OK);
+        if (kbd2_phase != KBD2_IDLE)
+            return; // the setup's next command
+    }
+
+    if (kbd2_bat) {
+        // it's been plugged in, or reset itself. either way it's back in set 2, so set it up again
+        kbd2_bat = 0;
+        keycodes_select_set(1, 2); // (what it types meanwhile is in set 2, and so is all of it if the setup fails)
+        kbd2_setup(KBD_SET3);
+    } else if (kbd2_state == KBD_ABSENT) {
+        if (now_us() - kbd2_since >= PS2_2_RETRY_US)
+            kbd2_setup(KBD_SET3);
+    } else if (kbd2_send_FE) {
+        kbd2_send_FE = 0;
+        kbd2_write(0xfe, 0, 1, 0);
+    } else if (leds_wanted != kbd2_leds_set) {
+        kbd2_leds_sending = leds_wanted;
+        kbd2_write(0xed, leds_wanted, 2, 0);
+    }
+}
+
+static uint8_t kbd2_idle(void) {
+    // (while it's absent, the look for it every PS2_2_RETRY_US can wait until we're awake again)
+    return kbd2_phase == KBD2_IDLE && ps2soft_idle(&kbd2) && !kbd2_bat &&
+           (kbd2_state == KBD_ABSENT || (kbd2_state == KBD_READY && !kbd2_send_FE && leds_wanted == kbd2_leds_set));
+}
+
+static void kbd2_init(void) {
+    ps2soft_init(&kbd2);
+    EICRA = (EICRA & ~_BV(ISC30)) | _BV(ISC31); // INT3 on the falling edge
+    EIFR = _BV(INTF3);
+    EIMSK |= _BV(INT3);
+    // a keyboard plugged in with us might have sent its AA before we were listening, so look for one right away
+    kbd2_state = KBD_ABSENT;
+    kbd2_since = now_us() - PS2_2_RETRY_US;
 }
 
+//-------------------------------------------------------------------------
 
 void ps2_tick(void) {
+    kbd2_tick();
+
+    if (bat) {
+        // the keyboard was replugged, or browned out, and is back in set 2 with its LEDs off. whatever was queued was
+        // for it as it was before; set it up again, maybe as a different keyboard, and then put the LEDs the way the
+        // host wants them. it's all sent in the background, and the first ACK is a msec or two from now
+        bat = 0;
+        trace(TRACE_KBD_RESET, cmd_count);
+        cmd_count = 0;
+        if (send_FE) {
+            send_FE = 0; // (the byte it garbled was from before)
+            PORTE = 0;
+        }
+        keycodes_select_set(0, 2); // (what it types meanwhile is in set 2)
+        kbd_state = KBD_SET3;
+        kbd_sending = 0;
+        leds_set = 0xff;
+        leds_sending = 0xff; // (in case a write is still finishing; it doesn't count now)
+    }
+
+    if (tx_state != TX_IDLE)
+        return; // the transmitter is busy; anything else can wait for it
 
-    // if the ISR needs a byte resent, send FE to the keyboard
+    if (kbd_sending) {
+        kbd_sending = 0;
+        uint8_t next = setup_next(kbd_state, tx_status == PS2_WRITE_OK, tx_answer);
+        if (next == KBD_READY || next == KBD_ABSENT) {
+            // (if even F0 02 failed, it's either still in set 2 from its reset, or gone until it's plugged in and sends AA)
+            if (kbd_state == KBD_F8)
+                keycodes_select_set(0, 3);
+            next = KBD_READY;
+        }
+        kbd_state = next;
+    }
+
+    if (leds_sending != 0xff) {
+        // an LED write just finished. if it failed we no longer know what the LEDs show
+        leds_set = tx_status == PS2_WRITE_OK ? leds_sending : 0xff;
+        leds_sending = 0xff;
+    }
+
+    // if the ISR needs a byte resent, send FE to the keyboard. that comes first, since the keyboard is waiting on it
     if (send_FE) {
-        _delay_us(1000); // give the keyboard a little time before we write to it
-        if (ps2_write(0xfe)) { // send an FE (resend command)
+        if (write_start(0xfe, 0, 1, 0)) { // send an FE (resend command)
             send_FE = 0;
+            count(&counters.resends_sent);
             // and clear the LED
             PORTE = 0;
         }
-        // else leave send_FE set and we'll retry the send at the next call to ps2_tick()
+    } else if (kbd_state != KBD_READY) {
+        if (write_start(setup_cmd[kbd_state].a, setup_cmd[kbd_state].b, setup_cmd[kbd_state].len, kbd_state == KBD_ASK_SET ? 2 : 1))
+            kbd_sending = 1;
+    } else if (cmd_count) {
+        if (ps2_write_start(cmd_queue[0].a, cmd_queue[0].b, cmd_queue[0].len)) {
+            cmd_count--;
+            for (uint8_t i=0; i<cmd_count; i++)
+                cmd_queue[i] = cmd_queue[i+1];
+        }
+    } else if (leds_wanted != leds_set) {
+        if (ps2_write_start(0xed, leds_wanted, 2))
+            leds_sending = leds_wanted;
     }
 }
 
+// true when the transmitters are idle and ps2_tick() has nothing more to send
+uint8_t ps2_idle(void) {
+    return tx_state == TX_IDLE && !bat && kbd_state == KBD_READY && !kbd_sending && leds_sending == 0xff && !send_FE &&
+           !cmd_count && leds_wanted == leds_set && kbd2_idle();
+}
+
+// the PS/2 Clk pin (XCK1) has no external interrupt, but Data (RXD1) is INT2, and the keyboard pulls Data low for the
+// start bit of a byte before it clocks the first bit. the INT0-3 edges are detected asynchronously, so this works while
+// sleeping with the I/O clock stopped, and out of standby the CPU is running again within 6 clocks, long before
+// the first falling edge of Clk, so the UART still receives the whole byte
+void ps2_wake_on_data(void) {
+    EICRA = (EICRA & ~_BV(ISC20)) | _BV(ISC21); // falling edge
+    EIFR = _BV(INTF2); // forget any edge from before now
+    EIMSK |= _BV(INT2);
+}
+
+ISR(INT2_vect) {
+    if (capture_running()) {
+        capture_data_edge(); // it's timestamping the Data edges instead (see capture.h)
+        return;
+    }
+    // waking us was all it was for. it's armed again by the next ps2_wake_on_data()
+    EIMSK &= ~_BV(INT2);
+}
+
+// queue a 1 or 2 byte command for ps2_tick() to send
+// if the same command is already waiting, it is replaced, so only the newest argument is sent
+// returns false if the queue is full
+uint8_t ps2_queue_command(uint8_t a, uint8_t b, uint8_t len) {
+    uint8_t i;
+    for (i=0; i<cmd_count; i++)
+        if (cmd_queue[i].a == a)
+            break;
+    if (i == cmd_count) {
+        if (cmd_count == sizeof(cmd_queue)/sizeof(cmd_queue[0]))
+            return 0;
+        cmd_count++;
+    }
+    cmd_queue[i].a = a;
+    cmd_queue[i].b = b;
+    cmd_queue[i].len = len;
+    return 1;
+}
+
 // are there scancodes available?
 uint8_t ps2_available(void) {
-    return head != tail;
+    return head != tail || kbd2_head != kbd2_tail;
 }
 
-// read the next scancode
-uint8_t ps2_read(void) {
-    uint8_t t = tail;
-    if (t == head)
-        return 0;
-    t++;
+// the first keyboard's next byte, whenever it arrived
+static uint8_t read_first(void) {
+    uint8_t t = tail + 1;
     if (t >= sizeof(buffer))
         t = 0;
     uint8_t c = buffer[t];
+    last_read_time = arrival[t];
+    last_read_port = 0;
     tail = t;
-    switch (c) {
+    if (trace_bytes)
+        trace_at(TRACE_PS2_BYTE, c, last_read_time); // all of them, stamped with when they arrived
+    else switch (c) {
         // show the non-keystroke bytes
         case 0xfe: case 0xfa: case 0xaa: case 0x00: case 0xff:
-            debug("ps2_read() = 0x%x\n", c);
+            trace(TRACE_PS2_READ, c);
             break;
     }
     return c;
 }
 
+// read the next scancode from either keyboard, whichever arrived first
+uint8_t ps2_read(void) {
+    uint8_t k = kbd2_tail;
+    if (k != kbd2_head) {
+        uint8_t t = tail + 1;
+        if (t >= sizeof(buffer))
+            t = 0;
+        uint16_t when = kbd2_arrival[k & (KBD2_BYTES-1)];
+        if (tail == head || (int16_t)(when - arrival[t]) < 0) {
+            uint8_t c = kbd2_buffer[k & (KBD2_BYTES-1)];
+            last_read_time = when;
+            last_read_port = 1;
+            kbd2_tail = k + 1;
+            return c; // (and it isn't traced; TRACE_PS2_BYTE is for recording the first keyboard, see tools/tracedump.c)
+        }
+    }
+    if (tail == head)
+        return 0;
+    return read_first();
+}
+
+uint16_t ps2_read_time(void) {
+    return last_read_time;
+}
+
+uint8_t ps2_read_port(void) {
+    return last_read_port;
+}
+
+//-------------------------------------------------------------------------
+// host -> keyboard transmit
+//
+// to send a byte to the keyboard over the PS/2 (aka AT) protocol, the host (us) has to twiddle the lines to get the
+// keyboard's attention, and then let the keyboard clock the bits at its own rate. That takes ~1.5 msec per byte, plus
+// however long the keyboard takes to answer with its ACK, and that used to be spent spinning in the foreground while
+// no USB reports went out. Now it is a state machine run from the Timer3 compare interrupt, and the main loop only
+// starts a write and later looks at how it went.
+//
+// Clk is on PD5 (XCK1), which has neither an external nor a pin change interrupt, so while we transmit Timer3
+// interrupts us every 10 usec and we sample Clk. The keyboard holds Clk low and high for 30-50 usec each, so we see
+// every edge with time to spare. The fixed waits, and the timeouts, are alarms on Timer1 (see timebase.h), so Timer3
+// only runs while there is an edge to catch.
+
+#define TX_TICK_US 10
+
+static uint8_t tx_cmd[2]; // the command being sent
+static uint8_t tx_len, tx_pos; // its length, and which byte of it we are sending
+static uint8_t tx_ack; // non-zero if the keyboard ACKs each byte (everything but the FE resend request), and 2 if it answers the last one after its ACK (F0 00 does)
+static uint8_t tx_tries; // how many times we have tried to send tx_cmd[tx_pos]
+static uint8_t tx_bit, tx_parity, tx_clk; // progress through the bits of the byte, and the last Clk we sampled
+static uint16_t tx_idle_since; // now_us16() when the bus was last seen busy, while in TX_WAIT_BUS
+
 // return true if PS2 bus is idle and nothing is pending in the UART rx buffer
 static inline uint8_t idle(void) {
     return (PIND & (_BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN))) == (_BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN))
            && !(UCSR1A & (1<<RXC1));
 }
 
-// send a byte to the keyboard. returns true if the write suceeded, else false
-uint8_t _ps2_write(uint8_t v) {
-    // to send a byte to the keyboard over the PS/2 (aka AT) protocol, the host (us)
-    // has to twiddle the lines to get the keyboard's attention, and then let the keyboard
-    // clock the bits at its own rate
+// start Timer3 interrupting us every TX_TICK_US
+static void tx_timer_start(void) {
+    TCCR3A = 0;
+    OCR3A = (F_CPU/1000000)*TX_TICK_US - 1;
+    TCCR3B = _BV(WGM32) | _BV(CS30); // CTC mode, no prescalar
+    TCNT3 = 0;
+    TIFR3 = _BV(OCF3A);
+    TIMSK3 = _BV(OCIE3A);
+}
+
+static void tx_timer_stop(void) {
+    TIMSK3 = 0;
+    TCCR3B = 0;
+}
+
+static void tx_finish(uint8_t status) {
+    tx_timer_stop();
+    alarm_cancel(ALARM_PS2);
+    tx_state = TX_IDLE;
+    tx_status = status;
+    if (status == PS2_WRITE_FAILED)
+        count(&counters.write_failures);
+    trace(TRACE_PS2_WRITE_DONE, status);
+}
+
+static void tx_retry(void);
+
+// the alarm went off before the keyboard clocked in the byte, or answered it
+static void tx_timed_out(void) {
+    count(tx_state == TX_WAIT_ACK ? &counters.ack_timeouts : &counters.write_timeouts);
+    tx_retry();
+}
+
+// start sending tx_cmd[tx_pos] as soon as the bus is free
+static void tx_start_byte(void) {
     // first wait for Clk to be high and any in-progress byte from the keyboard to finish arriving.
     // note that since the keyboard sends Ack bytes (0xFA) after most command bytes, there is likely an FA being received
     // at the same time that we are trying to send the 2nd byte of a multi-byte command.
-    // We usually are in a  race with the keyboard to see who sends first when it comes time for us to send the 2nd byte. 
+    // We usually are in a  race with the keyboard to see who sends first when it comes time for us to send the 2nd byte.
     // The keyboard will skip sending the FA if we overwrite the keyboard (say the IBM spec).
     // The 100 msec is a sanity check timeout
-wait_for_idle_bus:;
-    unsigned long start_ms = millis();
-    unsigned long now_ms = start_ms;
-    while (!idle() && now_ms - start_ms <= 100)
-        now_ms = millis(); // spin
-
-    if (!idle())
-        // Clk and Data aren't high; something is stuck and we can't send
-        return 0;
+    trace(TRACE_PS2_WRITE, tx_cmd[tx_pos]);
+    tx_state = TX_WAIT_BUS;
+    tx_idle_since = now_us16();
+    alarm_set(ALARM_PS2, 100000, tx_timed_out);
+    tx_timer_start();
+}
 
-    // emulate the PS motherboard I scoped and wait 19 usec after Clk is high before starting
-    // Note that I don't really know if Clk just transitioned low->high, but just in case
-    for (uint8_t i=0; i<19; i++) {
-        _delay_us(1); // one PS/2 bit time is roughly 100 usec, so we should see any bit starting pretty easily
-        if (!idle())
-            goto wait_for_idle_bus;
-    }
-    // OK at this point we believe the PS/2 bus is idle and we're going to grab it and go
-
-    // disable UART rx, which returns the PS/2 Clk and Data pins to being regular GPIO pins we can drive
-    // Note that there is a race here if the keyboard starting sending between the last idle() check and now.
-    // If that happens we'll just collide and the keyboard will have to back off as per the ps/2 protocol.
-    UCSR1B &= ~(1<<RXEN1);
-
-    // pull Clk low, which inhibits the keyboard from sending
-    // Note that we switch by temporarily letting Clk float, which is better than temporarily driving it to high
-    PORTD = _BV(PS2_DATA_PIN); // keep pulling Data up, but release Clk
-    DDRD = _BV(PS2_CLK_PIN); // drive Clk low
-    _delay_us(93); // emulate the PC I scoped and wait 93 usec before pulling data low as well. The IBM spec says Clk should be low for at least 60 usec
-    // pull Data low as well
-    PORTD = 0;
-    DDRD = _BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN);
-    _delay_us(86); // emulate the PC I scoped and wait 86 usec before releasing Clock
+// the current try went wrong; let go of the bus and try again, or give up
+static void tx_retry(void) {
+    // release Data and Clk, setting both back to pulled-up inputs, and re-enable UART rx
+    ps2_release(PS2_CLK_PIN);
+    ps2_release(PS2_DATA_PIN);
+    UCSR1B |= (1<<RXEN1);
+    // retry the byte 8 times before giving up, giving the keyboard a little time before each retry
+    if (++tx_tries < 8) {
+        trace(TRACE_PS2_RETRY, tx_tries);
+        tx_state = TX_GAP;
+        tx_timer_stop();
+        alarm_set(ALARM_PS2, 1000, tx_start_byte);
+    } else
+        tx_finish(PS2_WRITE_FAILED);
+}
+
+// F0 00 wasn't answered in time. it's done all the same, with tx_answer 0
+static void tx_no_answer(void) {
+    tx_finish(PS2_WRITE_OK);
+}
+
+// the current byte made it to the keyboard; move on to the next one
+static void tx_next_byte(void) {
+    tx_tries = 0;
+    if (++tx_pos < tx_len) {
+        tx_start_byte();
+    } else if (tx_ack == 2) {
+        // the answer comes after the ACK. the IBM spec gives it 20 msec
+        tx_state = TX_WAIT_ANSWER;
+        tx_answer = 0;
+        alarm_set(ALARM_PS2, 25000, tx_no_answer);
+    } else
+        tx_finish(PS2_WRITE_OK);
+}
+
+// TX_REQUEST is over: let the keyboard clock the bits in
+static void tx_request_done(void) {
     // release Clk (which should float back high), and keep holding Data low (so the bus doesn't look idle)
     // Note that we first stop driving Clk, then enable the pullup
-    DDRD = _BV(PS2_DATA_PIN);
-    PORTD = _BV(PS2_CLK_PIN);
-    // wait for the keyboard to drive Clk low. Every time the keyboard drives Clk low, feed it the next bit
+    ps2_release(PS2_CLK_PIN);
+    // from now on every time the keyboard drives Clk low, feed it the next bit
     // Note the Northgate OmniKey Ultra I am using for test takes ~350 usec before it drives Clk low for the first bit
     // The IBM spec says the keyboard should have been checking the bus no more than every 10 msec, so it might take 10 msec for the keyboard to notice
     // (the 0 we are driving now is considered the Start bit)
-    uint8_t parity = 1; // while we clock out the data bits, compute the parity bit
-    start_ms = millis();
-    now_ms = start_ms;
-    for (uint8_t n=0; n<10 && now_ms-start_ms < 100; n++) {
-        if (n == 8) {
-            // we're done with the data; next we send the parity bit and the stop bit
-            v = parity | 0x2;
+    tx_state = TX_BITS;
+    tx_bit = 0;
+    tx_parity = 1; // while we clock out the data bits, compute the parity bit
+    tx_clk = _BV(PS2_CLK_PIN);
+    alarm_set(ALARM_PS2, 100000, tx_timed_out);
+    tx_timer_start();
+}
+
+// TX_INHIBIT is over: pull Data low as well
+static void tx_inhibit_done(void) {
+    ps2_pull_low(PS2_DATA_PIN);
+    tx_state = TX_REQUEST;
+    // emulate the PC I scoped and wait 86 usec before releasing Clock
+    alarm_set(ALARM_PS2, 90, tx_request_done);
+}
+
+static inline void tx_tick(void) {
+    switch (tx_state) {
+      case TX_WAIT_BUS:
+        // emulate the PS motherboard I scoped and wait 19 usec after Clk is high before starting
+        if (!idle()) {
+            tx_idle_since = now_us16();
+            break;
+        }
+        if ((uint16_t)(now_us16() - tx_idle_since) < 20)
+            break;
+        // OK at this point we believe the PS/2 bus is idle and we're going to grab it and go
+
+        // disable UART rx, which returns the PS/2 Clk and Data pins to being regular GPIO pins we can drive
+        // Note that there is a race here if the keyboard starting sending between the last idle() check and now.
+        // If that happens we'll just collide and the keyboard will have to back off as per the ps/2 protocol.
+        UCSR1B &= ~(1<<RXEN1);
+        // pull Clk low, which inhibits the keyboard from sending
+        // Note that we switch by temporarily letting Clk float, which is better than temporarily driving it to high
+        ps2_pull_low(PS2_CLK_PIN); // (Data stays pulled up)
+        tx_state = TX_INHIBIT;
+        tx_timer_stop();
+        // emulate the PC I scoped and wait 93 usec before pulling data low as well. The IBM spec says Clk should be low for at least 60 usec
+        alarm_set(ALARM_PS2, 100, tx_inhibit_done);
+        break;
+
+      case TX_BITS: {
+        uint8_t clk = PIND & _BV(PS2_CLK_PIN);
+        if (!clk && tx_clk) {
+            // Clk went low; setup the next data bit (kbd samples Data on the Clk's low->high transition)
+            uint8_t bit;
+            if (tx_bit < 8)
+                bit = (tx_cmd[tx_pos] >> tx_bit) & 1;
+            else if (tx_bit == 8)
+                bit = tx_parity;
+            else
+                // the stop bit. since Data is released (and thus a 1) no setup/hold violation occurs at the keyboard side as it clocks it in
+                bit = 1;
+            tx_parity ^= bit;
+            if (bit) {
+                // send a 1 by letting the Data line get pulled-up to high
+                ps2_release(PS2_DATA_PIN);
+            } else {
+                // send a 0 by pulling the Data line low
+                ps2_pull_low(PS2_DATA_PIN);
+            }
+            if (++tx_bit == 10)
+                tx_state = TX_HANDSHAKE;
+        }
+        tx_clk = clk;
+        break;
+      }
+
+      case TX_HANDSHAKE: {
+        // finally there will be a handshake from the keyboard to acknowlege the reception
+        // the keyboard is going to clock a 0 bit to us
+        uint8_t lines = PIND;
+        uint8_t clk = lines & _BV(PS2_CLK_PIN);
+        if (!clk && tx_clk) {
+            if (lines & _BV(PS2_DATA_PIN)) {
+                // something didn't go right; the handshake should be a 0 bit
+                count(&counters.collisions);
+                tx_retry();
+                break;
+            }
+            // some specs say you should handshake back by stretching the Clk pulse. However the IBM spec does not say this. The IBM spec
+            // says the transaction is done as soon as Data and Clk go back to high. I suspect what I see on the scope is the
+            // computer inhibiting the keyboard from sending while it processes the keystroke. We don't have that problem, so
+            // we're done (and the keyboard will release Clk when it is ready to)
+            tx_state = TX_RELEASE;
         }
-        // wait for Clk to go low
-        while (PIND & _BV(PS2_CLK_PIN) && (now_ms=millis()) - start_ms < 100) /* spin */;
-        // Clk went low; setup the next data bit
-        uint8_t bit = v&1;
-        parity ^= bit;
-        v >>= 1;
-        if (bit) {
-            // send a 1 by letting the Data line get pulled-up to high
-            DDRD = 0;
-            PORTD = _BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN);
+        tx_clk = clk;
+        break;
+      }
+
+      case TX_RELEASE:
+        // wait for the bus to go back to idle.
+        // we don't want the XCLK1 to be low when we set RXEN1 just in case that confuses the UART
+        if (!idle())
+            break;
+        UCSR1B |= (1<<RXEN1);
+        if (tx_ack) {
+            // give the keyboard .25 sec to get us a response. normally it takes just a msec or two
+            tx_state = TX_WAIT_ACK;
+            tx_timer_stop();
+            alarm_set(ALARM_PS2, 250000, tx_timed_out);
         } else {
-            // send a 0 by pulling the Data line low
-            PORTD = _BV(PS2_CLK_PIN);
-            DDRD = _BV(PS2_DATA_PIN);
+            // no response is coming (an FE gets the keyboard to resend its last byte, not to reply)
+            tx_next_byte();
         }
-        // wait for Clk to go high (kbd samples Data on the Clk's low->high transition)
-        while (!(PIND & _BV(PS2_CLK_PIN)) && (now_ms=millis()) - start_ms < 100) /* spin */;
+        break;
     }
-    // release Data (and Clk was and remains released), setting both back to pulled-up inputs
-    // note that since Data is released (and thus a 1, since it is the Stop bit) no setup/hold violation occurs at the keyboard side as it clocks in the Stop bit
-    DDRD = 0; // all pins are inputs
-    PORTD = _BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN); // pull up both wires
-    if (now_ms - start_ms >= 100) {
-        // this transaction timed out
-fail:
-        UCSR1B |= (1<<RXEN1); // re-enable UART RX on the way out
-        return 0;
+    // (Timer3 is stopped in the other states)
+}
+
+// (this doesn't nest: it bit-bangs the bus on a 10 usec tick, and is short)
+ISR(TIMER3_COMPA_vect) {
+    uint16_t start = budget_start_fast();
+    tx_tick();
+    budget_end_fast(BUDGET_TIMER3, start);
+}
+
+// called from USART1_RX_vect when we're waiting for an ACK (or F0 00's answer) and byte c arrives (with errors if bad != 0)
+// returns true if c was the reply to our command, and thus isn't a keystroke
+static uint8_t tx_reply(uint8_t c, uint8_t bad) {
+    trace(TRACE_PS2_REPLY, c);
+    if (tx_state == TX_WAIT_ANSWER && (bad || c != 0xAA)) {
+        // F0 00's answer (if we couldn't read it, it's as good as none)
+        tx_answer = bad ? 0 : c;
+        tx_finish(PS2_WRITE_OK);
+        return 1;
     }
-    // finally there will be a handshake from the keyboard to acknowlege the reception
-    // the keyboard is going to clock a 0 bit to us. Wait for it
-    while ((PIND & _BV(PS2_CLK_PIN)) && (now_ms=millis()) - start_ms < 100) /* spin */;
-    if (now_ms - start_ms >= 100)
-        goto fail;
-    // read the handshake Data bit
-    v = PIND & _BV(PS2_DATA_PIN);
-    if (v) {
-        // something didn't go right; the handshake should be a 0 bit
-        goto fail;
+    if (bad || c == 0xFE) {
+        // either the keyboard wants the byte resent, or we couldn't read its reply. send the byte again
+        if (!bad)
+            count(&counters.resends_received);
+        tx_retry();
+        return 1;
     }
-    // some specs say you should handshake back by stretching the Clk pulse. However the IBM spec does not say this. The IBM spec
-    // says the transaction is done as soon as Data and Clk go back to high. I suspect what I see on the scope is the
-    // computer inhibiting the keyboard from sending while it processes the keystroke. We don't have that problem, so
-    // we're done (and the keyboard will release Clk when it is ready to)
-    if (0) {
-        // handshake back by holding Clk low for long enough that the keyboard, which should release Clk soon, will notice
-        PORTD = _BV(PS2_DATA_PIN);
-        DDRD = _BV(PS2_CLK_PIN);
-        _delay_us(180);
-        // let Clk float back up high and we're done
-        DDRD = 0;
-        PORTD = _BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN);
+    if (c == 0xFA) {
+        // yay, an ACK from the keyboard
+        tx_next_byte();
+        return 1;
     }
-
-    // waiting for the bus to go back to idle.
-    // we don't want the XCLK1 to be low when we set RXEN1 just in case that confuses the UART
-    if (1) {
-        // wait for the bus to be back to idle state before returning
-        while (!idle() && now_ms - start_ms <= 100)
-            now_ms = millis(); // spin
-
-        if (!idle()) {
-            // Clk and Data aren't high; something is stuck
-            PORTE = 1<<6; // light the LED until we get this fixed
-            UCSR1B |= (1<<RXEN1); // we'll re-enable UART RX, though who knows what is going on
-            return 0;
-        }
+    if (c == 0xAA) {
+        // it reset itself (see ps2_tick()) and forgot the command, so no ACK is coming. don't wait out the timeout for
+        // one before sending it the setup again. (and pass the AA on)
+        tx_finish(PS2_WRITE_FAILED);
+        return 0;
     }
+    // something else; most likely a keystroke which was on its way when we started. pass it on, and keep waiting
+    return 0;
+}
 
-    // re-enable UART rx
-    UCSR1B |= (1<<RXEN1);
-
+static uint8_t write_start(uint8_t a, uint8_t b, uint8_t len, uint8_t ack) {
+    if (tx_state != TX_IDLE)
+        return 0;
+    tx_cmd[0] = a;
+    tx_cmd[1] = b;
+    tx_len = len;
+    tx_pos = 0;
+    tx_ack = ack;
+    tx_tries = 0;
+    tx_status = PS2_WRITE_BUSY;
+    tx_start_byte();
     return 1;
 }
 
-uint8_t ps2_write(uint8_t v) {
-    debug("ps2_write(0x%x) = ", v);
-    uint8_t rc = _ps2_write(v);
-    debug("%u\n", rc);
-    return rc;
+uint8_t ps2_write_start(uint8_t a, uint8_t b, uint8_t len) {
+    return write_start(a, b, len, 1);
+}
+
+uint8_t ps2_write_status(void) {
+    return tx_status;
+}
+
+// wait for the write in progress to finish. returns true if it suceeded
+static uint8_t write_wait(void) {
+    while (tx_status == PS2_WRITE_BUSY) {
+        // tx_status only changes in an ISR (Timer3's, Timer1's alarm or the UART's), which wakes us up
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sleep_cpu();
+        sleep_disable();
+    }
+    return tx_status == PS2_WRITE_OK;
 }
 
 // write a byte and wait for the 0xFA ack
 // handle resending the byte if need be
 uint8_t ps2_write_and_ack(uint8_t v) {
-    // retry the whole transactions 8 times before giving up
-    for (uint8_t try=0; try<8; try++) {
-      // try to send the byte
-      if (!ps2_write(v))
-          // there was a collision or a missing low level ACK; retry
-          continue;
-
-      // wait for the response
-      unsigned long start_ms = millis();
-      while (millis() - start_ms < 250) { // give the keyboard .25 sec to get us a response. normally it takes just a msec or two
-        if (ps2_available())
-          goto got_reply;
-      }
-      // timed out waiting for a response
-      // should we retry , or give up?
-      continue; // let's retry
-
-got_reply:;
-      uint8_t r = ps2_read();
-      if (r == 0xFA) {
-        // yay, an ACK from the keyboard, we are successfull
-        return 1;
-      } else if (r == 0xFE) {
-        // keyboard wants that byte resent, so retry from the top
-        continue;
-      } else {
-        // a strange response from the keyboard
-        // should we ignore it? given up? retry?
-        continue; // let's retry
-      }
-    }
-    // given up and fail
-    return 0;
+    return write_wait() && ps2_write_start(v, 0, 1) && write_wait();
 }
 
 uint8_t ps2_write2(uint8_t a, uint8_t b) {
-    uint8_t rc = ps2_write_and_ack(a);
-    if (rc) {
-        _delay_us(1000);
-        rc = ps2_write_and_ack(b);
-    }
-    return rc;
+    return write_wait() && ps2_write_start(a, b, 2) && write_wait();
 }
 
 // send { 0xED, v } to the keyboard
 uint8_t ps2_set_leds(uint8_t v) {
-    return ps2_write2(0xed,v);
+    uint8_t rc = ps2_write2(0xed,v);
+    leds_wanted = v;
+    leds_set = rc ? v : 0xff;
+    return rc;
 }
 
 uint8_t ps2_set_scan_set(uint8_t v) {
     return ps2_write2(0xf0,v);
 }
 
+// ask the keyboard which codeset it is using (1, 2 or 3). returns 0 if it doesn't say
+// (the transmitter waits for the codeset after the ACK, the same as when ps2_tick() asks)
+uint8_t ps2_get_scan_set(void) {
+    if (!write_wait() || !write_start(0xf0, 0, 2, 2) || !write_wait())
+        return 0;
+    return tx_answer;
+}
+
+// update the keyboards' LEDs, once their transmitters are free (and if they need it)
+void ps2_update_leds(uint8_t v) {
+    leds_wanted = v;
+}
+
 void ps2_init() {
     // initialize both clk and data to be pulled-up input pins
     // (when not using the UART we'll make use of this configuration)
-    DDRD = 0; // not really needed since the reset value is 0
-    PORTD = _BV(PS2_CLK_PIN) | _BV(PS2_DATA_PIN); // pull up both wires
+    ps2_release(PS2_CLK_PIN);
+    ps2_release(PS2_DATA_PIN);
 
     // since we will be using the UART for PS/2 receive it doesn't look
     // like I can also use the internal pullups (Since the uart, when enabled,
@@ -326,5 +940,22 @@ void ps2_init() {
 
     // finally, enable UART receive and receive interrupt (we leave UART transmit disabled always, the complex PS/2 host transmit protocol is done in software
     UCSR1B |= (1<<RXEN1) | (1<<RXCIE1);
+
+    kbd2_init();
 }
 
+uint8_t ps2_get_counters(uint8_t* buf) {
+    // the ISRs update them, so copy them with interrupts off
+    uint8_t oldSREG = SREG;
+    cli();
+    memcpy(buf, &counters, sizeof(counters));
+    SREG = oldSREG;
+    return sizeof(counters);
+}
+
+void ps2_clear_counters(void) {
+    uint8_t oldSREG = SREG;
+    cli();
+    memset(&counters, 0, sizeof(counters));
+    SREG = oldSREG;
+}
@@ -27,26 +27,86 @@
 #include <util/delay.h>     // some convenient delay functions
 #include <stdint.h>
 #include <stdlib.h>
+#include "timebase.h"
 
-extern unsigned long millis(void);
 extern void die_blinking(uint8_t);
-extern void debug(const char* fmt, ...);
 
-// Note for this app the Clock pin is hardcoded to be INT0/PORTD0
-// and Data pin is hardcoded to be PORTD1 (For lack of better imagination)
+// the keyboard's wires are on port D, where the UART wants them. (the mouse's are on port D too; see mouse.h)
 #define PS2_CLK_PIN  PD5 // must be the XCLK1 pin because we use UART1 for ps/2 receive
 #define PS2_DATA_PIN PD2 // must be the RXD1 pin because we use UART1 for ps/2 receive
 
+// a second keyboard, a keypad or macro pad say, can be on a port of its own. the UART is the first's, so it's
+// bit-banged (see ps2soft.h) with Clk on INT3, which is TXD1 and free since the UART never transmits. its bytes come
+// out of ps2_read() along with the first keyboard's, oldest first, and ps2_read_port() tells which sent each one.
+// ps2_tick() sets it up in the background, the same way main() does the first, and again whenever it's plugged in
+#define PS2_PORTS 2
+#define PS2_2_CLK_PIN  PD3 // must be INT3, whose ISR does the clocking
+#define PS2_2_DATA_PIN PD7
+#define PS2_2_RETRY_US 1000000 // how often to look for the second keyboard when there isn't one
+
+// pull one of the port D wires low, or let it go back to its pull-up. these only ever touch the one bit, which the AVR
+// does in a single SBI or CBI, so the keyboard's and the mouse's sides don't undo each other's writes even when an ISR
+// of one interrupts the other. a wire is let go before its pull-up is turned on, so it never drives high
+static inline void ps2_pull_low(uint8_t pin) {
+    PORTD &= ~_BV(pin);
+    DDRD |= _BV(pin);
+}
+
+static inline void ps2_release(uint8_t pin) {
+    DDRD &= ~_BV(pin);
+    PORTD |= _BV(pin);
+}
+
 void ps2_init(void);
-void ps2_tick(void);
+void ps2_tick(void); // and whenever the keyboard resets itself (it sends AA), this sets it up again the way main() did
 
 uint8_t ps2_available(void); // is there ps2 data available to ps2_read()
 uint8_t ps2_read(void);
+uint16_t ps2_read_time(void); // when the byte last returned by ps2_read() arrived, in now_us16()
+uint8_t ps2_read_port(void); // and which keyboard it came from, 0 or 1
+// if set, USART1_RX_vect calls this after putting a byte in the buffer, so the bytes can be dealt with right away,
+// from inside the ISR. it runs with interrupts enabled, but is never re-entered: bytes which arrive while it runs are
+// only put in the buffer, so it should check for them before returning. it must leave alone whatever the main loop is in the middle of
+extern void (* volatile ps2_rx_hook)(void);
 
-uint8_t ps2_write(uint8_t v); // try once to send a byte (not that useful without a lot of error handling)
-uint8_t ps2_write_and_ack(uint8_t v); // ps2_write() + wait for ACK and handle resends/retries
+// writes to the (first) keyboard happen in the background, driven by the Timer3 interrupt
+// ps2_write_start() starts sending a 1 or 2 byte command (each byte of which the keyboard ACKs with 0xFA), and ps2_write_status() tells how it went
+enum {
+    PS2_WRITE_OK,
+    PS2_WRITE_BUSY,
+    PS2_WRITE_FAILED,
+};
+uint8_t ps2_write_start(uint8_t a, uint8_t b, uint8_t len); // returns false (and does nothing) if a write is already in progress
+uint8_t ps2_write_status(void); // how the last write went, or PS2_WRITE_BUSY if it is still going
+// or leave it to ps2_tick(), which sends queued commands whenever the transmitter is free
+uint8_t ps2_queue_command(uint8_t a, uint8_t b, uint8_t len); // replaces the same command if it's already queued; returns false if the queue is full
+void ps2_update_leds(uint8_t v); // set both keyboards' LEDs to v, unless they already are. only the last of several calls in a row is sent
+uint8_t ps2_idle(void); // true when nothing is being sent to either keyboard, or waiting to be
+void ps2_wake_on_data(void); // before sleeping in a mode which stops the UART: make the keyboard's next byte wake us up in time to receive it
+
+// blocking versions of the above, for use before the main loop is running. they return true if the keyboard ACKed
+uint8_t ps2_write_and_ack(uint8_t v); // send a byte, wait for ACK and handle resends/retries
 uint8_t ps2_write2(uint8_t a, uint8_t b); // write (and ack) a 2-byte command
 uint8_t ps2_set_leds(uint8_t v);
 uint8_t ps2_set_scan_set(uint8_t v);
+uint8_t ps2_get_scan_set(void); // returns 0 if the keyboard didn't answer
+
+// counts of what went wrong on the PS/2 link, to tell how healthy a keyboard, cable and USB polling rate are together
+// they stick at 0xffff rather than wrap, and are read (and cleared) through the diagnostics interface
+struct ps2_counters {
+    uint16_t framing_errors;    // received bytes whose stop bit wasn't 1
+    uint16_t overruns;          // times USART1_RX_vect wasn't fast enough and the UART dropped a byte
+    uint16_t parity_errors;     // received bytes with bad parity
+    uint16_t buffer_overflows;  // bytes lost because buffer[] was full
+    uint16_t resends_sent;      // FE (resend) commands we sent the keyboard because of the above
+    uint16_t resends_received;  // FE replies from the keyboard to a byte we wrote
+    uint16_t collisions;        // bytes we wrote which the keyboard didn't handshake, usually because it started to send at the same time
+    uint16_t write_timeouts;    // bytes we wrote which the keyboard never clocked in, or the bus never went idle for
+    uint16_t ack_timeouts;      // bytes we wrote which the keyboard never replied to
+    uint16_t write_failures;    // writes we gave up on after 8 tries
+    uint16_t peak_buffered;     // the most received bytes ever waiting in buffer[]
+};
+uint8_t ps2_get_counters(uint8_t* buf); // fill in a struct ps2_counters; returns its size
+void ps2_clear_counters(void);
 
 #endif
@@ -0,0 +1,146 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include "ps2soft.h"
+#include "ps2.h"
+
+#define FRAME_US 2000 // a frame takes 1.1 msec at the slowest clock the spec allows. one still going after this has lost an edge
+#define TX_INHIBIT_US 100 // the least the spec allows
+#define TX_US 25000 // for the device to clock the byte in. it should start within 15 msec, and take 2 more at most
+
+enum { TX_IDLE, TX_INHIBIT, TX_SENDING };
+
+// (with interrupts off; see ps2soft.h)
+static inline void pull_low(uint8_t bits) {
+    PORTD &= ~bits;
+    DDRD |= bits;
+}
+
+static inline void release(uint8_t bits) {
+    DDRD &= ~bits;
+    PORTD |= bits;
+}
+
+void ps2soft_init(struct ps2soft* p) {
+    uint8_t oldSREG = SREG;
+    cli();
+    release(p->clk | p->data);
+    SREG = oldSREG;
+}
+
+// the device pulled Clk low. both ways the bits change while Clk is high, so this is the time to read Data, or to
+// set it for the device to read when it lets Clk go back up. now is now_us16()
+uint16_t ps2soft_edge(struct ps2soft* p, uint16_t now) {
+    uint8_t data = PIND & p->data;
+    uint16_t c = PS2SOFT_NONE;
+    if (p->tx_edges) {
+        // the 10 bits after the start bit (8 data, parity and stop), then the device's ack
+        if (--p->tx_edges) {
+            if (p->tx_frame & 1)
+                release(p->data);
+            else
+                pull_low(p->data);
+            p->tx_frame >>= 1;
+        } else {
+            p->tx_acked = !data;
+        }
+        return c;
+    }
+    if (p->rx_bits && (uint16_t)(now - p->rx_start) > FRAME_US) {
+        // an edge went missing, and this is the start of the next frame
+        p->rx_bits = 0;
+        c = PS2SOFT_ERROR;
+    }
+    if (!p->rx_bits) {
+        if (!data) { // (else it's a glitch, since a frame always starts with a 0)
+            p->rx_start = now;
+            p->rx_ones = 0;
+            p->rx_bits = 1;
+        }
+    } else if (p->rx_bits <= 8) {
+        p->rx_byte >>= 1;
+        if (data) {
+            p->rx_byte |= 0x80;
+            p->rx_ones++;
+        }
+        p->rx_bits++;
+    } else if (p->rx_bits == 9) {
+        if (data)
+            p->rx_ones++; // the parity bit, which makes the count odd
+        p->rx_bits++;
+    } else {
+        c = data && (p->rx_ones & 1) ? p->rx_byte : PS2SOFT_ERROR; // and the stop bit, which is a 1
+        p->rx_bits = 0;
+    }
+    return c;
+}
+
+void ps2soft_send(struct ps2soft* p, uint8_t c) {
+    uint8_t parity = 1;
+    for (uint8_t b=c; b; b>>=1)
+        parity ^= b & 1;
+    p->tx_frame = c | (uint16_t)parity << 8 | 1 << 9;
+    uint8_t oldSREG = SREG;
+    cli();
+    pull_low(p->clk); // and if the device was in the middle of sending, it gives up on that byte
+    p->rx_bits = 0;
+    EIFR = p->intf; // (our own edge)
+    SREG = oldSREG;
+    p->tx_state = TX_INHIBIT;
+    p->tx_time = now_us();
+}
+
+void ps2soft_stop(struct ps2soft* p) {
+    uint8_t oldSREG = SREG;
+    cli();
+    p->tx_edges = 0;
+    release(p->clk | p->data);
+    SREG = oldSREG;
+    p->tx_state = TX_IDLE;
+}
+
+uint8_t ps2soft_tick(struct ps2soft* p) {
+    if (p->tx_state == TX_INHIBIT) {
+        if (now_us() - p->tx_time < TX_INHIBIT_US)
+            return 0;
+        uint8_t oldSREG = SREG;
+        cli();
+        p->tx_acked = 0;
+        p->tx_edges = 11;
+        pull_low(p->data); // the start bit
+        release(p->clk); // for the device to clock the rest
+        SREG = oldSREG;
+        p->tx_state = TX_SENDING;
+        p->tx_time = now_us();
+        return 0;
+    }
+    if (p->tx_edges && now_us() - p->tx_time < TX_US)
+        return 0;
+    uint8_t acked = !p->tx_edges && p->tx_acked;
+    ps2soft_stop(p);
+    return acked ? 1 : 2;
+}
+
+uint8_t ps2soft_sending(const struct ps2soft* p) {
+    return p->tx_state != TX_IDLE;
+}
+
+uint8_t ps2soft_idle(const struct ps2soft* p) {
+    return p->tx_state == TX_IDLE && !p->rx_bits;
+}
@@ -0,0 +1,74 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// a PS/2 port bit-banged on one of the INTn pins, for the devices past the first keyboard, which has the UART
+//
+// the owner's ISR for the falling edge of the port's Clk calls ps2soft_edge(), which clocks the bits in (and out) one
+// at a time, and hands back each byte as it finishes. it does no more than that, so it's a few usec each time.
+//
+// sending is driven from the main loop, by ps2soft_tick(). Clk is held low to stop the device sending and then Data
+// is pulled low as the start bit, the same as for the keyboard (see ps2.c). nothing sent this way is in a hurry, so
+// the inhibit just lasts until the next tick instead of needing an alarm
+//
+// the wires are on port D, like the keyboard's. which ones is only known at run time here, so writing them isn't the
+// single SBI or CBI of ps2_pull_low() and ps2_release(), and this only does it with interrupts off
+
+#ifndef PS2SOFT_H
+#define PS2SOFT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ps2soft {
+    uint8_t clk, data; // the wires' bits in port D
+    uint8_t intf; // the Clk pin's bit in EIFR
+    // receiving, in the ISR
+    uint8_t rx_bits; // how many bits of the frame have come in. 0 while waiting for the start bit
+    uint8_t rx_byte, rx_ones;
+    uint16_t rx_start; // now_us16() of the start bit
+    // sending
+    volatile uint8_t tx_edges; // how many more times the device is going to pull Clk low
+    uint16_t tx_frame; // the bits still to go out, lsb first
+    volatile uint8_t tx_acked; // the device pulled Data low for the last edge
+    uint8_t tx_state;
+    uint32_t tx_time; // now_us() when tx_state last changed
+};
+#define PS2SOFT_PORT(clk_pin, data_pin, intf_bit) { _BV(clk_pin), _BV(data_pin), _BV(intf_bit) }
+
+// what ps2soft_edge() returns when it isn't a byte
+#define PS2SOFT_ERROR 0x100 // a frame went wrong (an edge went missing, or the parity or stop bit was wrong)
+#define PS2SOFT_NONE  0x200 // the frame isn't finished yet
+
+void ps2soft_init(struct ps2soft* p); // let go of the wires. the owner sets up the interrupt
+uint16_t ps2soft_edge(struct ps2soft* p, uint16_t now); // from the owner's ISR: the byte which just finished, if any
+
+void ps2soft_send(struct ps2soft* p, uint8_t c); // start sending c. a byte the device was sending is lost
+uint8_t ps2soft_tick(struct ps2soft* p); // returns 0 while still sending, then 1 if the device took c, or 2 if it didn't
+void ps2soft_stop(struct ps2soft* p); // give up on sending, and let go of the wires
+uint8_t ps2soft_sending(const struct ps2soft* p);
+uint8_t ps2soft_idle(const struct ps2soft* p); // nothing going either way, so the timers can stop
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
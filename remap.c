@@ -0,0 +1,171 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "remap.h"
+
+#define REMAP_MAGIC 0x52 // changes if the layout of the EEPROM ever does
+
+// the header goes after the list in EEPROM, and its magic byte last, so it is the last thing a COMMIT writes
+struct remap_header {
+    uint8_t entries;
+    uint16_t crc; // _crc16_update() over the entries' bytes
+    uint8_t magic; // REMAP_MAGIC when the list is valid
+};
+
+static struct remap_entry EEMEM list[REMAP_MAX_ENTRIES];
+static struct remap_header EEMEM header;
+
+static uint8_t entries; // in the list in use, 0 if it isn't valid
+static uint8_t applied; // by the last remap_apply()
+static uint8_t status = REMAP_OK;
+
+// the upload
+static uint8_t uploading; // since the BEGIN
+static uint8_t uploaded;
+static uint16_t upload_crc;
+
+// bytes waiting to be written to EEPROM, one at a time as it's ready for them
+static uint8_t queue[sizeof(((struct remap_request*)0)->entries)];
+static uint8_t* queue_addr; // where in EEPROM queue[0] goes
+static uint8_t queue_len, queue_pos;
+static uint8_t reload; // the list changes once the queue has been written
+
+static uint16_t crc_of(uint8_t n) {
+    uint16_t crc = 0xffff;
+    const uint8_t* p = (const uint8_t*)list;
+    for (uint16_t i=0; i<n*sizeof(struct remap_entry); i++)
+        crc = _crc16_update(crc, eeprom_read_byte(p+i));
+    return crc;
+}
+
+void remap_init(void) {
+    struct remap_header h;
+    eeprom_read_block(&h, &header, sizeof(h));
+    entries = 0;
+    if (h.magic == REMAP_MAGIC && h.entries <= REMAP_MAX_ENTRIES && crc_of(h.entries) == h.crc)
+        entries = h.entries;
+    // else an erased EEPROM, an upload which never finished, or worn out bits. the defaults are better than any of those
+}
+
+void remap_apply(uint8_t set, uint8_t (*put)(uint8_t table, uint8_t code, uint8_t usb)) {
+    uint8_t first = set == 2 ? REMAP_SET2 : REMAP_SET3;
+    applied = 0;
+    for (uint8_t i=0; i<entries; i++) {
+        struct remap_entry e;
+        eeprom_read_block(&e, &list[i], sizeof(e));
+        if (e.table == first || e.table == first+1)
+            applied += put(e.table, e.code, e.usb);
+    }
+}
+
+static void write_later(void* addr, const void* data, uint8_t len) {
+    memcpy(queue, data, len);
+    queue_addr = addr;
+    queue_len = len;
+    queue_pos = 0;
+    status = REMAP_BUSY;
+}
+
+uint8_t remap_busy(void) {
+    return queue_pos != queue_len || !eeprom_is_ready();
+}
+
+uint8_t remap_tick(void) {
+    if (queue_pos != queue_len) {
+        if (eeprom_is_ready()) {
+            // (update rather than write, so the bytes which are already right don't wear out the cells)
+            eeprom_update_byte(queue_addr + queue_pos, queue[queue_pos]);
+            queue_pos++;
+        }
+        return 0;
+    }
+    if (!eeprom_is_ready())
+        return 0;
+    if (status == REMAP_BUSY)
+        status = REMAP_OK;
+    if (!reload)
+        return 0;
+    reload = 0;
+    // read back what was written rather than trusting it
+    remap_init();
+    return 1;
+}
+
+void remap_request(const void* data, uint16_t len) {
+    const struct remap_request* r = data;
+    if (remap_busy() || len < 2) {
+        status = REMAP_REFUSED;
+        return;
+    }
+    static const uint8_t invalid = 0xff;
+    switch (r->op) {
+        case REMAP_BEGIN:
+            uploading = 1;
+            uploaded = 0;
+            upload_crc = 0xffff;
+            write_later(&header.magic, &invalid, 1);
+            // the ADDs overwrite list[] as they come, so until the COMMIT a keycodes_reload() (a keyboard plugged in
+            // meanwhile) gets the defaults, rather than some of the old list and some of the new
+            entries = 0;
+            return;
+        case REMAP_ADD: {
+            if (!uploading || r->num > REMAP_REQUEST_ENTRIES || len < 2 + r->num*sizeof(struct remap_entry) || r->num > REMAP_MAX_ENTRIES - uploaded)
+                break;
+            for (uint8_t i=0; i<r->num; i++)
+                if (r->entries[i].table >= REMAP_NUM_TABLES || r->entries[i].usb > 0xE7)
+                    goto refused; // (nothing past E7 is defined, and main.c's matrix[] stops there)
+            const uint8_t* p = (const uint8_t*)r->entries;
+            for (uint8_t i=0; i<r->num*sizeof(struct remap_entry); i++)
+                upload_crc = _crc16_update(upload_crc, p[i]);
+            write_later(&list[uploaded], r->entries, r->num*sizeof(struct remap_entry));
+            uploaded += r->num;
+            return;
+        }
+        case REMAP_COMMIT: {
+            if (!uploading)
+                break;
+            uploading = 0;
+            struct remap_header h = { .entries = uploaded, .crc = upload_crc, .magic = REMAP_MAGIC };
+            write_later(&header, &h, sizeof(h));
+            reload = 1;
+            return;
+        }
+        case REMAP_CLEAR:
+            uploading = 0;
+            write_later(&header.magic, &invalid, 1);
+            reload = 1;
+            return;
+    }
+refused:
+    status = REMAP_REFUSED;
+}
+
+uint8_t remap_get_status(uint8_t* buf) {
+    struct remap_status* st = (struct remap_status*)buf;
+    st->status = status;
+    st->entries = entries;
+    st->uploaded = uploaded;
+    st->applied = applied;
+    return sizeof(*st);
+}
@@ -0,0 +1,107 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// key remapping stored in EEPROM
+//
+// the default layout is compiled in from layout.txt (see keymap.h). on top of it the EEPROM can hold a list of
+// remappings, each a scan code in one of layout.txt's tables and the USB key it should be instead (0 unmaps it).
+// keycodes.c keeps the active scan set's tables in RAM, and puts the list on top of the defaults whenever it loads them
+// (see keycodes_select_set()), so the decoding itself is still one indexed load per byte.
+//
+// the host uploads a new list with SET_REPORT(Feature) on the diagnostics interface (see diag.h), which tools/remap
+// does from a file in the same format as layout.txt: a BEGIN, then the entries an ADD at a time, then a COMMIT.
+// An EEPROM byte takes 3.4 msec to write, far too long to hold up a control request or anything else, so each request
+// only queues its bytes, and remap_tick() writes them from the main loop one at a time as the EEPROM becomes ready.
+// the host reads the status (GET_REPORT) until the last request is done before sending the next.
+//
+// BEGIN invalidates the list before anything else is written, and COMMIT writes the header which validates it last,
+// so an upload which is cut short (unplugged, or the tool killed) leaves no list, and the adapter falls back to the
+// defaults in flash. so does a header or checksum which doesn't add up, and CLEAR
+
+#ifndef REMAP_H
+#define REMAP_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the tables an entry can remap, in the order of the sections of layout.txt
+enum {
+    REMAP_SET3,
+    REMAP_SET3_E0,
+    REMAP_SET2,
+    REMAP_SET2_E0,
+    REMAP_NUM_TABLES
+};
+
+struct remap_entry {
+    uint8_t table; // REMAP_xxx
+    uint8_t code; // the PS/2 scan code (after the E0 prefix for the _E0 tables)
+    uint8_t usb; // the USB key code it maps to, or 0 for none
+};
+
+#define REMAP_MAX_ENTRIES 255 // enough for all of layout.txt. 4 + 3*255 bytes of the 1 KB EEPROM
+
+// the requests
+enum {
+    REMAP_BEGIN = 1, // start an upload. the list in EEPROM is invalid until the COMMIT
+    REMAP_ADD,       // append the entries to the upload
+    REMAP_COMMIT,    // the upload is complete. make it the list, and use it
+    REMAP_CLEAR,     // forget the list, and go back to the defaults
+};
+
+// the feature report, as SET_REPORT takes it
+#define REMAP_REQUEST_ENTRIES 20 // as many as fit in a 64 byte packet along with the report ID
+struct remap_request {
+    uint8_t op; // REMAP_BEGIN etc
+    uint8_t num; // how many of entries[] an ADD has
+    struct remap_entry entries[REMAP_REQUEST_ENTRIES];
+};
+
+// and as GET_REPORT returns it
+enum {
+    REMAP_OK,      // the last request is done
+    REMAP_BUSY,    // the last request is still being written. wait for it before sending the next
+    REMAP_REFUSED, // the last request was refused: it came while another was busy, or out of order, or an entry was bad, or the list is full
+};
+struct remap_status {
+    uint8_t status; // REMAP_OK etc
+    uint8_t entries; // in the list in use (0 means the defaults are)
+    uint8_t uploaded; // entries added since the BEGIN
+    uint8_t applied; // of the list's entries, how many fit the tables of the (first) keyboard's scan set. the others are for the other set, or out of range
+};
+
+void remap_init(void); // check the list in EEPROM. call before keycodes_select_set()
+uint8_t remap_tick(void); // from the main loop. writes the next queued byte. returns true when a new list has just taken effect
+uint8_t remap_busy(void); // true while there are bytes waiting to be written
+
+// keycodes.c's part: apply the list's entries for the tables of scan set set, by calling put() for each
+void remap_apply(uint8_t set, uint8_t (*put)(uint8_t table, uint8_t code, uint8_t usb));
+
+// the diagnostics interface's part
+uint8_t remap_get_status(uint8_t* buf); // fill in a struct remap_status; returns its size
+void remap_request(const void* data, uint16_t len);
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
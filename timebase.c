@@ -0,0 +1,141 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "timebase.h"
+#include "budget.h"
+
+static volatile uint32_t overflows; // of TCNT1
+volatile uint8_t timebase_reads; // bumped by every read of TCNT1, and by TIMER1_OVF_vect (see ticks())
+
+// Timer1, as the count of its overflows and TCNT1
+//
+// the AVR reads TCNT1 a byte at a time, through a TEMP register which all the 16 bit Timer1 registers share. an ISR
+// which reads one of them between our two bytes leaves us with its high byte instead of ours, and cli() is what
+// the datasheet suggests. Instead, every reader bumps timebase_reads before it starts, and starts over if someone
+// else bumped it meanwhile. the same catches TIMER1_OVF_vect changing overflows under us. Readers inside ISRs can't
+// be interrupted by the main loop, so they always get through on the first try.
+static uint16_t read_timer(uint32_t* overflowed) {
+    uint8_t r;
+    uint32_t o;
+    uint16_t t;
+    do {
+        r = ++timebase_reads;
+        o = overflows;
+        t = TCNT1;
+        // if TCNT1 has overflowed but the ISR hasn't run yet (we're called from inside another ISR) count the overflow ourselves
+        if ((TIFR1 & _BV(TOV1)) && t < 0x8000)
+            o++;
+    } while (r != timebase_reads);
+    *overflowed = o;
+    return t;
+}
+
+// in 0.5 usec ticks, as 32 bits
+static uint32_t ticks(void) {
+    uint32_t o;
+    uint16_t t = read_timer(&o);
+    return (o << 16) | t;
+}
+
+// ticks() >> 1 would lose the top bit, and wrap after 35 minutes
+uint32_t now_us(void) {
+    uint32_t o;
+    uint16_t t = read_timer(&o);
+    return (o << 15) | (t >> 1);
+}
+
+uint16_t now_ticks16(void) {
+    return (uint16_t)ticks();
+}
+
+// ICR1 goes through TEMP too. it's only read from TIMER1_CAPT_vect, so bumping timebase_reads is enough to make any ticks() it interrupted start over
+uint16_t timebase_icr1(void) {
+    timebase_reads++;
+    return ICR1;
+}
+
+// (too short to be worth timing, and budget_start() would read the time before overflows caught up with TCNT1)
+ISR(TIMER1_OVF_vect) {
+    overflows++;
+    timebase_reads++;
+}
+
+void timebase_init(void) {
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11); // normal mode, /8 prescalar
+    TIMSK1 = _BV(TOIE1);
+}
+
+// the alarms
+//
+// the compare unit matches the low 16 bits of the deadline once every overflow, so the ISR checks the high 16 bits
+// too, and keeps waiting until they match as well
+static struct {
+    uint32_t at; // the deadline, in ticks()
+    void (*fn)(void);
+} alarms[ALARM_NUM];
+
+void alarm_set(uint8_t which, uint32_t us, void (*fn)(void)) {
+    uint8_t oldSREG = SREG;
+    cli(); // writing OCR1x also goes through TEMP, and the ISR mustn't see half an alarm
+    uint32_t at = ticks() + 2*us;
+    alarms[which].at = at;
+    alarms[which].fn = fn;
+    uint8_t bit = which == ALARM_PS2 ? _BV(OCF1A) : _BV(OCF1B); // (the same bits in TIMSK1 and TIFR1)
+    if (which == ALARM_PS2)
+        OCR1A = (uint16_t)at;
+    else
+        OCR1B = (uint16_t)at;
+    TIFR1 = bit; // forget any match from before
+    TIMSK1 |= bit;
+    SREG = oldSREG;
+}
+
+void alarm_cancel(uint8_t which) {
+    uint8_t oldSREG = SREG;
+    cli();
+    TIMSK1 &= ~(which == ALARM_PS2 ? _BV(OCIE1A) : _BV(OCIE1B));
+    SREG = oldSREG;
+}
+
+uint8_t alarm_pending(uint8_t which) {
+    return TIMSK1 & (which == ALARM_PS2 ? _BV(OCIE1A) : _BV(OCIE1B));
+}
+
+static inline void alarm_match(uint8_t which) {
+    if ((int16_t)((ticks() >> 16) - (alarms[which].at >> 16)) < 0)
+        return; // the low 16 bits matched, but it's an overflow or more too early
+    TIMSK1 &= ~(which == ALARM_PS2 ? _BV(OCIE1A) : _BV(OCIE1B));
+    if (alarms[which].fn)
+        alarms[which].fn();
+}
+
+ISR(TIMER1_COMPA_vect) {
+    uint16_t start = budget_start();
+    alarm_match(ALARM_PS2);
+    budget_end(BUDGET_TIMER1, start);
+}
+
+ISR(TIMER1_COMPB_vect) {
+    uint16_t start = budget_start();
+    alarm_match(ALARM_KEYS);
+    budget_end(BUDGET_TIMER1, start);
+}
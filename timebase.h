@@ -0,0 +1,75 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// the time, from Timer1
+//
+// Timer1 runs free at F_CPU/8, so it ticks every 0.5 usec and overflows every 32.768 msec. TIMER1_OVF_vect counts
+// the overflows, and now_us() puts the two together. it can be called from anywhere, ISRs included, and never
+// turns interrupts off (see timebase.c for how).
+// Timer1's compare units make one-shot alarms, which call a function from their ISR when the time comes, so
+// nothing has to spin waiting for a timeout.
+// Timer1 stops while we sleep in standby (see main()), and so does the time.
+
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void timebase_init(void);
+
+uint32_t now_us(void); // usec since power up. wraps every 71 minutes
+// the low 16 bits, which is all the timestamps kept in RAM need. good for intervals up to 65 msec
+static inline uint16_t now_us16(void) {
+    return (uint16_t)now_us();
+}
+uint16_t now_ticks16(void); // Timer1 itself, in 0.5 usec ticks, for when usec are too coarse
+uint16_t timebase_icr1(void); // ICR1, the time of Timer1's last input capture, in the same ticks (see capture.h)
+
+// TCNT1 read straight, in the same ticks, for an ISR which runs too often to afford a call to now_us16(). only
+// from inside an ISR. bumping timebase_reads makes any ticks() it interrupted start over (see timebase.c)
+extern volatile uint8_t timebase_reads;
+static inline uint16_t timebase_tcnt1(void) {
+    timebase_reads++;
+    return TCNT1;
+}
+
+// the alarms, one per compare unit
+enum {
+    ALARM_PS2,  // OCR1A: the PS/2 transmitter's timeouts
+    ALARM_KEYS, // OCR1B: free for timing keys
+    ALARM_NUM
+};
+
+// call fn from the compare ISR (with interrupts off) us usec from now, replacing whatever alarm was set. fn may
+// be NULL, for an alarm which is only looked at with alarm_pending(). us must be at least ALARM_MIN_US
+#define ALARM_MIN_US 16
+void alarm_set(uint8_t which, uint32_t us, void (*fn)(void));
+void alarm_cancel(uint8_t which);
+uint8_t alarm_pending(uint8_t which); // true until the alarm goes off or is cancelled
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif
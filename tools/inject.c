@@ -0,0 +1,143 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// type text on the host through the adapter (see inject.h), as if it had been typed on the keyboard
+//
+// usage: inject /dev/hidrawN text...   types the text, the arguments separated by spaces
+//        inject /dev/hidrawN           types stdin
+//        inject -c /dev/hidrawN        throws away whatever hasn't been typed yet
+// it returns once the adapter has typed it all. the text is US ASCII; \n is ENTER and \t TAB. characters with no key
+// on a US keyboard are skipped, and counted at the end.
+// (this runs on linux, not the AVR)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "../inject.h"
+
+// this must match diag.h, which can't be included here because it needs LUFA
+#define DIAG_REPORT_INJECT 9
+
+static int get_status(int fd, struct inject_status* st) {
+    uint8_t buf[1 + sizeof(struct inject_request)];
+    buf[0] = DIAG_REPORT_INJECT;
+    int n = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+    if (n < 0) {
+        perror("HIDIOCGFEATURE");
+        return -1;
+    }
+    if (n < 1 + (int)sizeof(*st)) {
+        fprintf(stderr, "the adapter's inject report is only %d bytes. is its firmware older than this tool?\n", n);
+        return -1;
+    }
+    memcpy(st, buf+1, sizeof(*st));
+    return 0;
+}
+
+static int request(int fd, uint8_t op, const char* data, unsigned len) {
+    uint8_t buf[1 + sizeof(struct inject_request)];
+    struct inject_request* r = (struct inject_request*)(buf+1);
+    memset(buf, 0, sizeof(buf));
+    buf[0] = DIAG_REPORT_INJECT;
+    r->op = op;
+    r->len = len;
+    memcpy(r->data, data, len);
+    if (ioctl(fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0) {
+        perror("HIDIOCSFEATURE");
+        return -1;
+    }
+    return 0;
+}
+
+// type text, a queue full at a time
+static int type(int fd, const char* text, size_t len, struct inject_status* st) {
+    while (len) {
+        if (get_status(fd, st) < 0)
+            return -1;
+        if (!st->free) {
+            usleep(10000); // 20 msec of typing at the 2 msec polling interval
+            continue;
+        }
+        unsigned n = len < st->free ? len : st->free;
+        if (n > INJECT_REQUEST_BYTES)
+            n = INJECT_REQUEST_BYTES;
+        uint8_t refused = st->refused;
+        if (request(fd, INJECT_TEXT, text, n) < 0 || get_status(fd, st) < 0)
+            return -1;
+        if (st->refused != refused) {
+            // someone else is typing through the adapter too. try again when there's room
+            usleep(10000);
+            continue;
+        }
+        text += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int clear = argc > 1 && !strcmp(argv[1], "-c");
+    if (argc < 2 + clear || (clear && argc != 3)) {
+        fprintf(stderr, "usage: %s [-c] /dev/hidrawN [text...]\n", argv[0]);
+        return 2;
+    }
+    const char* dev = argv[1 + clear];
+    int fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        perror(dev);
+        return 1;
+    }
+    struct inject_status st;
+    if (clear) {
+        int err = request(fd, INJECT_CLEAR, "", 0) < 0;
+        close(fd);
+        return err;
+    }
+    if (get_status(fd, &st) < 0)
+        return 1;
+    uint8_t unknown = st.unknown;
+
+    int err = 0;
+    if (argc > 2) {
+        for (int i=2; i<argc && !err; i++) {
+            err = type(fd, argv[i], strlen(argv[i]), &st);
+            if (i+1 < argc && !err)
+                err = type(fd, " ", 1, &st);
+        }
+    } else {
+        char buf[4096];
+        size_t n;
+        while (!err && (n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+            err = type(fd, buf, n, &st);
+    }
+    // and wait for it to be typed
+    while (!err && st.queued) {
+        usleep(10000);
+        err = get_status(fd, &st);
+    }
+    if (!err && st.unknown != unknown)
+        fprintf(stderr, "%u characters had no key on a US keyboard, and were skipped\n", (uint8_t)(st.unknown - unknown));
+    close(fd);
+    return err != 0;
+}
@@ -0,0 +1,310 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// turn the layout description (layout.txt) into the PROGMEM lookup tables keycodes.c uses
+//
+// each table only covers the range of scan codes its layout section actually uses, and comes with a
+// <NAME>_BASE define for the first of them. keycodes.c copies both sets' tables into RAM, since each keyboard can be
+// in either set (with any remapping from EEPROM on top, see remap.h), so a lookup is still a subtract, a compare and
+// one load. the layer tables stay in flash
+//
+// the layers and the tap-hold keys (see layers.h) go in a part of keymap.h of their own, which only layers.c
+// includes, by defining KEYMAP_LAYERS first. the layer tables are the same sort of table, indexed by USB code
+//
+// usage: mklayout layout.txt keymap.h
+// (this runs on the build machine, not the AVR)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../layers.h"
+
+// the sections a layout file can have, and the names of the tables they become
+static const struct {
+    const char* section;
+    const char* name;
+    int layer; // the table maps USB codes, not PS/2 ones
+} tables[] = {
+    { "set3",    "set3_map" },
+    { "set3 e0", "set3_e0_map" },
+    { "set2",    "set2_map" },
+    { "set2 e0", "set2_e0_map" },
+    { "layer 1", "layer1_map", 1 },
+    { "layer 2", "layer2_map", 1 },
+    { "layer 3", "layer3_map", 1 },
+};
+#define NUM_TABLES (sizeof(tables)/sizeof(tables[0]))
+#define TAP_HOLD_SECTION NUM_TABLES // [tap hold], which is a list rather than a table
+
+static struct tap_hold_key tap_hold[0xe8];
+static int tap_hold_line[0xe8]; // where each key's tap-hold was defined, or 0
+static unsigned num_tap_hold;
+
+static struct {
+    unsigned char usb[256]; // 0 = no mapping
+    int line[256]; // where each mapping was defined, or 0
+    int lo, hi; // the range of codes used; lo > hi if none
+} maps[NUM_TABLES];
+
+static const char* layout_name;
+static int errors;
+
+static void error(int line, const char* msg, unsigned code) {
+    fprintf(stderr, "%s:%d: ", layout_name, line);
+    fprintf(stderr, msg, code);
+    fputc('\n', stderr);
+    errors++;
+}
+
+// parse a hex number at *p, advancing *p past it. returns -1 if there isn't one
+static int parse_hex(char** p) {
+    char* end;
+    long v = strtol(*p, &end, 16);
+    if (end == *p || (*end && !isspace((unsigned char)*end)))
+        return -1;
+    *p = end;
+    return (int)v;
+}
+
+// is usb a USB key (or one of the layer keys) which matrix[] has room for? says why not if it isn't
+static int is_key(int usb, int line) {
+    if (usb == 0 || usb >= 0xe8) {
+        // main.c's matrix[] stops at 0xE7, the last key the USB HID keyboard page defines
+        error(line, "USB code 0x%x isn't a key between 0x01 and 0xe7", usb);
+        return 0;
+    }
+    return 1;
+}
+
+// a line of [tap hold]: <USB code> <USB code when held> <USB code when tapped>
+static void read_tap_hold(char* p, int line) {
+    int key = parse_hex(&p);
+    while (isspace((unsigned char)*p))
+        p++;
+    int hold = parse_hex(&p);
+    while (isspace((unsigned char)*p))
+        p++;
+    int tap = parse_hex(&p);
+    if (key < 0 || hold < 0 || tap < 0) {
+        error(line, "expected <USB code> <USB code when held> <USB code when tapped>", 0);
+        return;
+    }
+    if (!is_key(key, line) || !is_key(hold, line) || !is_key(tap, line))
+        return;
+    if (IS_LAYER_KEY(tap) && tap < LAYER_TOGGLE) {
+        error(line, "tapping a momentary layer key 0x%x would turn the layer off as soon as it was on", tap);
+        return;
+    }
+    if (tap_hold_line[key]) {
+        fprintf(stderr, "%s:%d: USB code 0x%02x is already a tap-hold key on line %d\n", layout_name, line, key, tap_hold_line[key]);
+        errors++;
+        return;
+    }
+    tap_hold_line[key] = line;
+    tap_hold[num_tap_hold++] = (struct tap_hold_key){ key, hold, tap };
+}
+
+static void read_layout(FILE* f) {
+    char buf[512];
+    int line = 0;
+    int t = -1; // the table we are in
+    for (unsigned i=0; i<NUM_TABLES; i++) {
+        maps[i].lo = 256;
+        maps[i].hi = -1;
+    }
+
+    while (fgets(buf, sizeof(buf), f)) {
+        line++;
+        char* hash = strchr(buf, '#');
+        if (hash)
+            *hash = 0;
+        char* p = buf;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (!*p)
+            continue;
+
+        if (*p == '[') {
+            char* close = strchr(p, ']');
+            if (!close) {
+                error(line, "missing ']'", 0);
+                continue;
+            }
+            *close = 0;
+            t = -1;
+            for (unsigned i=0; i<NUM_TABLES; i++)
+                if (!strcmp(p+1, tables[i].section))
+                    t = i;
+            if (!strcmp(p+1, "tap hold"))
+                t = TAP_HOLD_SECTION;
+            if (t < 0)
+                error(line, "unknown section", 0);
+            continue;
+        }
+
+        if (t == TAP_HOLD_SECTION) {
+            read_tap_hold(p, line);
+            continue;
+        }
+
+        int ps2 = parse_hex(&p);
+        while (isspace((unsigned char)*p))
+            p++;
+        int usb = parse_hex(&p);
+        // anything after that is the key's name
+        if (ps2 < 0 || usb < 0) {
+            error(line, t >= 0 && tables[t].layer ? "expected <USB code> <USB code>" : "expected <PS/2 code> <USB code>", 0);
+            continue;
+        }
+        if (t < 0) {
+            error(line, "mapping outside of any section", 0);
+            continue;
+        }
+        if (tables[t].layer ? !is_key(ps2, line) : ps2 > 0xff) {
+            if (!tables[t].layer)
+                error(line, "PS/2 code 0x%x is more than a byte", ps2);
+            continue;
+        }
+        if (!is_key(usb, line))
+            continue;
+        if (maps[t].line[ps2]) {
+            fprintf(stderr, "%s:%d: %s code 0x%02x is already mapped on line %d\n", layout_name, line,
+                    tables[t].layer ? "USB" : "PS/2", ps2, maps[t].line[ps2]);
+            errors++;
+            continue;
+        }
+        maps[t].usb[ps2] = usb;
+        maps[t].line[ps2] = line;
+        if (ps2 < maps[t].lo)
+            maps[t].lo = ps2;
+        if (ps2 > maps[t].hi)
+            maps[t].hi = ps2;
+    }
+}
+
+static void write_keymap(FILE* f) {
+    fprintf(f, "// generated from %s by tools/mklayout. edit that, not this\n\n", layout_name);
+    fprintf(f, "#ifndef KEYMAP_LAYERS\n\n");
+    for (unsigned t=0; t<NUM_TABLES; t++) {
+        if (t && tables[t].layer != tables[t-1].layer)
+            fprintf(f, "#else // the layers, for layers.c\n\n");
+        int lo = maps[t].lo, hi = maps[t].hi;
+        if (lo > hi)
+            lo = hi = 0; // an empty section still gets a (1 byte, all unmapped) table
+        char upper[32];
+        unsigned i;
+        for (i=0; tables[t].name[i] && i<sizeof(upper)-1; i++)
+            upper[i] = toupper((unsigned char)tables[t].name[i]);
+        upper[i] = 0;
+
+        fprintf(f, "// [%s], codes 0x%02x-0x%02x\n", tables[t].section, lo, hi);
+        fprintf(f, "#define %s_BASE 0x%02x\n", upper, lo);
+        fprintf(f, "static const uint8_t PROGMEM %s[] = {", tables[t].name);
+        for (int c=lo; c<=hi; c++) {
+            if ((c-lo) % 16 == 0)
+                fprintf(f, "\n    /* %02x */", c);
+            fprintf(f, " 0x%02x,", maps[t].usb[c]);
+        }
+        fprintf(f, "\n};\n\n");
+    }
+
+    fprintf(f, "// [tap hold]\n");
+    fprintf(f, "#define NUM_TAP_HOLD_KEYS %u\n", num_tap_hold);
+    fprintf(f, "static const struct tap_hold_key PROGMEM tap_hold_keys[] = {\n");
+    for (unsigned i=0; i<num_tap_hold; i++)
+        fprintf(f, "    { 0x%02x, 0x%02x, 0x%02x },\n", tap_hold[i].key, tap_hold[i].hold, tap_hold[i].tap);
+    if (!num_tap_hold)
+        fprintf(f, "    { 0 }, // (none, but C wants an array to have something in it)\n");
+    fprintf(f, "};\n\n");
+
+    // a bitmap of the USB codes layers.c can't pass straight through even when no layer is on
+    unsigned char special[0xe8/8] = { 0 };
+    for (unsigned i=0; i<num_tap_hold; i++)
+        special[tap_hold[i].key/8] |= 1 << (tap_hold[i].key%8);
+    for (int u=LAYER_MOMENTARY; u<LAYER_TOGGLE+NUM_LAYERS; u++)
+        special[u/8] |= 1 << (u%8);
+    fprintf(f, "// the layer keys and the tap-hold keys, a bit per USB code\n");
+    fprintf(f, "static const uint8_t PROGMEM special_keys[] = {");
+    for (unsigned i=0; i<sizeof(special); i++)
+        fprintf(f, "%s 0x%02x,", i%16 ? "" : "\n   ", special[i]);
+    fprintf(f, "\n};\n\n#endif\n");
+}
+
+// tell the human how much flash the tables take, and what tables indexed from code 0 would have
+static void print_sizes(void) {
+    unsigned total = 0, total_0 = 0, total_ram = 0;
+    printf("%-10s %-12s %6s %6s %12s\n", "table", "codes", "flash", "RAM", "(from 0x00)");
+    for (unsigned t=0; t<NUM_TABLES; t++) {
+        int lo = maps[t].lo, hi = maps[t].hi;
+        unsigned keys = 0;
+        for (int c=0; c<256; c++)
+            keys += maps[t].usb[c] != 0;
+        unsigned flash = lo <= hi ? hi-lo+1 : 1;
+        unsigned flash_0 = lo <= hi ? hi+1 : 1;
+        char range[16];
+        if (lo <= hi)
+            snprintf(range, sizeof(range), "%02x-%02x", lo, hi);
+        else
+            snprintf(range, sizeof(range), "none");
+        unsigned ram = tables[t].layer ? 0 : flash; // (a set's tables are copied as they are)
+        printf("%-10s %-12s %6u %6u %12u   %u keys\n", tables[t].section, range, flash, ram, flash_0, keys);
+        total += flash;
+        total_ram += ram;
+        total_0 += flash_0;
+    }
+    unsigned th = (num_tap_hold ? num_tap_hold : 1) * sizeof(struct tap_hold_key) + 0xe8/8;
+    printf("%-10s %-12s %6u %6u %12u   %u keys\n", "tap hold", "", th, 0, th, num_tap_hold);
+    total += th;
+    total_0 += th;
+    printf("%-10s %-12s %6u %6u %12u\n", "total", "", total, total_ram, total_0);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s layout.txt keymap.h\n", argv[0]);
+        return 2;
+    }
+    layout_name = argv[1];
+    FILE* in = fopen(argv[1], "r");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    read_layout(in);
+    fclose(in);
+    if (errors)
+        return 1;
+
+    FILE* out = fopen(argv[2], "w");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    write_keymap(out);
+    if (fclose(out)) {
+        perror(argv[2]);
+        remove(argv[2]);
+        return 1;
+    }
+
+    print_sizes();
+    return 0;
+}
@@ -0,0 +1,435 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// capture the PS/2 signals through the adapter and print their timing, frame by frame
+//
+// the firmware timestamps each edge on the Clk and Data wires (see capture.h; Clk has to be jumpered to PD4 for this).
+// this arms a capture of the next N frames, collects the edges the adapter streams back, and works out for each
+// frame its Clk period and low and high times, how long Data was set up before and held after the Clk edge which
+// samples it, and any glitches. Margins which are thin compared to the PS/2 spec are flagged, since those are the
+// cables and keyboards which will produce parity errors (and the resends they cost) sooner or later.
+//
+// usage: ps2timing [-n frames] [-e] [-o file] /dev/hidrawN   capture that many frames (default 20), and print the report
+//        ps2timing [-e] file                                 print the report of a capture saved earlier with -o
+//   -e also prints every edge
+// (this runs on linux, not the AVR)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/hidraw.h>
+
+// these must match diag.h and capture.h, which can't be included here because they need LUFA and the AVR headers
+#define DIAG_REPORT_CAPTURE 6
+#define DIAG_REPORT_CAPTURE_STREAM 7
+#define CAPTURE_STATUS_SIZE 6
+#define CAPTURE_STREAM_EDGES 15
+#define CAPTURE_STREAM_DONE 0x80
+#define STREAM_REPORT_SIZE (1 + 2 + 4*CAPTURE_STREAM_EDGES) // the report ID, num and lost, then the edges
+
+#define CAPTURE_CLK       0x01
+#define CAPTURE_DATA      0x02
+#define CAPTURE_DATA_EDGE 0x04
+#define CAPTURE_MISSED    0x08
+#define CAPTURE_FRAME     0x10
+#define LOST              0x80 // not from the firmware: marks where edges were lost
+
+// the PS/2 spec's limits, in usec
+#define SPEC_PERIOD_MIN 60 // 16.7 kHz
+#define SPEC_PERIOD_MAX 100 // 10 kHz
+#define SPEC_HALF_MIN   30 // Clk low or high
+#define SPEC_SETUP_MIN  5 // Data stable before the sampling edge of Clk
+#define SPEC_HOLD_MIN   5 // and after the other edge
+#define GLITCH_US       10 // a Clk pulse shorter than this is a glitch, not a bit
+#define INHIBIT_US      80 // a frame starting with Clk held low longer than this is us sending to the keyboard
+#define START_BIT_US    80 // the keyboard's start bit pulls Data low at most this long before its first Clk edge
+
+struct edge {
+    uint16_t time; // Timer1 ticks (0.5 usec)
+    uint8_t lines;
+    uint8_t lag;
+};
+
+static struct edge* edges;
+static unsigned num_edges, max_edges;
+
+static void add_edge(uint16_t time, uint8_t lines, uint8_t lag) {
+    if (num_edges == max_edges) {
+        max_edges = max_edges ? 2*max_edges : 1024;
+        edges = realloc(edges, max_edges * sizeof(*edges));
+        if (!edges) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    edges[num_edges].time = time;
+    edges[num_edges].lines = lines;
+    edges[num_edges].lag = lag;
+    num_edges++;
+}
+
+// take the edges out of one stream report (starting at its report ID). returns true if it was the last one
+static int add_report(const uint8_t* r) {
+    if (r[2])
+        add_edge(0, LOST, r[2]);
+    unsigned n = r[1] & ~CAPTURE_STREAM_DONE;
+    for (unsigned i=0; i<n && i<CAPTURE_STREAM_EDGES; i++) {
+        const uint8_t* e = r + 3 + 4*i;
+        add_edge(e[0] | e[1]<<8, e[2], e[3]);
+    }
+    return (r[1] & CAPTURE_STREAM_DONE) != 0;
+}
+
+// arm a capture and collect the edges as they stream in, saving the reports to save if it's not NULL
+static int capture(const char* name, unsigned frames, FILE* save) {
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        perror(name);
+        return 1;
+    }
+    uint8_t buf[64] = { DIAG_REPORT_CAPTURE, frames };
+    if (ioctl(fd, HIDIOCSFEATURE(1 + CAPTURE_STATUS_SIZE), buf) < 0) {
+        perror("HIDIOCSFEATURE");
+        close(fd);
+        return 1;
+    }
+    fprintf(stderr, "capturing %u frames; type on the keyboard...\n", frames);
+    int n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (buf[0] != DIAG_REPORT_CAPTURE_STREAM || n != STREAM_REPORT_SIZE)
+            continue; // some other report
+        if (save)
+            fwrite(buf, STREAM_REPORT_SIZE, 1, save);
+        if (add_report(buf))
+            break;
+    }
+    if (n < 0)
+        perror(name);
+    close(fd);
+    return n < 0;
+}
+
+static int load(const char* name) {
+    FILE* f = fopen(name, "rb");
+    if (!f) {
+        perror(name);
+        return 1;
+    }
+    uint8_t buf[STREAM_REPORT_SIZE];
+    while (fread(buf, sizeof(buf), 1, f) == 1)
+        if (buf[0] == DIAG_REPORT_CAPTURE_STREAM)
+            add_report(buf);
+    fclose(f);
+    return 0;
+}
+
+// one frame, in usec relative to its first Clk edge, Clk and Data edges in time order
+struct ev {
+    double t;
+    uint8_t lines;
+};
+
+static struct {
+    unsigned frames, errors, glitches, violations, incomplete;
+    double period_min, period_max, low_min, high_min, setup_min, hold_min;
+} total = { .period_min = 1e9, .low_min = 1e9, .high_min = 1e9, .setup_min = 1e9, .hold_min = 1e9 };
+
+static int cmp_ev(const void* a, const void* b) {
+    const struct ev* x = a;
+    const struct ev* y = b;
+    return x->t < y->t ? -1 : x->t > y->t;
+}
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+// edges[first..end) are a frame whose first Clk edge is edges[start], preceded by the Data edges of its start bit
+static void frame(unsigned num, unsigned first, unsigned start, unsigned end, int print_edges) {
+    struct ev ev[end - first];
+    unsigned n = 0;
+    int lost = 0;
+    uint16_t t0 = edges[start].time;
+    for (unsigned i=first; i<end; i++) {
+        if (edges[i].lines & LOST) {
+            lost = 1;
+            continue;
+        }
+        // the times only have 16 bits, so they're taken relative to the frame, which is much shorter than their 32 msec wrap
+        // (a Data edge which came just after edges[start] can still be ahead of it in the ring, if INT2_vect ran before TIMER1_CAPT_vect)
+        ev[n].t = i < start ? (double)(int16_t)(edges[i].time - t0) / 2 : (double)(uint16_t)(edges[i].time - t0) / 2;
+        ev[n].lines = edges[i].lines;
+        n++;
+    }
+    // Data edges are recorded when their ISR runs, which can be after a Clk edge which came later
+    qsort(ev, n, sizeof(ev[0]), cmp_ev);
+
+    if (print_edges)
+        for (unsigned i=0; i<n; i++)
+            printf("          %8.1f us  %s %s%s%s\n", ev[i].t,
+                   ev[i].lines & CAPTURE_DATA_EDGE ? "Data" : "Clk ",
+                   ev[i].lines & CAPTURE_DATA_EDGE ? (ev[i].lines & CAPTURE_DATA ? "rises" : "falls") : (ev[i].lines & CAPTURE_CLK ? "rises" : "falls"),
+                   ev[i].lines & CAPTURE_MISSED ? " (and went back before it could be captured)" : "",
+                   ev[i].lines & CAPTURE_FRAME ? " (frame)" : "");
+
+    // is it the keyboard sending, or us? we start by holding Clk low for 100 usec
+    double first_low = 0;
+    for (unsigned i=0; i<n; i++)
+        if (!(ev[i].lines & CAPTURE_DATA_EDGE) && ev[i].t > 0) {
+            first_low = ev[i].t;
+            break;
+        }
+    int to_kbd = first_low > INHIBIT_US;
+    // the keyboard samples our bits on the rising edge of Clk, and we sample its bits on the falling edge. Data has to
+    // be stable from the setup time before the sampling edge to the Clk edge after it, and may change between those
+    uint8_t sample_level = to_kbd ? CAPTURE_CLK : 0;
+
+    double period_min = 1e9, period_max = 0, period_sum = 0, low_min = 1e9, high_min = 1e9, setup_min = 1e9, hold_min = 1e9;
+    unsigned periods = 0, glitches = 0, violations = 0, bits = 0;
+    uint16_t value = 0;
+    double last_fall = -1e9, last_clk = -1e9, last_data = -1e9;
+    uint8_t clk = CAPTURE_CLK, missed = 0;
+    uint8_t data = ev[0].lines & CAPTURE_DATA_EDGE ? ~ev[0].lines & CAPTURE_DATA : ev[0].lines & CAPTURE_DATA;
+    int inhibit = to_kbd; // until the end of our inhibit, which isn't a bit
+    for (unsigned i=0; i<n; i++) {
+        double t = ev[i].t;
+        uint8_t l = ev[i].lines;
+        if (l & CAPTURE_DATA_EDGE) {
+            uint8_t d = l & CAPTURE_DATA;
+            if (d == data)
+                glitches++; // it changed and changed back before INT2_vect could run
+            data = d;
+            // (the keyboard's ack after our stop bit comes while Clk is high, and isn't a bit)
+            if (t > 0 && !inhibit && bits < (to_kbd ? 10 : 11)) {
+                if (clk == sample_level)
+                    violations++; // Data moved while it should have been held
+                else if (last_clk > -1e8)
+                    hold_min = MIN(hold_min, t - last_clk);
+            }
+            last_data = t;
+            continue;
+        }
+
+        uint8_t c = l & CAPTURE_CLK;
+        if (l & CAPTURE_MISSED)
+            glitches++;
+        else if (c == clk && !missed)
+            glitches++; // two edges the same way, so there was one in between which wasn't captured
+        missed = l & CAPTURE_MISSED;
+        if (t - last_clk < GLITCH_US)
+            glitches++;
+        if (!c) {
+            if (last_clk > -1e8 && last_fall > -1e8)
+                high_min = MIN(high_min, t - last_clk);
+            if (last_fall > -1e8) {
+                double p = t - last_fall;
+                period_min = MIN(period_min, p);
+                period_max = MAX(period_max, p);
+                period_sum += p;
+                periods++;
+            }
+            last_fall = t;
+        } else if (inhibit) {
+            // the end of our inhibit: the keyboard clocks the bits in from its next falling edge
+            inhibit = 0;
+            last_fall = -1e9;
+            clk = c;
+            last_clk = t;
+            continue;
+        } else if (last_clk > -1e8) {
+            low_min = MIN(low_min, t - last_clk);
+        }
+        if (c == sample_level && c != clk) {
+            if (last_data > last_clk)
+                setup_min = MIN(setup_min, t - last_data);
+            if (bits < 16 && data)
+                value |= 1 << bits;
+            bits++;
+        }
+        clk = c;
+        last_clk = t;
+    }
+
+    // device to host: start, 8 data bits, odd parity, stop. host to device: 8 data bits, parity, stop, and the keyboard's ack
+    unsigned byte, ok;
+    if (!to_kbd) {
+        byte = (value >> 1) & 0xff;
+        ok = bits == 11 && !(value & 1) && (__builtin_popcount(value & 0x3fe) & 1) && (value & 0x400);
+    } else {
+        byte = value & 0xff;
+        ok = bits == 11 && (__builtin_popcount(value & 0x1ff) & 1) && (value & 0x200) && !(value & 0x400);
+    }
+
+    printf("%5u  %s  ", num, to_kbd ? "to kbd " : "from kbd");
+    if (bits >= 9)
+        printf("0x%02x %s", byte, ok ? "  " : "? ");
+    else
+        printf("--   ");
+    printf("%3u", bits);
+    if (periods)
+        printf("  %5.1f %5.1f %5.1f", period_min, period_sum / periods, period_max);
+    else
+        printf("      -     -     -");
+    if (low_min < 1e9)
+        printf("  %5.1f %5.1f", low_min, high_min < 1e9 ? high_min : 0);
+    else
+        printf("      -     -");
+    if (setup_min < 1e9)
+        printf("  %5.1f", setup_min);
+    else
+        printf("      -");
+    if (hold_min < 1e9)
+        printf("  %5.1f", hold_min);
+    else
+        printf("      -");
+    printf("  %4u %4u", glitches, violations);
+    // and what's marginal
+    if (lost)
+        printf("  edges lost");
+    if (periods && (period_min < SPEC_PERIOD_MIN || period_max > SPEC_PERIOD_MAX))
+        printf("  period");
+    if (low_min < SPEC_HALF_MIN || (high_min < 1e9 && high_min < SPEC_HALF_MIN))
+        printf("  short Clk");
+    if (setup_min < SPEC_SETUP_MIN)
+        printf("  setup");
+    if (hold_min < SPEC_HOLD_MIN)
+        printf("  hold");
+    putchar('\n');
+
+    total.frames++;
+    if (lost)
+        total.incomplete++;
+    else {
+        if (!ok)
+            total.errors++;
+        total.glitches += glitches;
+        total.violations += violations;
+        if (periods) {
+            total.period_min = MIN(total.period_min, period_min);
+            total.period_max = MAX(total.period_max, period_max);
+        }
+        total.low_min = MIN(total.low_min, low_min);
+        total.high_min = MIN(total.high_min, high_min);
+        total.setup_min = MIN(total.setup_min, setup_min);
+        total.hold_min = MIN(total.hold_min, hold_min);
+    }
+}
+
+// the index of the first of the Data edges just before edges[s] which belong to its frame's start bit, but not before floor
+static unsigned lead(unsigned s, unsigned floor) {
+    unsigned j = s;
+    while (j > floor && (edges[j-1].lines & (CAPTURE_DATA_EDGE|LOST)) == CAPTURE_DATA_EDGE &&
+           (int16_t)(edges[s].time - edges[j-1].time) < 2*START_BIT_US)
+        j--;
+    return j;
+}
+
+static int is_frame(unsigned i) {
+    return (edges[i].lines & (CAPTURE_DATA_EDGE|LOST|CAPTURE_FRAME)) == CAPTURE_FRAME;
+}
+
+static void report(int print_edges) {
+    printf("frame  direction byte  bits  period min/avg/max  low  high  setup  hold  glitches violations  (usec)\n");
+    // each frame runs from its Clk edge marked CAPTURE_FRAME to the next one's start bit
+    unsigned s = 0;
+    while (s < num_edges && !is_frame(s))
+        s++;
+    unsigned first = s < num_edges ? lead(s, 0) : 0, num = 0;
+    while (s < num_edges) {
+        unsigned next = s+1;
+        while (next < num_edges && !is_frame(next))
+            next++;
+        unsigned end = next < num_edges ? lead(next, s+1) : num_edges;
+        frame(++num, first, s, end, print_edges);
+        first = end;
+        s = next;
+    }
+    if (!num) {
+        printf("no frames captured. is PD4 jumpered to the PS/2 Clk wire?\n");
+        return;
+    }
+
+    printf("\n%u frames", total.frames);
+    if (total.incomplete)
+        printf(" (%u of them missing edges the host didn't read out in time, and left out of the totals below)", total.incomplete);
+    printf("\n");
+    if (total.period_min < 1e9)
+        printf("  Clk period     %5.1f to %5.1f usec   (spec %u to %u)\n", total.period_min, total.period_max, SPEC_PERIOD_MIN, SPEC_PERIOD_MAX);
+    if (total.low_min < 1e9)
+        printf("  shortest low   %5.1f usec           (spec %u)\n", total.low_min, SPEC_HALF_MIN);
+    if (total.high_min < 1e9)
+        printf("  shortest high  %5.1f usec           (spec %u)\n", total.high_min, SPEC_HALF_MIN);
+    if (total.setup_min < 1e9)
+        printf("  least setup    %5.1f usec           (spec %u)\n", total.setup_min, SPEC_SETUP_MIN);
+    if (total.hold_min < 1e9)
+        printf("  least hold     %5.1f usec           (spec %u)\n", total.hold_min, SPEC_HOLD_MIN);
+    printf("  glitches %u, Data moved while it should have held %u times, %u frames didn't decode\n",
+           total.glitches, total.violations, total.errors);
+    printf("(Data edges are timestamped by INT2_vect, so setup times read a few usec short and hold times as much long)\n");
+}
+
+int main(int argc, char** argv) {
+    unsigned frames = 20;
+    int print_edges = 0;
+    const char* save_name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:eo:")) != -1) {
+        switch (opt) {
+            case 'n':
+                frames = atoi(optarg);
+                break;
+            case 'e':
+                print_edges = 1;
+                break;
+            case 'o':
+                save_name = optarg;
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind != argc - 1 || frames < 1 || frames > 255) {
+        fprintf(stderr, "usage: %s [-n frames (1 to 255)] [-e] [-o file] /dev/hidrawN | file\n", argv[0]);
+        return 2;
+    }
+    const char* name = argv[optind];
+
+    struct stat st;
+    if (stat(name, &st) == 0 && S_ISCHR(st.st_mode)) {
+        FILE* save = NULL;
+        if (save_name && !(save = fopen(save_name, "wb"))) {
+            perror(save_name);
+            return 1;
+        }
+        int err = capture(name, frames, save);
+        if (save)
+            fclose(save);
+        if (err)
+            return 1;
+    } else if (load(name))
+        return 1;
+
+    report(print_edges);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// upload a key remapping to the adapter's EEPROM (see remap.h), so a layout can be changed without reflashing
+//
+// the file has the same format as layout.txt, but only needs the keys which differ from it (a USB code of 0 unmaps a
+// key). a whole layout.txt works too. the new remapping replaces the old one, and is used from the moment it's written.
+//
+// usage: remap /dev/hidrawN          show what's in use
+//        remap /dev/hidrawN file     upload the remapping in file
+//        remap -c /dev/hidrawN       clear it, and go back to the layout built into the firmware
+// (this runs on linux, not the AVR)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "../remap.h"
+
+// this must match diag.h, which can't be included here because it needs LUFA
+#define DIAG_REPORT_REMAP 8
+
+static const char* const sections[REMAP_NUM_TABLES] = { "set3", "set3 e0", "set2", "set2 e0" }; // in the order of REMAP_xxx
+
+static struct remap_entry entries[REMAP_MAX_ENTRIES];
+static unsigned num_entries;
+
+// read the remapping file. returns the number of errors
+static int read_file(const char* name) {
+    FILE* f = fopen(name, "r");
+    if (!f) {
+        perror(name);
+        return 1;
+    }
+    char buf[512];
+    int line = 0, errors = 0, t = -1;
+    while (fgets(buf, sizeof(buf), f)) {
+        line++;
+        char* hash = strchr(buf, '#');
+        if (hash)
+            *hash = 0;
+        char* p = buf;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (!*p)
+            continue;
+        if (*p == '[') {
+            char* close = strchr(p, ']');
+            t = -1;
+            if (close) {
+                *close = 0;
+                for (int i=0; i<REMAP_NUM_TABLES; i++)
+                    if (!strcmp(p+1, sections[i]))
+                        t = i;
+            }
+            if (t < 0) {
+                fprintf(stderr, "%s:%d: unknown section\n", name, line);
+                errors++;
+            }
+            continue;
+        }
+        unsigned ps2, usb;
+        if (sscanf(p, "%x %x", &ps2, &usb) != 2 || ps2 > 0xff || usb > 0xe7) {
+            fprintf(stderr, "%s:%d: expected <PS/2 code> <USB code between 0 and e7>\n", name, line);
+            errors++;
+            continue;
+        }
+        if (t < 0) {
+            fprintf(stderr, "%s:%d: mapping outside of any section\n", name, line);
+            errors++;
+            continue;
+        }
+        if (num_entries == REMAP_MAX_ENTRIES) {
+            fprintf(stderr, "%s:%d: more than the %d mappings the EEPROM has room for\n", name, line, REMAP_MAX_ENTRIES);
+            errors++;
+            break;
+        }
+        entries[num_entries++] = (struct remap_entry){ t, ps2, usb };
+    }
+    fclose(f);
+    return errors;
+}
+
+static int get_status(int fd, struct remap_status* st) {
+    uint8_t buf[1 + sizeof(struct remap_request)];
+    buf[0] = DIAG_REPORT_REMAP;
+    int n = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+    if (n < 0) {
+        perror("HIDIOCGFEATURE");
+        return -1;
+    }
+    if (n < 1 + (int)sizeof(*st)) {
+        fprintf(stderr, "the adapter's remap report is only %d bytes. is its firmware older than this tool?\n", n);
+        return -1;
+    }
+    memcpy(st, buf+1, sizeof(*st));
+    return 0;
+}
+
+// send a request, and wait for the adapter to finish writing it to EEPROM
+static int request(int fd, uint8_t op, const struct remap_entry* e, unsigned num) {
+    uint8_t buf[1 + sizeof(struct remap_request)];
+    struct remap_request* r = (struct remap_request*)(buf+1);
+    memset(buf, 0, sizeof(buf));
+    buf[0] = DIAG_REPORT_REMAP;
+    r->op = op;
+    r->num = num;
+    memcpy(r->entries, e, num * sizeof(*e));
+    if (ioctl(fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0) {
+        perror("HIDIOCSFEATURE");
+        return -1;
+    }
+    // each byte takes the EEPROM 3.4 msec, so an ADD of 20 entries is about a fifth of a second
+    for (int tries=0; tries<500; tries++) {
+        struct remap_status st;
+        if (get_status(fd, &st) < 0)
+            return -1;
+        if (st.status == REMAP_OK)
+            return 0;
+        if (st.status == REMAP_REFUSED) {
+            fprintf(stderr, "the adapter refused the request\n");
+            return -1;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "the adapter is taking too long to write the EEPROM\n");
+    return -1;
+}
+
+static void print_status(int fd) {
+    struct remap_status st;
+    if (get_status(fd, &st) < 0)
+        return;
+    if (st.entries)
+        printf("%u remappings in EEPROM, %u of them for the scan set in use\n", st.entries, st.applied);
+    else
+        printf("no remapping in EEPROM; using the layout built into the firmware\n");
+}
+
+int main(int argc, char** argv) {
+    int clear = 0;
+    if (argc == 3 && !strcmp(argv[1], "-c")) {
+        clear = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 2 && (argc != 3 || clear)) {
+        fprintf(stderr, "usage: %s [-c] /dev/hidrawN [file]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 3 && read_file(argv[2]))
+        return 1;
+
+    int fd = open(argv[1], O_RDWR);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    int err = 0;
+    if (clear) {
+        err = request(fd, REMAP_CLEAR, NULL, 0);
+    } else if (argc == 3) {
+        err = request(fd, REMAP_BEGIN, NULL, 0);
+        for (unsigned i=0; i<num_entries && !err; i += REMAP_REQUEST_ENTRIES) {
+            unsigned n = num_entries - i < REMAP_REQUEST_ENTRIES ? num_entries - i : REMAP_REQUEST_ENTRIES;
+            err = request(fd, REMAP_ADD, entries+i, n);
+        }
+        if (!err)
+            err = request(fd, REMAP_COMMIT, NULL, 0);
+        if (err)
+            fprintf(stderr, "the upload failed, so the adapter is using the layout built into the firmware\n");
+    }
+    print_status(fd);
+    close(fd);
+    return err != 0;
+}
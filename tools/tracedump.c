@@ -0,0 +1,271 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// read the adapter's trace log and print it as text
+//
+// the firmware only records a message number and a byte of argument (see trace.h). the format strings
+// come from trace.h too, so this has to be built from the same source as the firmware it's reading.
+//
+// usage: tracedump /dev/hidrawN      read the log out of the adapter's diagnostics interface
+//        tracedump -c /dev/hidrawN   same, and clear the log afterwards
+//        tracedump -f /dev/hidrawN   print the records the adapter streams as they happen, until killed
+//        tracedump -r /dev/hidrawN   record every byte the keyboard sends, as a replay trace for host/replay, until ^C
+//        tracedump file              decode a report saved earlier (the raw bytes, starting with the report ID)
+// (this runs on linux, not the AVR)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/hidraw.h>
+
+#define TRACE_DECODER
+#include "../trace.h"
+
+// these must match diag.h, which can't be included here because it needs LUFA
+#define DIAG_REPORT_TRACE 2
+#define DIAG_REPORT_TRACE_STREAM 3
+
+#define TRACE_STRING(id, fmt) fmt,
+static const char* const formats[TRACE_NUM_FORMATS] = { TRACE_FORMATS(TRACE_STRING) };
+
+#define REPORT_SIZE (1 + sizeof(struct trace_report)) // the report ID, then the report
+#define STREAM_REPORT_SIZE (1 + sizeof(struct trace_stream_report))
+
+// print one 4 byte record: id, arg, and the time in little endian (it's an AVR).
+// the records are decoded byte by byte rather than trusting this machine's layout of struct trace_record
+static uint16_t prev_time;
+static int have_prev;
+
+static void print_record(const uint8_t* rec) {
+    uint8_t id = rec[0], arg = rec[1];
+    uint16_t t = rec[2] | rec[3]<<8;
+    // the timestamps are in usec and wrap every 65 msec, so only the deltas between records mean much
+    unsigned long delta = have_prev ? (uint16_t)(t - prev_time) : 0;
+    prev_time = t;
+    have_prev = 1;
+    printf("%2u.%03u ms  +%5lu us  ", t/1000, t%1000, delta);
+    if (id < TRACE_NUM_FORMATS)
+        printf(formats[id], arg);
+    else
+        printf("unknown message %u, arg 0x%02x", id, arg);
+    putchar('\n');
+}
+
+// print the streamed records until the device goes away
+static int follow(const char* name) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        return 1;
+    }
+    uint8_t buf[64];
+    int n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (buf[0] != DIAG_REPORT_TRACE_STREAM || n != (int)STREAM_REPORT_SIZE)
+            continue; // some other report
+        const uint8_t* r = buf + 1;
+        if (r[0])
+            printf("(%u%s records lost)\n", r[0], r[0] == 255 ? " or more" : "");
+        for (unsigned i=0; i<r[1] && i<TRACE_STREAM_RECORDS; i++)
+            print_record(r + 2 + 4*i);
+        fflush(stdout);
+    }
+    if (n < 0)
+        perror(name);
+    close(fd);
+    return n < 0;
+}
+
+// the host's clock, in usec
+static uint64_t host_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+// print the bytes the keyboard sends in the replay trace format (see host/replay.c) until interrupted.
+// the records' 16 bit timestamps wrap every 65 msec, and there are often longer pauses than that between keystrokes,
+// so the whole wraps come from this machine's clock, and the exact time within them from the adapter's
+static int record(const char* name) {
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        perror(name);
+        return 1;
+    }
+    // the scan set was traced when the adapter started. it's still in the log unless that has wrapped since
+    uint8_t buf[REPORT_SIZE];
+    unsigned set = 0;
+    buf[0] = DIAG_REPORT_TRACE;
+    if (ioctl(fd, HIDIOCGFEATURE(REPORT_SIZE), buf) == (int)REPORT_SIZE && buf[4] == TRACE_RECORDS) {
+        unsigned count = buf[1] | buf[2]<<8;
+        unsigned num = buf[3] ? TRACE_RECORDS : count;
+        for (unsigned i=0; i<num; i++) {
+            const uint8_t* rec = buf + 5 + 4*((count-num+i) & (TRACE_RECORDS-1));
+            if (rec[0] == TRACE_SCAN_SET)
+                set = rec[1];
+        }
+    }
+    uint8_t on[2] = { DIAG_REPORT_TRACE, 1 };
+    if (ioctl(fd, HIDIOCSFEATURE(2), on) < 0) {
+        perror("HIDIOCSFEATURE");
+        close(fd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; // and no SA_RESTART, so read() returns when we're interrupted
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("# recorded by tracedump -r from %s\n", name);
+    if (set)
+        printf("set %u\n", set);
+    else
+        printf("# the scan set had gone from the trace log. 3 is assumed; change it if the adapter fell back to set 2\n");
+    fflush(stdout);
+
+    int first = 1;
+    uint16_t prev = 0;
+    uint64_t t = 0, prev_host = 0;
+    int n = 0;
+    while (!stop && (n = read(fd, buf, 64)) > 0) {
+        if (buf[0] != DIAG_REPORT_TRACE_STREAM || n != (int)STREAM_REPORT_SIZE)
+            continue;
+        uint64_t h = host_us();
+        const uint8_t* r = buf + 1;
+        if (r[0])
+            printf("# %u%s records lost\n", r[0], r[0] == 255 ? " or more" : "");
+        for (unsigned i=0; i<r[1] && i<TRACE_STREAM_RECORDS; i++) {
+            const uint8_t* rec = r + 2 + 4*i;
+            if (rec[0] != TRACE_PS2_BYTE) {
+                printf("# ");
+                if (rec[0] < TRACE_NUM_FORMATS)
+                    printf(formats[rec[0]], rec[1]);
+                putchar('\n');
+                continue;
+            }
+            uint16_t rt = rec[2] | rec[3]<<8;
+            if (!first) {
+                // add as many whole wraps as make the gap closest to the one this machine saw
+                uint16_t d = rt - prev;
+                uint64_t gap = h - prev_host;
+                t += d;
+                if (gap > d)
+                    t += (gap - d + 32768) / 65536 * 65536;
+            }
+            first = 0;
+            prev = rt;
+            prev_host = h;
+            printf("%llu %02x\n", (unsigned long long)t, rec[1]);
+        }
+        fflush(stdout);
+    }
+    if (n < 0 && !stop)
+        perror(name);
+    uint8_t off[2] = { DIAG_REPORT_TRACE, 0 };
+    if (ioctl(fd, HIDIOCSFEATURE(2), off) < 0)
+        perror("HIDIOCSFEATURE");
+    close(fd);
+    return n < 0 && !stop;
+}
+
+// read the report, from the device or from a file. returns its size, or -1
+static int read_report(const char* name, int clear, uint8_t* buf) {
+    int fd = open(name, clear ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        return -1;
+    }
+    struct stat st;
+    int n;
+    if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode)) {
+        buf[0] = DIAG_REPORT_TRACE;
+        n = ioctl(fd, HIDIOCGFEATURE(REPORT_SIZE), buf);
+        if (n < 0)
+            perror("HIDIOCGFEATURE");
+        else if (clear) {
+            uint8_t c = DIAG_REPORT_TRACE;
+            if (ioctl(fd, HIDIOCSFEATURE(1), &c) < 0)
+                perror("HIDIOCSFEATURE");
+        }
+    } else {
+        n = read(fd, buf, REPORT_SIZE);
+        if (n < 0)
+            perror(name);
+    }
+    close(fd);
+    return n;
+}
+
+int main(int argc, char** argv) {
+    int clear = 0;
+    if (argc == 3 && !strcmp(argv[1], "-f"))
+        return follow(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "-r"))
+        return record(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "-c")) {
+        clear = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s [-c | -f | -r] /dev/hidrawN | file\n", argv[0]);
+        return 2;
+    }
+
+    uint8_t buf[REPORT_SIZE];
+    int n = read_report(argv[1], clear, buf);
+    if (n < 0)
+        return 1;
+    if (n != (int)REPORT_SIZE || buf[0] != DIAG_REPORT_TRACE) {
+        fprintf(stderr, "%s: expected a %u byte report %u, got %d bytes of report %u\n",
+                argv[1], (unsigned)REPORT_SIZE, DIAG_REPORT_TRACE, n, n > 0 ? buf[0] : 0);
+        return 1;
+    }
+
+    const uint8_t* r = buf + 1;
+    unsigned count = r[0] | r[1]<<8;
+    unsigned wrapped = r[2];
+    if (r[3] != TRACE_RECORDS) {
+        fprintf(stderr, "%s: the firmware's ring has %u records, but this tracedump was built for %u\n", argv[1], r[3], TRACE_RECORDS);
+        return 1;
+    }
+    const uint8_t* ring = r + 4;
+    unsigned first = wrapped ? count & (TRACE_RECORDS-1) : 0;
+    unsigned num = wrapped ? TRACE_RECORDS : count;
+
+    printf("%u records%s\n", num, wrapped ? " (the log has wrapped; older ones were lost)" : "");
+    for (unsigned i=0; i<num; i++)
+        print_record(ring + 4*((first+i) & (TRACE_RECORDS-1)));
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+#include <string.h>
+#include "trace.h"
+
+struct trace_report trace_log = { .size = TRACE_RECORDS };
+uint8_t trace_bytes;
+
+static uint16_t stream_pos; // trace_log.count as of the last record streamed
+
+uint8_t trace_get_report(uint8_t* buf) {
+    // copy it with interrupts off so we don't catch a record half written
+    uint8_t oldSREG = SREG;
+    cli();
+    memcpy(buf, &trace_log, sizeof(trace_log));
+    SREG = oldSREG;
+    return sizeof(trace_log);
+}
+
+void trace_clear(void) {
+    uint8_t oldSREG = SREG;
+    cli();
+    memset(&trace_log, 0, sizeof(trace_log));
+    trace_log.size = TRACE_RECORDS;
+    stream_pos = 0;
+    SREG = oldSREG;
+}
+
+uint8_t trace_get_stream_report(uint8_t* buf) {
+    struct trace_stream_report* rep = (struct trace_stream_report*)buf;
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t n = trace_log.count - stream_pos;
+    if (!n) {
+        SREG = oldSREG;
+        return 0;
+    }
+    uint8_t lost = 0;
+    if (n > TRACE_RECORDS) {
+        // nobody was reading and the ring went all the way around. skip to the oldest record still in it
+        lost = n - TRACE_RECORDS > 255 ? 255 : n - TRACE_RECORDS;
+        stream_pos = trace_log.count - TRACE_RECORDS;
+        n = TRACE_RECORDS;
+    }
+    if (n > TRACE_STREAM_RECORDS)
+        n = TRACE_STREAM_RECORDS;
+    for (uint8_t i=0; i<n; i++)
+        rep->records[i] = trace_log.ring[(stream_pos+i) & (TRACE_RECORDS-1)];
+    stream_pos += n;
+    SREG = oldSREG;
+    rep->lost = lost;
+    rep->num = n;
+    // (LUFA hands us a zeroed buffer, so the unused end of records[] goes out as 0s)
+    return sizeof(*rep);
+}
@@ -0,0 +1,128 @@
+/*
+ *  This file is part of ps2_kbd_to_usb_adapter,
+ *  copyright (c) 2014 Nicolas S. Dade
+ *
+ *  ps2_kbd_to_usb_adapter, is free software: you can redistribute it
+ *  and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  ps2_kbd_to_usb_adapter, is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with ps2_kbd_to_usb_adapter.  If not, see http://www.gnu.org/licenses/
+ *
+ */
+
+// the trace log
+//
+// trace(id, arg) appends a 4-byte record (which message, one byte of argument, and the time) to a
+// small ring buffer. it's cheap enough to call from an ISR, so it stays on all the time. The format
+// strings never make it into the firmware; they are listed here, and tools/tracedump uses this same
+// list to turn the records back into text on the host.
+// the host reads the ring with a GET_REPORT(Feature) on the diagnostics interface, or has new records streamed
+// to it as they happen on that interface's IN endpoint (see diag.h)
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the messages. each is X(id, printf format of the argument)
+// add new ones at the end, so that older dumps still decode
+#define TRACE_FORMATS(X) \
+    X(TRACE_NONE,           "") \
+    X(TRACE_UART_ERROR,     "UART error, UCSR1A 0x%02x") \
+    X(TRACE_RX_OVERFLOW,    "buffer[] full, lost 0x%02x") \
+    X(TRACE_PS2_READ,       "ps2_read() = 0x%02x") \
+    X(TRACE_PS2_WRITE,      "writing 0x%02x to the keyboard") \
+    X(TRACE_PS2_RETRY,      "retrying the write, try %u") \
+    X(TRACE_PS2_WRITE_DONE, "write finished, status %u") \
+    X(TRACE_PS2_REPLY,      "keyboard replied 0x%02x") \
+    X(TRACE_SCAN_SET,       "using scan code set %u") \
+    X(TRACE_PS2_BYTE,       "received 0x%02x") \
+    X(TRACE_LAYERS,         "layers on 0x%02x") \
+    X(TRACE_HELD,           "tap-hold key held, as 0x%02x") \
+    X(TRACE_TAPPED,         "tap-hold key tapped, as 0x%02x") \
+    X(TRACE_MOUSE_READY,    "mouse set up, wheel %u") \
+    X(TRACE_MOUSE_FAILED,   "mouse didn't take 0x%02x") \
+    X(TRACE_KBD2_READY,     "second keyboard set up, scan code set %u") \
+    X(TRACE_KBD2_FAILED,    "second keyboard didn't take 0x%02x") \
+    X(TRACE_KBD_RESET,      "keyboard reset itself, dropping %u queued commands") \
+
+#define TRACE_ENUM(id, fmt) id,
+enum { TRACE_FORMATS(TRACE_ENUM) TRACE_NUM_FORMATS };
+#undef TRACE_ENUM
+
+#define TRACE_RECORDS 32 // must be a power of 2
+
+struct trace_record {
+    uint8_t id;
+    uint8_t arg;
+    uint16_t time; // now_us16() (usec, wrapping every 65 msec)
+};
+
+// the feature report: the ring, and how many records have been written to it
+struct trace_report {
+    uint16_t count; // records written so far (wraps). the next one goes in ring[count % TRACE_RECORDS]
+    uint8_t wrapped; // non-zero once all TRACE_RECORDS records are valid
+    uint8_t size; // TRACE_RECORDS, so the decoder can check it agrees
+    struct trace_record ring[TRACE_RECORDS];
+};
+
+// the streamed input report: the records written since the previous one
+#define TRACE_STREAM_RECORDS 15 // as many as fit in a 64 byte packet along with the report ID
+struct trace_stream_report {
+    uint8_t lost; // how many records were overwritten before they could be sent (saturates at 255)
+    uint8_t num; // how many of records[] are valid
+    struct trace_record records[TRACE_STREAM_RECORDS];
+};
+
+#ifndef TRACE_DECODER // (the rest is for the firmware, not for tools/tracedump)
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "timebase.h"
+
+
+extern struct trace_report trace_log;
+extern uint8_t trace_bytes; // non-zero to trace every byte ps2_read() returns, for recording a replay trace (see host/replay.c)
+
+// record with a time other than now
+static inline void trace_at(uint8_t id, uint8_t arg, uint16_t time) {
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t n = trace_log.count;
+    struct trace_record* r = &trace_log.ring[n & (TRACE_RECORDS-1)];
+    r->id = id;
+    r->arg = arg;
+    r->time = time;
+    n++;
+    trace_log.count = n;
+    if (!(n & (TRACE_RECORDS-1)))
+        trace_log.wrapped = 1;
+    SREG = oldSREG;
+}
+
+static inline void trace(uint8_t id, uint8_t arg) {
+    trace_at(id, arg, now_us16());
+}
+
+uint8_t trace_get_report(uint8_t* buf); // fill in a struct trace_report; returns its size
+void trace_clear(void);
+uint8_t trace_get_stream_report(uint8_t* buf); // fill in a struct trace_stream_report with the records not yet streamed; returns 0 if there are none
+
+#endif
+
+#ifdef __cplusplus
+} // end of extern "C"
+#endif
+
+#endif